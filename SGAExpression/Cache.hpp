@@ -0,0 +1,152 @@
+#ifndef CACHE_HEADER
+#define CACHE_HEADER
+#include "Expression.hpp"
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+// Готовое к использованию выражение: разобранное, упрощенное и скомпилированное.
+// После помещения в кэш не изменяется, поэтому его можно читать из многих потоков сразу.
+// Для вычисления из нескольких потоков у каждого потока должны быть свои регистры: program.run(vals, regs).
+template <typename T> struct CachedExpression {
+    Expression<T> expression;
+    Program<T> program;
+    std::size_t bytes;
+};
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    std::size_t entries;
+    std::size_t bytes;
+};
+
+// Кэш выражений по исходному тексту с вытеснением давно не использованных (LRU).
+// Кэш разбит на сегменты со своими мьютексами, чтобы потоки с разными формулами не ждали друг друга.
+// Ограничение памяти делится между сегментами поровну, размер записи оценивается по числу нод и инструкций.
+template <typename T> class ExpressionCache {
+    private:
+        typedef std::pair<std::string, std::shared_ptr<const CachedExpression<T>>> Entry;
+        struct Shard {
+            std::mutex mutex;
+            std::list<Entry> order;
+            std::unordered_map<std::string, typename std::list<Entry>::iterator> index;
+            std::size_t bytes = 0;
+        };
+        std::vector<Shard> shards;
+        std::size_t shard_limit;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> evictions{0};
+        std::shared_ptr<const CachedExpression<T>> build(std::string_view source, const std::string &key, std::string &error) const;
+    public:
+        ExpressionCache(std::size_t memory_limit = 64 << 20, unsigned shards_count = 16);
+        static std::string normalise(std::string_view source);
+        std::shared_ptr<const CachedExpression<T>> get(std::string_view source);
+        std::shared_ptr<const CachedExpression<T>> get(std::string_view source, std::string &error);
+        CacheStats stats();
+        void clear();
+};
+
+template <typename T> ExpressionCache<T>::ExpressionCache(std::size_t memory_limit, unsigned shards_count) : shards(shards_count ? shards_count : 1) {
+    shard_limit = memory_limit / shards.size();
+}
+
+// Пробелы рядом со скобками и знаками операций не влияют на смысл формулы, поэтому "x+1" и "x + 1" - одна запись.
+// Между двумя другими символами пробел разделяет лексемы ("x 1" - не "x1", "2 x" - не "2x") и сжимается до одного.
+// Знак сразу после e или E может оказаться показателем числа ("1e-5"), поэтому пробелы вокруг него остаются.
+// Одинаковый ключ значит одинаковую последовательность лексем, но строится запись все равно из исходного текста.
+// Пробел - только ' ', как в Parser::skip_spaces: табуляция и перевод строки для парсера - ошибка и в ключе остаются.
+template <typename T> std::string ExpressionCache<T>::normalise(std::string_view source) {
+    auto is_space = [](char sym) { return sym == ' '; };
+    auto is_operator = [](char sym) { return sym == '(' || sym == ')' || sym == '+' || sym == '-' || sym == '*' || sym == '/' || sym == '^'; };
+    auto is_exponent = [](char sym) { return sym == 'e' || sym == 'E'; };
+    std::string key;
+    key.reserve(source.size());
+    for (std::size_t i = 0; i < source.size(); i++) {
+        if (!is_space(source[i])) {
+            key.push_back(source[i]);
+            continue;
+        }
+        while (i + 1 < source.size() && is_space(source[i + 1])) i++;
+        if (key.empty() || i + 1 == source.size()) continue;
+        char before = key.back(), after = source[i + 1];
+        bool sign_after = (after == '+' || after == '-') && is_exponent(before);
+        bool sign_before = (before == '+' || before == '-') && key.size() > 1 && is_exponent(key[key.size() - 2]);
+        if (sign_after || sign_before || (!is_operator(before) && !is_operator(after))) key.push_back(' ');
+    }
+    return key;
+}
+
+// Ошибка в формуле не завершает программу: build возвращает nullptr и текст ошибки.
+template <typename T> std::shared_ptr<const CachedExpression<T>> ExpressionCache<T>::build(std::string_view source, const std::string &key, std::string &error) const {
+    std::shared_ptr<CachedExpression<T>> entry = std::make_shared<CachedExpression<T>>();
+    bool built;
+    if constexpr (std::is_same_v<T, double>) built = construct_real(source, entry->expression, error);
+    else built = construct_complex(source, entry->expression, error);
+    if (!built || !entry->expression.simplify(error)) return nullptr;
+    entry->program = entry->expression.compile();
+    entry->bytes = sizeof(CachedExpression<T>) + 2 * key.size() + entry->expression.count_nodes() * 64
+        + entry->program.code.size() * sizeof(Instruction) + 2 * entry->program.registers_count() * sizeof(T);
+    return entry;
+}
+
+// Неверная формула дает nullptr и в кэш не попадает; текст ошибки - во втором варианте get.
+template <typename T> std::shared_ptr<const CachedExpression<T>> ExpressionCache<T>::get(std::string_view source) {
+    std::string error;
+    return get(source, error);
+}
+
+// Разбор и компиляция при промахе идут без блокировки: сегмент занят только на время поиска и вставки.
+template <typename T> std::shared_ptr<const CachedExpression<T>> ExpressionCache<T>::get(std::string_view source, std::string &error) {
+    std::string key = normalise(source);
+    Shard &shard = shards[std::hash<std::string>()(key) % shards.size()];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found != shard.index.end()) {
+            shard.order.splice(shard.order.begin(), shard.order, found->second);
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return found->second->second;
+        }
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+    std::shared_ptr<const CachedExpression<T>> entry = build(source, key, error);
+    if (!entry) return nullptr;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) return found->second->second;
+    shard.order.emplace_front(key, entry);
+    shard.index.emplace(key, shard.order.begin());
+    shard.bytes += entry->bytes;
+    while (shard.bytes > shard_limit && shard.order.size() > 1) {
+        shard.bytes -= shard.order.back().second->bytes;
+        shard.index.erase(shard.order.back().first);
+        shard.order.pop_back();
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    return entry;
+}
+
+template <typename T> CacheStats ExpressionCache<T>::stats() {
+    CacheStats result = {hits.load(), misses.load(), evictions.load(), 0, 0};
+    for (Shard &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        result.entries += shard.order.size();
+        result.bytes += shard.bytes;
+    }
+    return result;
+}
+
+template <typename T> void ExpressionCache<T>::clear() {
+    for (Shard &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.order.clear();
+        shard.index.clear();
+        shard.bytes = 0;
+    }
+}
+
+#endif
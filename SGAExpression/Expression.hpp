@@ -1,12 +1,26 @@
 #ifndef EXPRESSION_HEADER
 #define EXPRESSION_HEADER
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <type_traits>
 #include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <cstdint>
+#include <array>
+#include <bit>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include <vector>
 #include <iostream>
 #include <memory>
 #include <complex>
 #include <cmath>
+#include <numbers>
+#include <limits>
+#include <algorithm>
 
 // Вспомогательныые типы - перечисления, чтобы не плодить еще больше классов
 enum class NodeKind : char {op, func, var, val, head};
@@ -16,22 +30,23 @@ enum class Sign : bool {pos, neg};
 
 
 // Виртуальный базовый класс ноды дерева выражений.
-// Содержит одно поле - вид ноды, чтобы не проверять кастом.
-// Пока что я скорее верю, что не будет создан Operation с kind = var, например. В дальнейшем может исправлю.
+// Содержит одно поле - вид ноды, чтобы не проверять кастом. Набор подклассов закрыт (все они final), и вид ноды
+// однозначно задает ее класс: каждый конструктор ставит kind равным tag своего класса.
 template <typename T> class Node {
     public:
         NodeKind kind;
         Node() = default;
         virtual std::shared_ptr<Node<T>> clone() = 0;
         virtual Node<T>& substitute(std::string __name, T __value) = 0;
-        virtual T calculate() = 0;
+        virtual T calculate() const = 0;
         virtual std::string to_string() = 0;
         virtual ~Node() = default;
 };
 
 // Подкласс головы - вспомогательный, пригодится при вычислениях, так как в дереве удобно работать с потомками.
-template <typename T> class Head : public Node<T> {
+template <typename T> class Head final : public Node<T> {
     public:
+        static constexpr NodeKind tag = NodeKind::head;
         std::shared_ptr<Node<T>> next;
         Head();
         Head(const Head& other);
@@ -41,16 +56,17 @@ template <typename T> class Head : public Node<T> {
         Head<T>& operator=(const Head& other);
         Head<T>& operator=(Head&& other);
         Head<T>& substitute(std::string __name, T __value) override;
-        T calculate() override;
+        T calculate() const override;
         std::string to_string() override;
-        ~Head() = default;
+        ~Head();
 };
 
 // Далее идут подклассы ноды: операция, функция, переменная и число.
 
 // У операции есть три поля: тип операции, левый и правый операнды - указатели на две ноды.
-template <typename T> class Operation : public Node<T> {
+template <typename T> class Operation final : public Node<T> {
     public:
+        static constexpr NodeKind tag = NodeKind::op;
         OperationType type;
         std::shared_ptr<Node<T>> left;
         std::shared_ptr<Node<T>> right;
@@ -62,14 +78,15 @@ template <typename T> class Operation : public Node<T> {
         Operation<T>& operator=(const Operation<T> &other);
         Operation<T>& operator=(Operation<T> &&other);
         Operation<T>& substitute(std::string __name, T __value) override;
-        T calculate() override;
+        T calculate() const override;
         std::string to_string() override;
-        ~Operation() = default;
+        ~Operation();
 };
 
 // У функции есть два поля: тип и аргумент - указатель на ноду
-template <typename T> class Function : public Node<T> {
+template <typename T> class Function final : public Node<T> {
     public:
+        static constexpr NodeKind tag = NodeKind::func;
         FunctionType type;
         std::shared_ptr<Node<T>> arg;
         Function();
@@ -80,14 +97,15 @@ template <typename T> class Function : public Node<T> {
         Function<T>& operator=(const Function<T> &other);
         Function<T>& operator=(Function<T> &&other);
         Function<T>& substitute(std::string __name, T __value) override;
-        T calculate() override;
+        T calculate() const override;
         std::string to_string() override;
-        ~Function() = default;
+        ~Function();
 };
 
 // У переменной есть одно поле: её название
-template <typename T> class Variable : public Node<T> {
+template <typename T> class Variable final : public Node<T> {
     public:
+        static constexpr NodeKind tag = NodeKind::var;
         std::string name;
         Variable();
         Variable(const Variable<T> &other) = default;
@@ -97,14 +115,15 @@ template <typename T> class Variable : public Node<T> {
         Variable<T>& operator=(Variable<T> &other);
         Variable<T>& operator=(Variable<T> &&other);
         Variable<T>& substitute(std::string __name, T __value) override;
-        T calculate() override;
+        T calculate() const override;
         std::string to_string() override;
         ~Variable() = default;
 };
 
 // У числа есть одно поле: его значение
-template <typename T> class Value : public Node<T> {
+template <typename T> class Value final : public Node<T> {
     public:
+        static constexpr NodeKind tag = NodeKind::val;
         T value;
         Value();
         Value(const Value<T> &other) = default;
@@ -114,114 +133,513 @@ template <typename T> class Value : public Node<T> {
         Value<T>& operator=(Value<T> &other) = default;
         Value<T>& operator=(Value<T> &&other) = default;
         Value<T>& substitute(std::string __name, T __value) override;
-        T calculate() override;
+        T calculate() const override;
         std::string to_string() override;
         ~Value() = default;
 };
 
+// Разбор ноды по виду без RTTI. node_cast - static_cast к классу X, вид ноды проверяет вызывающий
+// (в отличие от dynamic_pointer_cast не трогает счетчик ссылок). visit_node выбирает обработчик по kind
+// и вызывает visitor с нодой уже нужного класса - перегрузка выбирается при компиляции, виртуальных вызовов нет.
+// Обработчики удобно собирать из лямбд: visit_node(node, node_handlers{[](Value<T> &) {...}, [](auto &) {...}}).
+template <typename... Handlers> struct node_handlers : Handlers... { using Handlers::operator()...; };
+template <typename... Handlers> node_handlers(Handlers...) -> node_handlers<Handlers...>;
+template <typename X, typename T> X* node_cast(Node<T>* node);
+template <typename X, typename T> const X* node_cast(const Node<T>* node);
+template <typename X, typename T> X* node_cast(const std::shared_ptr<Node<T>> &node);
+template <typename T, typename Visitor> decltype(auto) visit_node(Node<T>* node, Visitor &&visitor);
+template <typename T, typename Visitor> decltype(auto) visit_node(const Node<T>* node, Visitor &&visitor);
+
+// Коды инструкций байткода - те же операции и функции, что и в дереве, но в одном перечислении.
+enum class OpCode : char {add, sub, mult, div, pow, sin, cos, ln, exp};
+
+// Инструкция: код, регистр результата и регистры операндов (у функций right не используется).
+struct Instruction {
+    OpCode code;
+    unsigned dest;
+    unsigned left;
+    unsigned right;
+};
+
+// Скомпилированное выражение - линейный массив инструкций над файлом регистров.
+// Регистры устроены так: сначала слоты переменных, затем пул констант, затем значения общих поддеревьев DAG
+// (каждое вычисляется один раз и живет в своем регистре), затем временные значения.
+// Вычисление не делает ни одной аллокации: регистры выделяются один раз при компиляции.
+template <typename T> class Program {
+    private:
+        std::vector<T> registers;
+        unsigned temp_base = 0;
+        unsigned shared_next = 0;
+        std::unordered_map<const Node<T>*, unsigned> uses;
+        std::unordered_map<const Node<T>*, unsigned> lowered;
+        void count_uses(std::shared_ptr<Node<T>> node);
+        unsigned lower(std::shared_ptr<Node<T>> node, unsigned top);
+    public:
+        std::vector<Instruction> code;
+        std::vector<T> constants;
+        std::vector<std::string> slots;
+        unsigned shared = 0;
+        unsigned temporaries = 0;
+        unsigned result = 0;
+        Program() = default;
+        Program(std::shared_ptr<Node<T>> node, std::vector<std::string> __slots);
+        int slot(std::string __name) const;
+        unsigned registers_count() const;
+        std::vector<T> make_registers() const;
+        T run(const T* vals, T* regs) const;
+        T run(const T* vals);
+        T run(const std::vector<T> &vals);
+        static const unsigned block = 256;
+        std::vector<T> make_batch_registers() const;
+        void run_batch(const T* const* columns, T* out, std::size_t n, T* regs) const;
+        void run_batch(const std::vector<const T*> &columns, T* out, std::size_t n);
+    private:
+        std::vector<T> batch_registers;
+};
+
+// Ключ хранилища: по нему структурно одинаковые ноды находят друг друга.
+// Потомки сравниваются по адресу - они уже лежат в хранилище, поэтому одинаковые потомки это один и тот же объект.
+template <typename T> struct NodeKey {
+    NodeKind kind;
+    char type;
+    const Node<T>* left;
+    const Node<T>* right;
+    T value;
+    std::string name;
+    bool operator==(const NodeKey<T> &other) const;
+};
+
+template <typename T> struct NodeKeyHash {
+    std::size_t operator()(const NodeKey<T> &key) const;
+};
+
+// Хранилище нод с хэш-консингом: структурно одинаковые поддеревья хранятся в одном экземпляре, и выражение становится DAG.
+// Ноды из хранилища никогда не изменяются на месте, поэтому упрощение, подстановка и дифференцирование строят новые ноды,
+// запоминая результат для каждой уже обработанной ноды - общее поддерево обрабатывается один раз.
+// Хранилище со сверткой (folding = true) сворачивает операции и функции уже при создании: над двумя числами сразу
+// получается число, тождества с 0 и 1 не создают ноду вовсе. Выражения, собранные операторами в таком хранилище,
+// сразу минимальны, и отдельный проход simplify им не нужен.
+template <typename T> class NodeStore {
+    private:
+        bool folding = false;
+        std::unordered_map<NodeKey<T>, std::shared_ptr<Node<T>>, NodeKeyHash<T>> table;
+        std::unordered_set<const Node<T>*> members;
+        typedef std::unordered_map<const Node<T>*, std::shared_ptr<Node<T>>> Memo;
+        std::shared_ptr<Node<T>> insert(NodeKey<T> key, std::shared_ptr<Node<T>> node);
+        std::shared_ptr<Node<T>> intern(std::shared_ptr<Node<T>> node, Memo &memo);
+        std::shared_ptr<Node<T>> simplify(std::shared_ptr<Node<T>> node, Memo &memo, std::string *error);
+        std::shared_ptr<Node<T>> differentiate(std::shared_ptr<Node<T>> node, std::string __name, Memo &memo);
+        std::shared_ptr<Node<T>> bind(std::shared_ptr<Node<T>> node, const std::map<std::string, T> &values, bool fold, Memo &memo);
+    public:
+        NodeStore() = default;
+        NodeStore(bool __folding);
+        bool folds() const;
+        std::shared_ptr<Node<T>> value(T __value);
+        std::shared_ptr<Node<T>> variable(std::string __name);
+        std::shared_ptr<Node<T>> function(FunctionType __type, std::shared_ptr<Node<T>> __arg);
+        std::shared_ptr<Node<T>> operation(OperationType __type, std::shared_ptr<Node<T>> __left, std::shared_ptr<Node<T>> __right);
+        std::shared_ptr<Node<T>> intern(std::shared_ptr<Node<T>> node);
+        std::shared_ptr<Node<T>> simplify(std::shared_ptr<Node<T>> node, std::string *error = nullptr);
+        std::shared_ptr<Node<T>> differentiate(std::shared_ptr<Node<T>> node, std::string __name);
+        std::shared_ptr<Node<T>> bind(std::shared_ptr<Node<T>> node, const std::map<std::string, T> &values, bool fold = true);
+        std::size_t size() const;
+};
+
+template <typename T> class Expression;
+
+// Дуальное число: значение и N касательных. Вычисление выражения над дуальными числами дает вместе со значением
+// производные по N направлениям сразу (прямой режим автоматического дифференцирования).
+template <typename T, std::size_t N = 1> struct Dual {
+    T value;
+    std::array<T, N> tangent;
+    Dual();
+    Dual(T __value);
+    Dual(T __value, std::array<T, N> __tangent);
+};
+
+// Интервал [lower, upper], который гарантированно содержит все значения подвыражения, пока входы лежат в своих
+// интервалах. Границы округляются наружу, так что ошибки округления их не сужают. faults - какие ошибки могут
+// случиться где-то в подвыражении: деление на ноль, логарифм неположительного числа, дробная степень
+// отрицательного основания. Границы покрывают значения во всех точках, где ошибки нет; если таких точек нет
+// вовсе, границы - вся прямая. Только для вещественных T.
+template <typename T> struct Interval {
+    static constexpr unsigned char division = 1;
+    static constexpr unsigned char logarithm = 2;
+    static constexpr unsigned char power = 4;
+    T lower;
+    T upper;
+    unsigned char faults;
+    Interval();
+    Interval(T value);
+    Interval(T __lower, T __upper, unsigned char __faults = 0);
+    bool contains(T value) const;
+};
+
+// Значение выражения в точке и его частные производные по всем переменным.
+template <typename T> struct Gradient {
+    T value;
+    std::map<std::string, T> partials;
+};
+
+// Итог канонизации: число различных нод до и после, сколько проходов сделано и дошли ли до неподвижной точки.
+struct SimplifyReport {
+    std::size_t nodes_before;
+    std::size_t nodes_after;
+    unsigned rounds;
+    bool converged;
+};
+
+// Значение, градиент и матрица вторых производных. Строки и столбцы идут в порядке names (по алфавиту),
+// matrix - плотная симметричная матрица по строкам. passes - сколько проходов понадобилось.
+template <typename T> struct Hessian {
+    T value;
+    std::vector<std::string> names;
+    std::vector<T> gradient;
+    std::vector<T> matrix;
+    unsigned passes;
+};
+
+// Компактная запись ноды для плоского хранения. У операции и функции left и right - индексы потомков
+// (у функции right не используется), у числа left - индекс в пуле констант, у переменной - в таблице имен.
+struct FlatNode {
+    NodeKind kind;
+    char type;
+    uint32_t left;
+    uint32_t right;
+};
+
+// Плоское выражение: все ноды лежат одним массивом записей фиксированного размера в обратном польском порядке,
+// так что потомки всегда раньше родителя, а корень - последняя запись. Копирование - это копирование трех массивов,
+// уничтожение - освобождение трех блоков, а вычисление - один проход по массиву без рекурсии и виртуальных вызовов.
+template <typename T> class FlatExpression {
+    private:
+        uint32_t flatten(std::shared_ptr<Node<T>> node, std::unordered_map<const Node<T>*, uint32_t> &memo);
+        std::shared_ptr<Node<T>> expand(uint32_t index) const;
+        uint32_t name_index(std::string __name);
+    public:
+        std::vector<FlatNode> nodes;
+        std::vector<T> constants;
+        std::vector<std::string> names;
+        FlatExpression() = default;
+        FlatExpression(const Expression<T> &expr);
+        Expression<T> expand() const;
+        std::string to_string() const;
+        template <typename U> U evaluate(const U* vals, U* scratch) const;
+        template <typename U> std::vector<U> order(std::vector<std::string> vars, std::vector<U> vals) const;
+        T calculate(const T* vals, T* scratch) const;
+        T calculate(std::vector<std::string> vars, std::vector<T> vals) const;
+        template <typename U> U gradient(const U* vals, U* grad, U* scratch, U* adjoint) const;
+        std::vector<bool> hessian_pattern() const;
+        FlatExpression<T>& combine(OperationType __type, const FlatExpression<T> &other);
+        FlatExpression<T>& apply(FunctionType __type);
+        FlatExpression<T>& operator +=(const FlatExpression<T> &other);
+        FlatExpression<T> operator +(const FlatExpression<T> &other) const;
+        FlatExpression<T>& operator -=(const FlatExpression<T> &other);
+        FlatExpression<T> operator -(const FlatExpression<T> &other) const;
+        FlatExpression<T>& operator *=(const FlatExpression<T> &other);
+        FlatExpression<T> operator *(const FlatExpression<T> &other) const;
+        FlatExpression<T>& operator /=(const FlatExpression<T> &other);
+        FlatExpression<T> operator /(const FlatExpression<T> &other) const;
+        FlatExpression<T>& operator ^=(const FlatExpression<T> &other);
+        FlatExpression<T> operator ^(const FlatExpression<T> &other) const;
+};
+
+// Проход по плоской записи, лежащей где угодно: в FlatExpression или прямо в отображенном в память файле.
+// flat_step вычисляет одну запись по уже готовым значениям потомков в scratch, flat_evaluate - count записей подряд,
+// flat_expand собирает дерево с корнем в записи index, name(i) возвращает имя переменной номер i.
+template <typename T, typename U> U flat_step(const FlatNode &record, const T* constants, const U* vals, const U* scratch);
+template <typename T, typename U> U flat_evaluate(const FlatNode* nodes, uint32_t count, const T* constants, const U* vals, U* scratch);
+template <typename T, typename Name> std::shared_ptr<Node<T>> flat_expand(const FlatNode* nodes, uint32_t index, const T* constants, Name name);
+
 // Основной класс - выражение. Именно с ним и работает пользователь.
 // Он содержит указатель на вершину дерева выражений и множество называний переменных.
+// Ноды дерева общие между выражениями: копирование и арифметика не копируют поддеревья, а ссылаются на них, поэтому
+// стоят O(1) от размера дерева. Изменяющие дерево на месте simplify и self_substitute сначала забирают себе общие
+// ноды (копирование при записи), так что изменения одного выражения другие не видят.
 template <typename T> class Expression {
     private:
         std::unordered_set<std::string> variables = {};
+        template <typename U> std::vector<U> point_values(const FlatExpression<T> &flat, const std::map<std::string, U> &point) const;
     public:
         std::shared_ptr<Head<T>> head;
+        std::shared_ptr<NodeStore<T>> store;
         Expression() = default;
         Expression(T value);
         Expression(std::string var);
+        Expression(T value, std::shared_ptr<NodeStore<T>> __store);
+        Expression(std::string var, std::shared_ptr<NodeStore<T>> __store);
         Expression(std::shared_ptr<Head<T>> __head, std::unordered_set<std::string> __variables);
         Expression(const Expression<T> &other);
         Expression(Expression<T> &&other);
         Expression<T>& operator=(const Expression<T> &other);
         Expression<T>& operator=(Expression<T> &&other);
         Expression<T>& simplify();
+        bool simplify(std::string &error);
+        SimplifyReport canonicalize(unsigned budget = 8);
+        Expression<T>& share();
+        Expression<T>& share(std::shared_ptr<NodeStore<T>> __store);
+        std::size_t count_nodes() const;
         Expression<T>& self_substitute(std::string __name, T __value);
         std::unordered_set<std::string> get_variables() const;
         Expression<T> substitute(std::string __name, T __value) const;
+        Expression<T> bind(const std::map<std::string, T> &values) const;
         Expression<T> differentiate(std::string __name) const;
+        bool differentiate(std::string __name, Expression<T> &result, std::string &error) const;
         T calculate(std::vector<std::string> vars, std::vector<T> vals) const;
-        std::string to_string();
+        void calculate_batch(std::vector<std::string> vars, std::vector<const T*> columns, T* out, std::size_t n) const;
+        Program<T> compile() const;
+        Program<T> compile(std::vector<std::string> vars) const;
+        FlatExpression<T> flatten() const;
+        Gradient<T> gradient(const std::map<std::string, T> &point) const;
+        Interval<T> calculate_interval(const std::map<std::string, Interval<T>> &box) const;
+        template <std::size_t N> Dual<T, N> calculate_dual(std::vector<std::string> vars, std::vector<T> vals, std::vector<std::array<T, N>> tangents) const;
+        T derivative(std::string __name, std::vector<std::string> vars, std::vector<T> vals) const;
+        Hessian<T> hessian(const std::map<std::string, T> &point, bool sparse = false) const;
+        std::map<std::string, T> hessian_vector(const std::map<std::string, T> &point, const std::map<std::string, T> &direction) const;
+        std::string to_string() const;
+        template <typename Out> void write(Out &out) const;
+        Expression<T>& combine(OperationType __type, const Expression<T> &other);
+        Expression<T>& combine(OperationType __type, Expression<T> &&other);
         Expression<T>& operator +=(const Expression<T> &other);
-        Expression<T> operator +(const Expression<T> &other) const;
+        Expression<T>& operator +=(Expression<T> &&other);
+        Expression<T> operator +(const Expression<T> &other) const &;
+        Expression<T> operator +(const Expression<T> &other) &&;
+        Expression<T> operator +(Expression<T> &&other) const &;
+        Expression<T> operator +(Expression<T> &&other) &&;
         Expression<T>& operator -=(const Expression<T> &other);
-        Expression<T> operator -(const Expression<T> &other) const;
+        Expression<T>& operator -=(Expression<T> &&other);
+        Expression<T> operator -(const Expression<T> &other) const &;
+        Expression<T> operator -(const Expression<T> &other) &&;
+        Expression<T> operator -(Expression<T> &&other) const &;
+        Expression<T> operator -(Expression<T> &&other) &&;
         Expression<T>& operator *=(const Expression<T> &other);
-        Expression<T> operator *(const Expression<T> &other) const;
+        Expression<T>& operator *=(Expression<T> &&other);
+        Expression<T> operator *(const Expression<T> &other) const &;
+        Expression<T> operator *(const Expression<T> &other) &&;
+        Expression<T> operator *(Expression<T> &&other) const &;
+        Expression<T> operator *(Expression<T> &&other) &&;
         Expression<T>& operator /=(const Expression<T> &other);
-        Expression<T> operator /(const Expression<T> &other) const;
+        Expression<T>& operator /=(Expression<T> &&other);
+        Expression<T> operator /(const Expression<T> &other) const &;
+        Expression<T> operator /(const Expression<T> &other) &&;
+        Expression<T> operator /(Expression<T> &&other) const &;
+        Expression<T> operator /(Expression<T> &&other) &&;
         Expression<T>& operator ^=(const Expression<T> &other);
-        Expression<T> operator ^(const Expression<T> &other) const;
+        Expression<T>& operator ^=(Expression<T> &&other);
+        Expression<T> operator ^(const Expression<T> &other) const &;
+        Expression<T> operator ^(const Expression<T> &other) &&;
+        Expression<T> operator ^(Expression<T> &&other) const &;
+        Expression<T> operator ^(Expression<T> &&other) &&;
         ~Expression() = default;
         void display_variables() const;
 };
 
-template <typename T> std::ostream& operator<<(std::ostream &out, Expression<T> e);
+template <typename T> std::ostream& operator<<(std::ostream &out, const Expression<T> &e);
 template <typename T> Expression<T> sin(Expression<T> e);
 template <typename T> Expression<T> cos(Expression<T> e);
 template <typename T> Expression<T> ln(Expression<T> e);
 template <typename T> Expression<T> exp(Expression<T> e);
+template <typename T> FlatExpression<T> sin(FlatExpression<T> e);
+template <typename T> FlatExpression<T> cos(FlatExpression<T> e);
+template <typename T> FlatExpression<T> ln(FlatExpression<T> e);
+template <typename T> FlatExpression<T> exp(FlatExpression<T> e);
+
+// Обход дерева без рекурсии: стек явный и лежит в куче, поэтому глубина дерева ограничена только памятью.
+// enter вызывается при входе в ноду и решает, спускаться ли в потомков; leave - после потомков (левый раньше правого),
+// entered - что вернул enter. Результаты потомков обычно копятся в стеке, который ведет сам вызывающий.
+template <typename T, typename Enter, typename Leave> void walk_func(const std::shared_ptr<Node<T>> &root, Enter enter, Leave leave);
+
+// Вспомогательные функции: глубокое копирование, запись текста, вычисление и подстановка - все через явный стек.
+// write_func пишет в out: строку (дописывает в конец), поток или итератор вывода (итератор сдвигается).
+template <typename T> std::shared_ptr<Node<T>> clone_func(const std::shared_ptr<Node<T>> &node);
+
+// Замена общих с другими выражениями внутренних нод своими копиями перед изменением дерева на месте.
+template <typename T> void own_func(std::shared_ptr<Node<T>> &node);
+template <typename T, typename Out> void write_func(const Node<T>* node, Out &out);
+template <typename T> T calc_func(const std::shared_ptr<Node<T>> &node);
+template <typename T> void subst_func(Node<T>* node, const std::string &__name, T __value);
 
 // Вспомогательная функция дифференцирования ноды по указателю.
 template <typename T> std::shared_ptr<Node<T>> diff_func(std::shared_ptr<Node<T>> node, std::string __name);
 
+// Вспомогательная функция подсчета различных нод: общие поддеревья DAG считаются один раз.
+template <typename T> std::size_t count_func(std::shared_ptr<Node<T>> node, std::unordered_set<const Node<T>*> *seen);
+
 // Вспомогательная функция упрощения выражения.
-template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T>> node);
+template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T>> node, std::string *error = nullptr);
+
+// Свертка одной ноды, потомки которой уже упрощены: константы и тождества с 0 и 1. Деление на ноль и логарифм
+// отрицательного числа завершают программу, а если передан error - записываются в него, и нода остается как есть.
+template <typename T> std::shared_ptr<Node<T>> fold_func(std::shared_ptr<Node<T>> node, std::string *error = nullptr);
+
+// Одна операция или функция над уже вычисленными значениями.
+template <typename T> T calc_operation(OperationType type, T left, T right);
+template <typename T> T calc_function(FunctionType type, T arg);
+
+// Каноническая форма: сумма одночленов с числовыми коэффициентами и свободный член. Одночлен - произведение
+// оснований в числовых степенях. Одночлены и основания упорядочены по ключу - строке, одинаковой у равных выражений.
+template <typename T> struct Monomial {
+    std::map<std::string, std::pair<std::shared_ptr<Node<T>>, T>> factors;
+};
+
+template <typename T> struct Polynomial {
+    T constant = (T)0;
+    std::map<std::string, std::pair<T, Monomial<T>>> terms;
+};
+
+// Ключ вложенного многочлена (аргумента функции, основания в скобках) заменяется в ключе родителя номером "#n",
+// поэтому ключи не растут с глубиной и не копируются на каждом уровне. Номера общие для всех проходов canonicalize.
+struct CanonKeys {
+    std::unordered_map<std::string, std::size_t> ids;
+    std::string id(std::string key) {
+        std::size_t next = ids.size();
+        return "#" + std::to_string(ids.emplace(std::move(key), next).first->second);
+    }
+};
 
-//Вспомогательные ункции парсинга.
-void skip_spaces(std::string::iterator *it, std::string::iterator end);
-double parse_number(std::string::iterator *it, std::string::iterator end);
-std::string parse_string(std::string::iterator *it, std::string::iterator end);
-void skip_all(std::string::iterator *it, std::string::iterator end);
-void find_end(std::string::iterator *it, std::string::iterator end);
+// Вспомогательные функции канонизации: разбор дерева в сумму одночленов, ее ключ и сборка обратно в дерево.
+template <typename T> Polynomial<T> canon_func(std::shared_ptr<Node<T>> node, CanonKeys &keys);
+template <typename T> std::string canon_key(const Polynomial<T> &poly);
+template <typename T> std::shared_ptr<Node<T>> canon_build(const Polynomial<T> &poly);
+
+// Вспомогательная функция подстановки набора значений: строит новое дерево за один проход, сразу сворачивая константы.
+template <typename T> std::shared_ptr<Node<T>> bind_func(std::shared_ptr<Node<T>> node, const std::map<std::string, T> &values);
+
+// Парсер с приоритетами операторов: один проход слева направо по string_view, подстроки не копируются.
+// Приоритеты: + и - (1), * и / (2), ^ (3, правоассоциативная). Унарный минус слабее ^, но сильнее * и /,
+// а перед числом он просто делает число отрицательным. Число вплотную перед именем - неявное умножение ("3x", "-1sin(x)"),
+// так что вывод to_string читается обратно. Для комплексных чисел добавляется мнимая единица i и литералы вида 6i.
+// Рекурсии нет: операнды и отложенные операторы (вместе со скобками и функциями) лежат в двух стеках,
+// поэтому глубина вложенности скобок ограничена только памятью.
+template <typename T> class Parser {
+    private:
+        // Отложенный оператор: бинарный, унарный минус, неявное умножение на число value, открытая скобка или функция.
+        struct Pending {
+            enum Kind : char {binary, negate, scale, paren, function} kind;
+            char sym;
+            FunctionType type;
+            std::shared_ptr<Node<T>> value;
+        };
+        std::string_view input;
+        std::size_t pos = 0;
+        std::unordered_set<std::string> *vars;
+        std::vector<std::shared_ptr<Node<T>>> operands;
+        std::vector<Pending> operators;
+        unsigned open = 0;
+        std::string *error;
+        bool failed = false;
+        void skip_spaces();
+        bool at_word() const;
+        bool at_number() const;
+        std::string_view read_word();
+        std::shared_ptr<Node<T>> parse_number(bool negative);
+        void push_number(bool negative);
+        void push_word();
+        int strength(const Pending &pending) const;
+        void reduce();
+        std::shared_ptr<Node<T>> combine(char sym, std::shared_ptr<Node<T>> left, std::shared_ptr<Node<T>> right);
+        void fail(std::string message);
+        std::shared_ptr<Node<T>> fail_symbol(bool operand);
+    public:
+        Parser(std::string_view __input, std::unordered_set<std::string> *__vars, std::string *__error = nullptr);
+        std::shared_ptr<Node<T>> parse();
+};
 
 //Парсинг действительных выражений.
-std::shared_ptr<Node<double>> parse_real(std::string::iterator *it, std::string::iterator end, std::unordered_set<std::string> *vars);
+std::shared_ptr<Node<double>> parse_real(std::string_view input, std::unordered_set<std::string> *vars);
 
 //Парсинг комплексных выражений.
-std::shared_ptr<Node<std::complex<double>>> parse_complex(std::string::iterator *it, std::string::iterator end, std::unordered_set<std::string> *vars);
+std::shared_ptr<Node<std::complex<double>>> parse_complex(std::string_view input, std::unordered_set<std::string> *vars);
 
 //Функции создания выражения на основе строки.
-Expression<double> construct_real(std::string input);
-Expression<std::complex<double>> construct_complex(std::string input);
+Expression<double> construct_real(std::string_view input);
+Expression<std::complex<double>> construct_complex(std::string_view input);
+
+//Создание выражения без завершения программы: при ошибке в записи - false и ее текст в error.
+bool construct_real(std::string_view input, Expression<double> &result, std::string &error);
+bool construct_complex(std::string_view input, Expression<std::complex<double>> &result, std::string &error);
 
 template <typename T> void Expression<T>::display_variables() const {
     for (auto it = variables.begin(); it != variables.end(); it++) std::cout << *it << " ";
 }
 
-bool iszero(double number) {
+inline bool iszero(double number) {
     return std::abs(number) < 1e-6;
 }
 
-bool iszero(std::complex<double> number) {
+inline bool iszero(std::complex<double> number) {
     return std::abs(number) < 1e-6;
 }
 
-bool isone(double number) {
+inline bool isone(double number) {
     return std::abs(number - 1) < 1e-6;
 }
 
-bool isone(std::complex<double> number) {
+inline bool isone(std::complex<double> number) {
     return isone(number.real()) && iszero(number.imag());
 }
 
-bool isnegative(double number) {
+inline bool isnegative(double number) {
     return number < 1e-6;
 }
 
-bool isnegative(std::complex<double> number) {
+inline bool isnegative(std::complex<double> number) {
     return false;
 }
 
-std::string two_string(double number) {
-    char a[20];
-    sprintf(a, "%.15g", number);
-    return std::string(a);
+// Совпадение чисел побитово: в отличие от ==, 0.0 и -0.0 различаются (1 / x дает для них разные бесконечности),
+// а NaN совпадает сам с собой.
+inline bool same_bits(double a, double b) {
+    return std::bit_cast<uint64_t>(a) == std::bit_cast<uint64_t>(b);
+}
+
+inline bool same_bits(std::complex<double> a, std::complex<double> b) {
+    return same_bits(a.real(), b.real()) && same_bits(a.imag(), b.imag());
+}
+
+// Приемники текста: строка, поток и любой итератор вывода. Поток подходит и наследникам std::ostream.
+inline void write_text(std::string &out, const char* text, std::size_t length) {
+    out.append(text, length);
+}
+
+inline void write_text(std::ostream &out, const char* text, std::size_t length) {
+    out.write(text, (std::streamsize)length);
+}
+
+template <typename Out> requires (!std::is_base_of_v<std::ostream, Out>) void write_text(Out &out, const char* text, std::size_t length) {
+    out = std::copy(text, text + length, out);
+}
+
+// Числа форматируются через to_chars в буфер на стеке - так же, как printf("%.15g"), но без аллокаций и локали.
+template <typename Out> void write_number(Out &out, double number) {
+    char buffer[32];
+    std::to_chars_result written = std::to_chars(buffer, buffer + sizeof(buffer), number, std::chars_format::general, 15);
+    write_text(out, buffer, written.ptr - buffer);
+}
+
+template <typename Out> void write_number(Out &out, std::complex<double> number) {
+    if (iszero(number.imag())) return write_number(out, number.real());
+    if (iszero(number.real())) {
+        write_number(out, number.imag());
+        return write_text(out, "i", 1);
+    }
+    write_text(out, "(", 1);
+    write_number(out, number.real());
+    write_text(out, " + ", 3);
+    write_number(out, number.imag());
+    write_text(out, "i)", 2);
+}
+
+inline std::string two_string(double number) {
+    std::string result;
+    write_number(result, number);
+    return result;
 }
 
 template<typename T> std::string two_string(std::complex<T> number) {
-    if (iszero(number.imag())) return two_string(number.real());
-    if (iszero(number.real())) return two_string(number.imag()) + "i";
-    return "(" + two_string(number.real()) + " + " + two_string(number.imag()) + "i)";
+    std::string result;
+    write_number(result, std::complex<double>(number));
+    return result;
 }
 
 //---------------------------------------------------------------------------------------------------------------
@@ -241,15 +659,29 @@ template <typename T> Expression<T>::Expression(std::string var) {
     head = __head;
 }
 
+// Листья сразу берутся из хранилища: одинаковые числа и переменные - одна и та же нода.
+template <typename T> Expression<T>::Expression(T value, std::shared_ptr<NodeStore<T>> __store) {
+    store = std::move(__store);
+    head = std::make_shared<Head<T>>(store->value(value));
+}
+
+template <typename T> Expression<T>::Expression(std::string var, std::shared_ptr<NodeStore<T>> __store) {
+    variables.insert(var);
+    store = std::move(__store);
+    head = std::make_shared<Head<T>>(store->variable(var));
+}
+
+// Копия ссылается на то же дерево: ноды общие, своя у копии только голова.
 template <typename T> Expression<T>::Expression(const Expression<T>& other){
-    head = std::make_shared<Head<T>>(other.head->next->clone());
-    variables = other.get_variables();
+    head = std::make_shared<Head<T>>(other.head->next);
+    store = other.store;
+    variables = other.variables;
 }
 
 template <typename T> Expression<T>::Expression(Expression<T>&& other){
-    head = other.head;
-    other.head = nullptr;
-    variables = other.get_variables();
+    head = std::move(other.head);
+    store = std::move(other.store);
+    variables = std::move(other.variables);
 }
 
 template <typename T> Expression<T>::Expression(std::shared_ptr<Head<T>> __head, std::unordered_set<std::string> __variables) {
@@ -263,7 +695,7 @@ template <typename T> Head<T>::Head() {
 
 template <typename T> Head<T>::Head(const Head<T>& other) {
     Node<T>::kind = NodeKind::head;
-    next = other.next->clone();
+    next = clone_func(other.next);
 }
 
 template <typename T> Head<T>::Head(Head<T>&& other) {
@@ -284,8 +716,8 @@ template <typename T> Operation<T>::Operation() {
 template <typename T> Operation<T>::Operation(const Operation<T>& other) {
     Node<T>::kind = NodeKind::op;
     type = other.type;
-    left = other.left->clone();
-    right = other.right->clone();
+    left = clone_func(other.left);
+    right = clone_func(other.right);
 }
 
 template <typename T> Operation<T>::Operation(Operation<T>&& other) {
@@ -317,7 +749,7 @@ template <typename T> Function<T>::Function(FunctionType __type, std::shared_ptr
 template <typename T> Function<T>::Function(const Function<T>& other) {
     Node<T>::kind = NodeKind::func;
     type = other.type;
-    arg = other.arg->clone();
+    arg = clone_func(other.arg);
 }
 
 template <typename T> Function<T>::Function(Function<T>&& other) {
@@ -345,10 +777,177 @@ template <typename T> Value<T>::Value(T __value) {
     value = __value;
 }
 
+//---------------------------------------------------------------------------------------------------------------
+// Разбор нод по виду
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename X, typename T> X* node_cast(Node<T>* node) {
+    return static_cast<X*>(node);
+}
+
+template <typename X, typename T> const X* node_cast(const Node<T>* node) {
+    return static_cast<const X*>(node);
+}
+
+template <typename X, typename T> X* node_cast(const std::shared_ptr<Node<T>> &node) {
+    return static_cast<X*>(node.get());
+}
+
+// switch по kind компилятор превращает в таблицу переходов, а обработчики-лямбды встраивает в ветки.
+template <typename T, typename Visitor> decltype(auto) visit_node(Node<T>* node, Visitor &&visitor) {
+    switch (node->kind) {
+        case NodeKind::op: return visitor(*static_cast<Operation<T>*>(node));
+        case NodeKind::func: return visitor(*static_cast<Function<T>*>(node));
+        case NodeKind::var: return visitor(*static_cast<Variable<T>*>(node));
+        case NodeKind::val: return visitor(*static_cast<Value<T>*>(node));
+        default: return visitor(*static_cast<Head<T>*>(node));
+    }
+}
+
+template <typename T, typename Visitor> decltype(auto) visit_node(const Node<T>* node, Visitor &&visitor) {
+    switch (node->kind) {
+        case NodeKind::op: return visitor(*static_cast<const Operation<T>*>(node));
+        case NodeKind::func: return visitor(*static_cast<const Function<T>*>(node));
+        case NodeKind::var: return visitor(*static_cast<const Variable<T>*>(node));
+        case NodeKind::val: return visitor(*static_cast<const Value<T>*>(node));
+        default: return visitor(*static_cast<const Head<T>*>(node));
+    }
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Обход без рекурсии и освобождение нод
+//---------------------------------------------------------------------------------------------------------------
+
+// В стеке лежат адреса указателей на ноды (полей родителя), а не копии shared_ptr - обход не трогает счетчики ссылок.
+// Потомки кладутся в обратном порядке, чтобы левый был обработан раньше правого, как при рекурсии.
+template <typename T, typename Enter, typename Leave> void walk_func(const std::shared_ptr<Node<T>> &root, Enter enter, Leave leave) {
+    struct Frame {
+        const std::shared_ptr<Node<T>>* slot;
+        bool expanded;
+        bool entered;
+    };
+    std::vector<Frame> stack;
+    stack.reserve(32);
+    stack.push_back({&root, false, false});
+    while (!stack.empty()) {
+        Frame &frame = stack.back();
+        if (frame.expanded) {
+            const std::shared_ptr<Node<T>> &node = *frame.slot;
+            bool entered = frame.entered;
+            stack.pop_back();
+            leave(node, entered);
+            continue;
+        }
+        frame.expanded = true;
+        Node<T>* node = frame.slot->get();
+        frame.entered = enter(*frame.slot);
+        if (!frame.entered) continue;
+        if (node->kind == NodeKind::op) {
+            Operation<T>* operation = static_cast<Operation<T>*>(node);
+            stack.push_back({&operation->right, false, false});
+            stack.push_back({&operation->left, false, false});
+        }
+        else if (node->kind == NodeKind::func) stack.push_back({&static_cast<Function<T>*>(node)->arg, false, false});
+        else if (node->kind == NodeKind::head) stack.push_back({&static_cast<Head<T>*>(node)->next, false, false});
+    }
+}
+
+// Нода, на которую больше никто не ссылается и у которой есть потомки.
+template <typename T> bool owns_subtree(const std::shared_ptr<Node<T>> &node) {
+    return node && node.use_count() == 1 && (node->kind == NodeKind::op || node->kind == NodeKind::func || node->kind == NodeKind::head);
+}
+
+// Обычное разрушение цепочки из миллиона нод - миллион вложенных вызовов деструкторов и переполнение стека.
+// Поэтому нода не удаляет единственную ссылку на внутреннего потомка сама, а отдает потомков в список pending:
+// ноды из списка разбираются в цикле, и каждая удаляется, когда ее собственные потомки уже забраны.
+template <typename T> void release_func(std::vector<std::shared_ptr<Node<T>>> &pending) {
+    while (!pending.empty()) {
+        std::shared_ptr<Node<T>> node = std::move(pending.back());
+        pending.pop_back();
+        if (node->kind == NodeKind::op) {
+            Operation<T>* operation = static_cast<Operation<T>*>(node.get());
+            if (owns_subtree(operation->left)) pending.push_back(std::move(operation->left));
+            if (owns_subtree(operation->right)) pending.push_back(std::move(operation->right));
+        }
+        else if (node->kind == NodeKind::func) {
+            Function<T>* function = static_cast<Function<T>*>(node.get());
+            if (owns_subtree(function->arg)) pending.push_back(std::move(function->arg));
+        }
+        else if (node->kind == NodeKind::head) {
+            Head<T>* head = static_cast<Head<T>*>(node.get());
+            if (owns_subtree(head->next)) pending.push_back(std::move(head->next));
+        }
+    }
+}
+
+template <typename T> Head<T>::~Head() {
+    if (!owns_subtree(next)) return;
+    std::vector<std::shared_ptr<Node<T>>> pending;
+    pending.push_back(std::move(next));
+    release_func(pending);
+}
+
+template <typename T> Operation<T>::~Operation() {
+    if (!owns_subtree(left) && !owns_subtree(right)) return;
+    std::vector<std::shared_ptr<Node<T>>> pending;
+    if (owns_subtree(left)) pending.push_back(std::move(left));
+    if (owns_subtree(right)) pending.push_back(std::move(right));
+    release_func(pending);
+}
+
+template <typename T> Function<T>::~Function() {
+    if (!owns_subtree(arg)) return;
+    std::vector<std::shared_ptr<Node<T>>> pending;
+    pending.push_back(std::move(arg));
+    release_func(pending);
+}
+
 //---------------------------------------------------------------------------------------------------------------
 // Функции клонирования нод
 //---------------------------------------------------------------------------------------------------------------
 
+// Копии потомков копятся в стеке: нода забирает верхние копии и кладет на их место свою.
+template <typename T> std::shared_ptr<Node<T>> clone_func(const std::shared_ptr<Node<T>> &node) {
+    std::vector<std::shared_ptr<Node<T>>> copies;
+    walk_func<T>(node, [](const std::shared_ptr<Node<T>> &) { return true; }, [&](const std::shared_ptr<Node<T>> &current, bool) {
+        visit_node(current.get(), node_handlers{
+            [&](const Value<T> &value) { copies.push_back(std::make_shared<Value<T>>(value.value)); },
+            [&](const Variable<T> &variable) { copies.push_back(std::make_shared<Variable<T>>(variable.name)); },
+            [&](const Function<T> &function) { copies.back() = std::make_shared<Function<T>>(function.type, std::move(copies.back())); },
+            [&](const Operation<T> &operation) {
+                std::shared_ptr<Node<T>> right = std::move(copies.back());
+                copies.pop_back();
+                copies.back() = std::make_shared<Operation<T>>(operation.type, std::move(copies.back()), std::move(right));
+            },
+            [](const Head<T> &) {}
+        });
+    });
+    return copies.back();
+}
+
+// Ноды одного дерева могут входить в несколько выражений, поэтому перед изменением на месте выражение забирает
+// дерево себе: внутренняя нода, на которую ссылается кто-то еще, заменяется копией своего поддерева. Нода с
+// единственной ссылкой от уже своего родителя - тоже своя, и спускаться дальше нужно только по таким нодам.
+// Листья не копируются: их не меняют, а заменяют в поле родителя.
+template <typename T> void own_func(std::shared_ptr<Node<T>> &node) {
+    std::vector<std::shared_ptr<Node<T>>*> stack = {&node};
+    while (!stack.empty()) {
+        std::shared_ptr<Node<T>> &slot = *stack.back();
+        stack.pop_back();
+        if (slot->kind == NodeKind::val || slot->kind == NodeKind::var) continue;
+        if (slot.use_count() > 1) {
+            slot = clone_func(slot);
+            continue;
+        }
+        if (slot->kind == NodeKind::op) {
+            Operation<T>* operation = node_cast<Operation<T>>(slot);
+            stack.push_back(&operation->right);
+            stack.push_back(&operation->left);
+        }
+        else if (slot->kind == NodeKind::func) stack.push_back(&node_cast<Function<T>>(slot)->arg);
+    }
+}
+
 template <typename T> std::shared_ptr<Node<T>> Head<T>::clone() {
     std::cerr << "Something went wrong, head is an inner node of the tree.\n";
     exit(-1);
@@ -356,12 +955,12 @@ template <typename T> std::shared_ptr<Node<T>> Head<T>::clone() {
 }
 
 template <typename T> std::shared_ptr<Node<T>> Operation<T>::clone() {
-    std::shared_ptr<Node<T>> copy = std::make_shared<Operation<T>>(type, left->clone(), right->clone());
+    std::shared_ptr<Node<T>> copy = std::make_shared<Operation<T>>(type, clone_func(left), clone_func(right));
     return copy;
 }
 
 template <typename T> std::shared_ptr<Node<T>> Function<T>::clone() {
-    std::shared_ptr<Node<T>> copy = std::make_shared<Function<T>>(type, arg->clone());
+    std::shared_ptr<Node<T>> copy = std::make_shared<Function<T>>(type, clone_func(arg));
     return copy;
 }
 
@@ -380,21 +979,22 @@ template <typename T> std::shared_ptr<Node<T>> Value<T>::clone() {
 //---------------------------------------------------------------------------------------------------------------
 
 template <typename T> Expression<T>& Expression<T>::operator=(const Expression<T>& other){
-    head = std::make_shared<Head<T>>(other->head);
-    variables = other.get_variables();
+    head = std::make_shared<Head<T>>(other.head->next);
+    store = other.store;
+    variables = other.variables;
     return *this;
 }
 
 template <typename T> Expression<T>& Expression<T>::operator=(Expression<T>&& other){
-    head = other.head;
-    other.head = nullptr;
-    variables = other.get_variables();
+    head = std::move(other.head);
+    store = std::move(other.store);
+    variables = std::move(other.variables);
     return *this;
 }
 
 template <typename T> Head<T>& Head<T>::operator=(const Head& other) {
     Node<T>::kind = NodeKind::head;
-    next = other.next->clone();
+    next = clone_func(other.next);
     return *this;
 }
 
@@ -407,13 +1007,15 @@ template <typename T> Head<T>& Head<T>::operator=(Head&& other) {
 
 template <typename T> Operation<T>& Operation<T>::operator=(const Operation<T>& other) {
     Node<T>::kind = NodeKind::op;
-    left = other.left->clone();
-    right = other.right->clone();
+    type = other.type;
+    left = clone_func(other.left);
+    right = clone_func(other.right);
     return *this;
 }
 
 template <typename T> Operation<T>& Operation<T>::operator=(Operation<T>&& other) {
     Node<T>::kind = NodeKind::op;
+    type = other.type;
     left = other.left;
     right = other.right;
     other.left = nullptr;
@@ -422,13 +1024,15 @@ template <typename T> Operation<T>& Operation<T>::operator=(Operation<T>&& other
 }
 
 template <typename T> Function<T>& Function<T>::operator=(const Function<T>& other) {
-    Node<T>::kind = NodeKind::var;
-    arg = other.arg->clone();
+    Node<T>::kind = NodeKind::func;
+    type = other.type;
+    arg = clone_func(other.arg);
     return *this;
 }
 
 template <typename T> Function<T>& Function<T>::operator=(Function<T>&& other) {
-    Node<T>::kind = NodeKind::var;
+    Node<T>::kind = NodeKind::func;
+    type = other.type;
     arg = other.arg;
     other.arg = nullptr;
     return *this;
@@ -438,70 +1042,113 @@ template <typename T> Function<T>& Function<T>::operator=(Function<T>&& other) {
 // Функции преобразования в строку и вывода (пока что ставлю лишние скобки, позже улучшу)
 //---------------------------------------------------------------------------------------------------------------
 
-template <typename T> std::string Expression<T>::to_string(){
-    return head->to_string();
-}
-
-template <typename T> std::string Head<T>::to_string(){
-    return next->to_string();
+template <typename T> std::string Expression<T>::to_string() const {
+    std::string out;
+    write_func<T>(head.get(), out);
+    return out;
 }
 
-template <typename T> std::string Operation<T>::to_string(){
-    std::string sym;
-    if (type == OperationType::add) {
-        return left->to_string() + " + " + right->to_string();
-    }
-    if (type == OperationType::sub) {
-        if (right->kind != NodeKind::op) return left->to_string() + " - " + right->to_string();
-        if (std::dynamic_pointer_cast<Operation<T>>(right)->type != OperationType::add 
-        && std::dynamic_pointer_cast<Operation<T>>(right)->type != OperationType::sub) return left->to_string() + " - " + right->to_string();
-        return left->to_string() + " - (" + right->to_string() + ")";
-    }
-    if (type == OperationType::mult) {
-        if (left->kind == NodeKind::val && (right->kind == NodeKind::var || right->kind == NodeKind::func)) return left->to_string() + right->to_string();
-        if (left->kind != NodeKind::op) {
-            if (right->kind != NodeKind::op) {
-                return left->to_string() + " * " + right->to_string();
-            }
-            else if (std::dynamic_pointer_cast<Operation<T>>(right)->type == OperationType::mult) return left->to_string() + " * " + right->to_string();
-            else return left->to_string() + " * (" + right->to_string() + ")";
+// Дописывает запись выражения в out: в конец строки (ее можно переиспользовать как буфер), в поток или через итератор.
+template <typename T> template <typename Out> void Expression<T>::write(Out &out) const {
+    write_func<T>(head.get(), out);
+}
+
+// Запись идет в один приемник out по стеку заданий: задание - либо нода, либо готовый кусок текста (скобка или знак).
+// Открывающая скобка и имя функции пишутся сразу, остальное кладется в стек в обратном порядке.
+// Каждая нода печатается один раз, без склеивания промежуточных строк, поэтому время линейно по длине результата.
+// Стек заданий свой у каждого потока и переиспользуется между вызовами, поэтому запись в строку с уже выделенной
+// памятью (или в поток) не делает ни одной аллокации.
+template <typename T, typename Out> void write_func(const Node<T>* node, Out &out) {
+    struct Item {
+        const Node<T>* node;
+        const char* text;
+        std::size_t length;
+    };
+    auto is_mult = [](const Node<T>* operand) {
+        return operand->kind == NodeKind::op && static_cast<const Operation<T>*>(operand)->type == OperationType::mult;
+    };
+    thread_local std::vector<Item> stack;
+    stack.clear();
+    stack.push_back({node, nullptr, 0});
+    while (!stack.empty()) {
+        Item item = stack.back();
+        stack.pop_back();
+        if (item.text) {
+            write_text(out, item.text, item.length);
+            continue;
         }
-        else if (right->kind != NodeKind::op) {
-            if (std::dynamic_pointer_cast<Operation<T>>(left)->type == OperationType::mult) return left->to_string() + " * " + right->to_string();
-            else return "(" + left->to_string() + ") * " + right->to_string();
+        const Node<T>* current = item.node;
+        if (current->kind == NodeKind::val) write_number(out, static_cast<const Value<T>*>(current)->value);
+        else if (current->kind == NodeKind::var) {
+            const std::string &name = static_cast<const Variable<T>*>(current)->name;
+            write_text(out, name.data(), name.size());
         }
-        else if (std::dynamic_pointer_cast<Operation<T>>(left)->type == OperationType::mult 
-            && std::dynamic_pointer_cast<Operation<T>>(right)->type == OperationType::mult) 
-            return left->to_string() + " * " + right->to_string();
-        else return "(" + left->to_string() + ") * (" + right->to_string() + ")";
-    }
-    if (type == OperationType::div) {
-        if (left->kind != NodeKind::op) {
-            if (right->kind != NodeKind::op) return left->to_string() + " / " + right->to_string();
-            else return left->to_string() + " / (" + right->to_string() + ")";
+        else if (current->kind == NodeKind::head) stack.push_back({static_cast<const Head<T>*>(current)->next.get(), nullptr, 0});
+        else if (current->kind == NodeKind::func) {
+            const Function<T>* function = static_cast<const Function<T>*>(current);
+            if (function->type == FunctionType::sin) write_text(out, "sin(", 4);
+            if (function->type == FunctionType::cos) write_text(out, "cos(", 4);
+            if (function->type == FunctionType::ln) write_text(out, "ln(", 3);
+            if (function->type == FunctionType::exp) write_text(out, "exp(", 4);
+            stack.push_back({nullptr, ")", 1});
+            stack.push_back({function->arg.get(), nullptr, 0});
         }
-        else if (right->kind != NodeKind::op) return "(" + left->to_string() + ") / " + right->to_string();
-        return "(" + left->to_string() + ") / (" + right->to_string() + ")";
-    }
-    if (type == OperationType::pow) {
-        if (left->kind != NodeKind::op) {
-            if (right->kind != NodeKind::op) return left->to_string() + " ^ " + right->to_string();
-            else return left->to_string() + " ^ (" + right->to_string() + ")";
+        else {
+            const Operation<T>* operation = static_cast<const Operation<T>*>(current);
+            const Node<T>* left = operation->left.get();
+            const Node<T>* right = operation->right.get();
+            bool left_op = left->kind == NodeKind::op, right_op = right->kind == NodeKind::op;
+            bool wrap_left = false, wrap_right = false;
+            const char* sym = nullptr;
+            if (operation->type == OperationType::add) sym = " + ";
+            else if (operation->type == OperationType::sub) {
+                sym = " - ";
+                OperationType inner = right_op ? static_cast<const Operation<T>*>(right)->type : OperationType::mult;
+                wrap_right = inner == OperationType::add || inner == OperationType::sub;
+            }
+            else if (operation->type == OperationType::mult) {
+                sym = " * ";
+                if (left->kind == NodeKind::val && (right->kind == NodeKind::var || right->kind == NodeKind::func)) sym = "";
+                else if (!left_op) wrap_right = right_op && !is_mult(right);
+                else if (!right_op) wrap_left = !is_mult(left);
+                else wrap_left = wrap_right = !(is_mult(left) && is_mult(right));
+            }
+            else if (operation->type == OperationType::div || operation->type == OperationType::pow) {
+                sym = operation->type == OperationType::div ? " / " : " ^ ";
+                wrap_left = left_op;
+                wrap_right = right_op;
+            }
+            else {
+                std::cerr << "Something went horribly wrong, an operation has no type!\n";
+                exit(EXIT_FAILURE);
+            }
+            if (wrap_right) stack.push_back({nullptr, ")", 1});
+            stack.push_back({right, nullptr, 0});
+            if (wrap_right) stack.push_back({nullptr, "(", 1});
+            if (*sym) stack.push_back({nullptr, sym, 3});
+            if (wrap_left) stack.push_back({nullptr, ")", 1});
+            stack.push_back({left, nullptr, 0});
+            if (wrap_left) write_text(out, "(", 1);
         }
-        else if (right->kind != NodeKind::op) return "(" + left->to_string() + ") ^ " + right->to_string();
-        return "(" + left->to_string() + ") ^ (" + right->to_string() + ")";
     }
-    std::cerr << "Something went horribly wrong, an operation has no type!\n Its left and right operands are: " << left->to_string() << " " << right->to_string();
-    exit(EXIT_FAILURE);
+}
+
+template <typename T> std::string Head<T>::to_string(){
+    std::string out;
+    write_func<T>(this, out);
+    return out;
+}
+
+template <typename T> std::string Operation<T>::to_string(){
+    std::string out;
+    write_func<T>(this, out);
+    return out;
 }
 
 template <typename T> std::string Function<T>::to_string(){
-    std::string sym;
-    if (type == FunctionType::sin) sym = "sin(";
-    if (type == FunctionType::cos) sym = "cos(";
-    if (type == FunctionType::ln) sym = "ln(";
-    if (type == FunctionType::exp) sym = "exp(";
-    return sym + arg->to_string() + ")";
+    std::string out;
+    write_func<T>(this, out);
+    return out;
 }
 
 template <typename T> std::string Variable<T>::to_string(){
@@ -512,8 +1159,8 @@ template <typename T> std::string Value<T>::to_string(){
     return two_string(value);
 }
 
-template <typename T> std::ostream& operator<<(std::ostream &out, Expression<T> e) {
-    out << e.to_string();
+template <typename T> std::ostream& operator<<(std::ostream &out, const Expression<T> &e) {
+    e.write(out);
     return out;
 }
 
@@ -521,74 +1168,174 @@ template <typename T> std::ostream& operator<<(std::ostream &out, Expression<T>
 // Арифметические операции
 //---------------------------------------------------------------------------------------------------------------
 
-template <typename T> Expression<T>& Expression<T>::operator +=(const Expression<T> &other) {
-    std::shared_ptr<Expression<T>> copy = std::make_shared<Expression<T>>(other);
-    std::shared_ptr<Operation<T>> op = std::make_shared<Operation<T>>(OperationType::add, head->next, copy->head->next);
-    variables.merge(copy->get_variables());
-    head->next = op;
+// Новая операция ссылается на корни обоих операндов, ничего не копируя. Из временного операнда забирается и
+// множество переменных. Если хранилище есть только у правого операнда, результат переходит в его хранилище.
+template <typename T> Expression<T>& Expression<T>::combine(OperationType __type, const Expression<T> &other) {
+    if (!store && other.store) share(other.store);
+    if (store) head->next = store->operation(__type, head->next, store->intern(other.head->next));
+    else head->next = std::make_shared<Operation<T>>(__type, head->next, other.head->next);
+    if (&other != this) variables.insert(other.variables.begin(), other.variables.end());
     return *this;
 }
 
-template <typename T> Expression<T> Expression<T>::operator +(const Expression<T> &other) const {
+template <typename T> Expression<T>& Expression<T>::combine(OperationType __type, Expression<T> &&other) {
+    if (&other == this) return combine(__type, static_cast<const Expression<T>&>(other));
+    if (!store && other.store) share(other.store);
+    if (store) head->next = store->operation(__type, head->next, store->intern(other.head->next));
+    else head->next = std::make_shared<Operation<T>>(__type, head->next, std::move(other.head->next));
+    if (variables.size() < other.variables.size()) std::swap(variables, other.variables);
+    variables.merge(other.variables);
+    return *this;
+}
+
+template <typename T> Expression<T>& Expression<T>::operator +=(const Expression<T> &other) {
+    return combine(OperationType::add, other);
+}
+
+template <typename T> Expression<T>& Expression<T>::operator +=(Expression<T> &&other) {
+    return combine(OperationType::add, std::move(other));
+}
+
+template <typename T> Expression<T> Expression<T>::operator +(const Expression<T> &other) const & {
     Expression<T> copy(*this);
-    copy += other;
+    copy.combine(OperationType::add, other);
     return copy;
 }
 
+template <typename T> Expression<T> Expression<T>::operator +(const Expression<T> &other) && {
+    combine(OperationType::add, other);
+    return std::move(*this);
+}
+
+template <typename T> Expression<T> Expression<T>::operator +(Expression<T> &&other) const & {
+    Expression<T> copy(*this);
+    copy.combine(OperationType::add, std::move(other));
+    return copy;
+}
+
+template <typename T> Expression<T> Expression<T>::operator +(Expression<T> &&other) && {
+    combine(OperationType::add, std::move(other));
+    return std::move(*this);
+}
+
 template <typename T> Expression<T>& Expression<T>::operator -=(const Expression<T> &other) {
-    std::shared_ptr<Expression<T>> copy = std::make_shared<Expression<T>>(other);
-    std::shared_ptr<Operation<T>> op = std::make_shared<Operation<T>>(OperationType::sub, head->next, copy->head->next);
-    variables.merge(copy->get_variables());
-    head->next = op;
-    return *this;
+    return combine(OperationType::sub, other);
+}
+
+template <typename T> Expression<T>& Expression<T>::operator -=(Expression<T> &&other) {
+    return combine(OperationType::sub, std::move(other));
+}
+
+template <typename T> Expression<T> Expression<T>::operator -(const Expression<T> &other) const & {
+    Expression<T> copy(*this);
+    copy.combine(OperationType::sub, other);
+    return copy;
+}
+
+template <typename T> Expression<T> Expression<T>::operator -(const Expression<T> &other) && {
+    combine(OperationType::sub, other);
+    return std::move(*this);
 }
 
-template <typename T> Expression<T> Expression<T>::operator -(const Expression<T> &other) const {
+template <typename T> Expression<T> Expression<T>::operator -(Expression<T> &&other) const & {
     Expression<T> copy(*this);
-    copy -= other;
+    copy.combine(OperationType::sub, std::move(other));
     return copy;
 }
 
+template <typename T> Expression<T> Expression<T>::operator -(Expression<T> &&other) && {
+    combine(OperationType::sub, std::move(other));
+    return std::move(*this);
+}
+
 template <typename T> Expression<T>& Expression<T>::operator *=(const Expression<T> &other) {
-    std::shared_ptr<Expression<T>> copy = std::make_shared<Expression<T>>(other);
-    std::shared_ptr<Operation<T>> op = std::make_shared<Operation<T>>(OperationType::mult, head->next, copy->head->next);
-    variables.merge(copy->get_variables());
-    head->next = op;
-    return *this;
+    return combine(OperationType::mult, other);
+}
+
+template <typename T> Expression<T>& Expression<T>::operator *=(Expression<T> &&other) {
+    return combine(OperationType::mult, std::move(other));
+}
+
+template <typename T> Expression<T> Expression<T>::operator *(const Expression<T> &other) const & {
+    Expression<T> copy(*this);
+    copy.combine(OperationType::mult, other);
+    return copy;
+}
+
+template <typename T> Expression<T> Expression<T>::operator *(const Expression<T> &other) && {
+    combine(OperationType::mult, other);
+    return std::move(*this);
 }
 
-template <typename T> Expression<T> Expression<T>::operator *(const Expression<T> &other) const {
+template <typename T> Expression<T> Expression<T>::operator *(Expression<T> &&other) const & {
     Expression<T> copy(*this);
-    copy *= other;
+    copy.combine(OperationType::mult, std::move(other));
     return copy;
 }
 
+template <typename T> Expression<T> Expression<T>::operator *(Expression<T> &&other) && {
+    combine(OperationType::mult, std::move(other));
+    return std::move(*this);
+}
+
 template <typename T> Expression<T>& Expression<T>::operator /=(const Expression<T> &other) {
-    std::shared_ptr<Expression<T>> copy = std::make_shared<Expression<T>>(other);
-    std::shared_ptr<Operation<T>> op = std::make_shared<Operation<T>>(OperationType::div, head->next, copy->head->next);
-    variables.merge(copy->get_variables());
-    head->next = op;
-    return *this;
+    return combine(OperationType::div, other);
+}
+
+template <typename T> Expression<T>& Expression<T>::operator /=(Expression<T> &&other) {
+    return combine(OperationType::div, std::move(other));
+}
+
+template <typename T> Expression<T> Expression<T>::operator /(const Expression<T> &other) const & {
+    Expression<T> copy(*this);
+    copy.combine(OperationType::div, other);
+    return copy;
+}
+
+template <typename T> Expression<T> Expression<T>::operator /(const Expression<T> &other) && {
+    combine(OperationType::div, other);
+    return std::move(*this);
 }
 
-template <typename T> Expression<T> Expression<T>::operator /(const Expression<T> &other) const {
+template <typename T> Expression<T> Expression<T>::operator /(Expression<T> &&other) const & {
     Expression<T> copy(*this);
-    copy /= other;
-    return copy;    
+    copy.combine(OperationType::div, std::move(other));
+    return copy;
+}
+
+template <typename T> Expression<T> Expression<T>::operator /(Expression<T> &&other) && {
+    combine(OperationType::div, std::move(other));
+    return std::move(*this);
 }
 
 template <typename T> Expression<T>& Expression<T>::operator ^=(const Expression<T> &other) {
-    std::shared_ptr<Expression<T>> copy = std::make_shared<Expression<T>>(other);
-    std::shared_ptr<Operation<T>> op = std::make_shared<Operation<T>>(OperationType::pow, head->next, copy->head->next);
-    variables.merge(copy->get_variables());
-    head->next = op;
-    return *this;
+    return combine(OperationType::pow, other);
+}
+
+template <typename T> Expression<T>& Expression<T>::operator ^=(Expression<T> &&other) {
+    return combine(OperationType::pow, std::move(other));
+}
+
+template <typename T> Expression<T> Expression<T>::operator ^(const Expression<T> &other) const & {
+    Expression<T> copy(*this);
+    copy.combine(OperationType::pow, other);
+    return copy;
+}
+
+template <typename T> Expression<T> Expression<T>::operator ^(const Expression<T> &other) && {
+    combine(OperationType::pow, other);
+    return std::move(*this);
 }
 
-template <typename T> Expression<T> Expression<T>::operator ^(const Expression<T> &other) const {
+template <typename T> Expression<T> Expression<T>::operator ^(Expression<T> &&other) const & {
     Expression<T> copy(*this);
-    copy ^= other;
-    return copy;    
+    copy.combine(OperationType::pow, std::move(other));
+    return copy;
+}
+
+template <typename T> Expression<T> Expression<T>::operator ^(Expression<T> &&other) && {
+    combine(OperationType::pow, std::move(other));
+    return std::move(*this);
 }
 
 //---------------------------------------------------------------------------------------------------------------
@@ -596,86 +1343,106 @@ template <typename T> Expression<T> Expression<T>::operator ^(const Expression<T
 //---------------------------------------------------------------------------------------------------------------
 
 template <typename T> Expression<T> sin(Expression<T> e) {
-    Expression<T> copy(e);
-    std::shared_ptr<Function<T>> func = std::make_shared<Function<T>>(FunctionType::sin, copy.head->next);
-    copy.head->next = func;
-    return copy;
+    if (e.store) e.head->next = e.store->function(FunctionType::sin, e.head->next);
+    else e.head->next = std::make_shared<Function<T>>(FunctionType::sin, std::move(e.head->next));
+    return e;
 }
 
 template <typename T> Expression<T> cos(Expression<T> e) {
-    Expression<T> copy(e);
-    std::shared_ptr<Function<T>> func = std::make_shared<Function<T>>(FunctionType::cos, copy.head->next);
-    copy.head->next = func;
-    return copy;
+    if (e.store) e.head->next = e.store->function(FunctionType::cos, e.head->next);
+    else e.head->next = std::make_shared<Function<T>>(FunctionType::cos, std::move(e.head->next));
+    return e;
 }
 
 template <typename T> Expression<T> ln(Expression<T> e) {
-    Expression<T> copy(e);
-    std::shared_ptr<Function<T>> func = std::make_shared<Function<T>>(FunctionType::ln, copy.head->next);
-    copy.head->next = func;
-    return copy;
+    if (e.store) e.head->next = e.store->function(FunctionType::ln, e.head->next);
+    else e.head->next = std::make_shared<Function<T>>(FunctionType::ln, std::move(e.head->next));
+    return e;
 }
 
 template <typename T> Expression<T> exp(Expression<T> e) {
-    Expression<T> copy(e);
-    std::shared_ptr<Function<T>> func = std::make_shared<Function<T>>(FunctionType::exp, copy.head->next);
-    copy.head->next = func;
-    return *copy;
+    if (e.store) e.head->next = e.store->function(FunctionType::exp, e.head->next);
+    else e.head->next = std::make_shared<Function<T>>(FunctionType::exp, std::move(e.head->next));
+    return e;
 }
 
 //---------------------------------------------------------------------------------------------------------------
 // Функция упрощения
 //---------------------------------------------------------------------------------------------------------------
 
-template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T>> node) {
-    if (node->kind == NodeKind::head) {
-        std::shared_ptr<Head<T>> head = std::dynamic_pointer_cast<Head<T>>(node);
-        head->next = simpl_func(head->next);
-    }
-    else if (node->kind == NodeKind::func) {
-        std::shared_ptr<Function<T>> function = std::dynamic_pointer_cast<Function<T>>(node);
-        function->arg = simpl_func(function->arg);
+// Потомки упрощаются раньше родителя: их результаты копятся в стеке, родитель забирает их на место своих потомков
+// и сворачивается сам.
+template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T>> node, std::string *error) {
+    std::vector<std::shared_ptr<Node<T>>> results;
+    walk_func<T>(node, [](const std::shared_ptr<Node<T>> &) { return true; }, [&](const std::shared_ptr<Node<T>> &current, bool) {
+        visit_node(current.get(), node_handlers{
+            [&](Head<T> &head) {
+                head.next = std::move(results.back());
+                results.back() = current;
+            },
+            [&](Function<T> &function) {
+                function.arg = std::move(results.back());
+                results.back() = fold_func(current, error);
+            },
+            [&](Operation<T> &operation) {
+                operation.right = std::move(results.back());
+                results.pop_back();
+                operation.left = std::move(results.back());
+                results.back() = fold_func(current, error);
+            },
+            [&](auto &) { results.push_back(current); }
+        });
+    });
+    return results.back();
+}
+
+template <typename T> std::shared_ptr<Node<T>> fold_func(std::shared_ptr<Node<T>> node, std::string *error) {
+    if (node->kind == NodeKind::func) {
+        Function<T>* function = node_cast<Function<T>>(node);
         if (function->type == FunctionType::ln) {
             if (function->arg->kind == NodeKind::val) {
-                std::shared_ptr<Value<T>> value = std::dynamic_pointer_cast<Value<T>>(function->arg);
+                Value<T>* value = node_cast<Value<T>>(function->arg);
                 if (isnegative(value->value)) {
-                    std::cerr << "Logarithm of a negative value!";
-                    exit(EXIT_FAILURE);
+                    if (!error) {
+                        std::cerr << "Logarithm of a negative value!";
+                        exit(EXIT_FAILURE);
+                    }
+                    if (error->empty()) *error = "Logarithm of a negative value!";
+                    return node;
                 }
             }
         }
         if (function->arg->kind == NodeKind::val) {
-            std::shared_ptr<Node<T>> value = std::make_shared<Value<T>>(function->calculate());
+            std::shared_ptr<Node<T>> value = std::make_shared<Value<T>>(calc_function(function->type, node_cast<Value<T>>(function->arg)->value));
             node = value;
         }
     }
     else if (node->kind == NodeKind::op) {
-        std::shared_ptr<Operation<T>> operation = std::dynamic_pointer_cast<Operation<T>>(node);
-        operation->left = simpl_func(operation->left);
-        operation->right = simpl_func(operation->right);
+        Operation<T>* operation = node_cast<Operation<T>>(node);
         if (operation->right->kind == NodeKind::val) {
-            std::shared_ptr<Value<T>> right_value = std::dynamic_pointer_cast<Value<T>>(operation->right);
+            Value<T>* right_value = node_cast<Value<T>>(operation->right);
             if (operation->type == OperationType::div && iszero(right_value->value)) {
-                std::cerr << "Division by zero!";
-                exit(EXIT_FAILURE);
+                if (!error) {
+                    std::cerr << "Division by zero!";
+                    exit(EXIT_FAILURE);
+                }
+                if (error->empty()) *error = "Division by zero!";
             }
             else if (operation->left->kind == NodeKind::val) {
-                std::shared_ptr<Node<T>> value = std::make_shared<Value<T>>(operation->calculate());
+                std::shared_ptr<Node<T>> value = std::make_shared<Value<T>>(calc_operation(operation->type, node_cast<Value<T>>(operation->left)->value, right_value->value));
                 node = value;
             }
             else if (isone(right_value->value)) {
                 if (operation->type == OperationType::mult || 
                     operation->type == OperationType::pow || 
                     operation->type == OperationType::div) {
-                    std::shared_ptr<Node<T>> left = operation->left->clone();
-                    node = left;
+                    node = operation->left;
                 }
             }
             else if (iszero(right_value->value)) {
                 if (operation->type == OperationType::add ||
                     operation->type == OperationType::sub) {
-                    std::shared_ptr<Node<T>> left = operation->left->clone();
-                    node = left;
+                    node = operation->left;
                 }
                 if (operation->type == OperationType::mult) {
                     std::shared_ptr<Node<T>> zero = std::make_shared<Value<T>>((T)0);
@@ -688,11 +1455,10 @@ template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T
             }
         } 
         else if (operation->left->kind == NodeKind::val) {
-            std::shared_ptr<Value<T>> left_value = std::dynamic_pointer_cast<Value<T>>(operation->left);
+            Value<T>* left_value = node_cast<Value<T>>(operation->left);
             if (isone(left_value->value)) {
                 if (operation->type == OperationType::mult) {
-                    std::shared_ptr<Node<T>> right = operation->right->clone();
-                    node = right;
+                    node = operation->right;
                 }
                 else if (operation->type == OperationType::pow) {
                     std::shared_ptr<Node<T>> one = std::make_shared<Value<T>>((T)1);
@@ -700,10 +1466,11 @@ template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T
                 }
             }
             else if (iszero(left_value->value)) {
-                if (operation->type == OperationType::add ||
-                    operation->type == OperationType::sub) {
-                    std::shared_ptr<Node<T>> right = operation->right->clone();
-                    node = right;
+                if (operation->type == OperationType::add) {
+                    node = operation->right;
+                }
+                else if (operation->type == OperationType::sub) {
+                    node = std::make_shared<Operation<T>>(OperationType::mult, std::make_shared<Value<T>>((T)-1), operation->right);
                 }
                 else if (operation->type == OperationType::mult || 
                     operation->type == OperationType::pow || 
@@ -714,8 +1481,7 @@ template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T
             }
             else if (isone(left_value->value)) {
                 if (operation->type == OperationType::mult) {
-                    std::shared_ptr<Node<T>> right = operation->right->clone();
-                    node = right;
+                    node = operation->right;
                 }
                 else if (operation->type == OperationType::pow) {
                     std::shared_ptr<Node<T>> one = std::make_shared<Value<T>>((T)1);
@@ -727,127 +1493,467 @@ template <typename T> std::shared_ptr<Node<T>> simpl_func(std::shared_ptr<Node<T
     return node;
 }
 
+// Свертка до создания ноды: во что превратится функция или операция над готовыми потомками, или nullptr, если
+// ноду нужно создавать. Правила те же, что у fold_func, но ни одной лишней ноды не выделяется, а числа создает
+// make_value (в хранилище - через него). Деление на ноль и логарифм отрицательного числа не сворачиваются:
+// ошибку по-прежнему сообщит simplify, а не построение выражения.
+template <typename T, typename MakeValue> std::shared_ptr<Node<T>> fold_function(FunctionType type, const std::shared_ptr<Node<T>> &arg, MakeValue make_value) {
+    if (arg->kind != NodeKind::val) return nullptr;
+    T number = node_cast<Value<T>>(arg)->value;
+    if (type == FunctionType::ln && isnegative(number)) return nullptr;
+    return make_value(calc_function(type, number));
+}
+
+template <typename T, typename MakeValue> std::shared_ptr<Node<T>> fold_operation(OperationType type, const std::shared_ptr<Node<T>> &left,
+    const std::shared_ptr<Node<T>> &right, MakeValue make_value) {
+    if (right->kind == NodeKind::val) {
+        T number = node_cast<Value<T>>(right)->value;
+        if (type == OperationType::div && iszero(number)) return nullptr;
+        if (left->kind == NodeKind::val) return make_value(calc_operation(type, node_cast<Value<T>>(left)->value, number));
+        if (isone(number) && (type == OperationType::mult || type == OperationType::pow || type == OperationType::div)) return left;
+        if (iszero(number)) {
+            if (type == OperationType::add || type == OperationType::sub) return left;
+            if (type == OperationType::mult) return make_value((T)0);
+            if (type == OperationType::pow) return make_value((T)1);
+        }
+    }
+    else if (left->kind == NodeKind::val) {
+        T number = node_cast<Value<T>>(left)->value;
+        if (isone(number)) {
+            if (type == OperationType::mult) return right;
+            if (type == OperationType::pow) return make_value((T)1);
+        }
+        else if (iszero(number)) {
+            if (type == OperationType::add) return right;
+            if (type == OperationType::mult || type == OperationType::pow || type == OperationType::div) return make_value((T)0);
+        }
+    }
+    return nullptr;
+}
+
 template <typename T> Expression<T>& Expression<T>::simplify() {
-    head = std::dynamic_pointer_cast<Head<T>>(simpl_func(std::dynamic_pointer_cast<Node<T>>(head)));
+    if (store) {
+        head->next = store->simplify(head->next);
+        return *this;
+    }
+    own_func(head->next);
+    head = std::static_pointer_cast<Head<T>>(simpl_func(std::static_pointer_cast<Node<T>>(head)));
     return *this;
 }
 
+// Для входа, которому нельзя доверять (сервер): деление на ноль и логарифм отрицательного числа не завершают
+// программу, а дают false и текст первой такой ошибки. Выражение при этом упрощено не до конца.
+template <typename T> bool Expression<T>::simplify(std::string &error) {
+    error.clear();
+    if (store) head->next = store->simplify(head->next, &error);
+    else {
+        own_func(head->next);
+        head = std::static_pointer_cast<Head<T>>(simpl_func(std::static_pointer_cast<Node<T>>(head), &error));
+    }
+    return error.empty();
+}
+
 //---------------------------------------------------------------------------------------------------------------
-// Функции подстановки и вычисления
+// Канонизация
 //---------------------------------------------------------------------------------------------------------------
 
-template <typename T> std::unordered_set<std::string> Expression<T>::get_variables() const {
-    return variables;
+// В отличие от simplify, смотрит не на соседние ноды, а на целые цепочки + и *: цепочка раскладывается в сумму
+// одночленов, подобные слагаемые складываются, одинаковые основания в произведении складывают степени,
+// а вычитание и деление становятся коэффициентом -1 и степенью -1 - поэтому двойное отрицание пропадает само.
+// Скобки не раскрываются: сумма внутри произведения остается одним основанием.
+// Проходы повторяются, пока ключ результата не перестанет меняться, но не больше budget раз.
+// Как и любая компьютерная алгебра, x / x превращается в 1 - точки, где выражение не определено, теряются.
+template <typename T> SimplifyReport Expression<T>::canonicalize(unsigned budget) {
+    SimplifyReport report = {count_nodes(), 0, 0, false};
+    std::shared_ptr<Node<T>> node = head->next;
+    std::string key;
+    CanonKeys keys;
+    while (report.rounds < budget) {
+        Polynomial<T> poly = canon_func(node, keys);
+        std::string next = canon_key(poly);
+        node = canon_build(poly);
+        report.rounds++;
+        if (next == key) {
+            report.converged = true;
+            break;
+        }
+        key = next;
+    }
+    head->next = store ? store->intern(node) : node;
+    report.nodes_after = count_nodes();
+    return report;
 }
 
-template <typename T> Expression<T>& Expression<T>::self_substitute(std::string __name, T __value) {
-    auto pos = variables.begin();
-    while(pos != variables.end() && *pos != __name) pos++;
-    if (pos == variables.end()) {
-        std::cerr <<"\"" << __name << "\" - no such variable!";
-        exit(EXIT_FAILURE);
-    }
-    variables.erase(pos);
-    head->substitute(__name, __value);
-    return *this;
+template <typename T> bool canon_negative(T number) {
+    if constexpr (std::is_same_v<T, double>) return number < 0;
+    else return number.imag() == 0 && number.real() < 0;
 }
 
-template <typename T> Expression<T> Expression<T>::substitute(std::string __name, T __value) const {
-    Expression<T> copy = *this;
-    copy.self_substitute(__name, __value);
-    return copy;
+template <typename T> bool canon_integer(T number) {
+    if constexpr (std::is_same_v<T, double>) return number == std::round(number);
+    else return number.imag() == 0 && number.real() == std::round(number.real());
 }
 
-template <typename T> T Expression<T>::calculate(std::vector<std::string> vars, std::vector<T> vals) const {
-    if (vars.size() > vals.size()) {
-        std::cerr << "More variables than values!";
-        exit(EXIT_FAILURE);
-    }
-    else if (vars.size() < vals.size()) {
-        std::cerr << "More values than variables!";
-        exit(EXIT_FAILURE);
+// Число в ключе - кратчайшая запись, которая читается обратно в то же число. two_string печатает 15 знаков,
+// и с ним разные константы давали бы одинаковые ключи и складывались как подобные слагаемые.
+template <typename T> std::string canon_number(T number) {
+    if constexpr (std::is_same_v<T, double>) {
+        char buffer[32];
+        return std::string(buffer, std::to_chars(buffer, buffer + sizeof(buffer), number).ptr);
     }
-    Expression<T> copy = *this;
-    auto itval = vals.begin();
-    for (auto it = vars.begin(); it < vars.end(); it++) {
-        if (copy.get_variables().find(*it) != copy.get_variables().end()) {
-            copy.self_substitute(*it, *itval);
+    else return canon_number(number.real()) + "," + canon_number(number.imag()) + "i";
+}
+
+template <typename T> std::string canon_key(const Monomial<T> &mono) {
+    std::string key;
+    for (auto it = mono.factors.begin(); it != mono.factors.end(); it++) {
+        if (!key.empty()) key += "*";
+        key += it->first;
+        if (it->second.second != (T)1) key += "^" + canon_number(it->second.second);
+    }
+    return key;
+}
+
+template <typename T> std::string canon_key(const Polynomial<T> &poly) {
+    std::string key;
+    for (auto it = poly.terms.begin(); it != poly.terms.end(); it++) key += canon_number(it->second.first) + "*" + it->first + "+";
+    return key + canon_number(poly.constant);
+}
+
+template <typename T> Polynomial<T> canon_constant(T value) {
+    Polynomial<T> poly;
+    poly.constant = value;
+    return poly;
+}
+
+template <typename T> Polynomial<T> canon_term(T coefficient, const Monomial<T> &mono) {
+    Polynomial<T> poly;
+    if (coefficient == (T)0) return poly;
+    if (mono.factors.empty()) return canon_constant(coefficient);
+    poly.terms[canon_key(mono)] = {coefficient, mono};
+    return poly;
+}
+
+template <typename T> Polynomial<T> canon_atom(std::shared_ptr<Node<T>> node, std::string key, T exponent) {
+    Monomial<T> mono;
+    mono.factors[key] = {node, exponent};
+    return canon_term((T)1, mono);
+}
+
+// Многочлен как одно слагаемое: коэффициент и одночлен. Если слагаемых несколько, вся сумма становится основанием.
+template <typename T> std::pair<T, Monomial<T>> canon_single(const Polynomial<T> &poly, CanonKeys &keys) {
+    if (poly.terms.empty()) return {poly.constant, Monomial<T>()};
+    if (poly.terms.size() == 1 && poly.constant == (T)0) return poly.terms.begin()->second;
+    Monomial<T> mono;
+    mono.factors["(" + keys.id(canon_key(poly)) + ")"] = {canon_build(poly), (T)1};
+    return {(T)1, mono};
+}
+
+template <typename T> Polynomial<T> canon_add(Polynomial<T> left, const Polynomial<T> &right, T sign) {
+    left.constant += sign * right.constant;
+    for (auto it = right.terms.begin(); it != right.terms.end(); it++) {
+        auto found = left.terms.find(it->first);
+        if (found == left.terms.end()) left.terms[it->first] = {sign * it->second.first, it->second.second};
+        else if ((found->second.first += sign * it->second.first) == (T)0) left.terms.erase(found);
+    }
+    return left;
+}
+
+template <typename T> Polynomial<T> canon_multiply(const Polynomial<T> &left, const Polynomial<T> &right, CanonKeys &keys) {
+    std::pair<T, Monomial<T>> a = canon_single(left, keys), b = canon_single(right, keys);
+    for (auto it = b.second.factors.begin(); it != b.second.factors.end(); it++) {
+        auto found = a.second.factors.find(it->first);
+        if (found == a.second.factors.end()) a.second.factors.insert(*it);
+        else if ((found->second.second += it->second.second) == (T)0) a.second.factors.erase(found);
+    }
+    return canon_term(a.first * b.first, a.second);
+}
+
+// Целая степень раскрывается внутрь одночлена: (2x * y ^ 2) ^ 3 = 8x ^ 3 * y ^ 6. Дробная - только для
+// одиночного основания в первой степени, иначе (x ^ 2) ^ 0.5 превратилось бы в x вместо |x|.
+template <typename T> Polynomial<T> canon_power(const Polynomial<T> &base, T exponent, CanonKeys &keys) {
+    if (exponent == (T)0) return canon_constant((T)1);
+    std::pair<T, Monomial<T>> single = canon_single(base, keys);
+    if (single.second.factors.empty()) return canon_constant(std::pow(single.first, exponent));
+    bool plain = single.first == (T)1 && single.second.factors.size() == 1 && single.second.factors.begin()->second.second == (T)1;
+    if (!canon_integer(exponent) && !plain) {
+        std::shared_ptr<Node<T>> node = canon_build(base);
+        return canon_atom(node, "(" + keys.id(canon_key(base)) + ")", exponent);
+    }
+    for (auto it = single.second.factors.begin(); it != single.second.factors.end(); it++) it->second.second *= exponent;
+    return canon_term((T)std::pow(single.first, exponent), single.second);
+}
+
+// Многочлены потомков копятся в стеке и забираются перемещением, так что длинная сумма не копируется на каждом шаге.
+template <typename T> Polynomial<T> canon_func(std::shared_ptr<Node<T>> node, CanonKeys &keys) {
+    std::vector<Polynomial<T>> results;
+    walk_func<T>(node, [](const std::shared_ptr<Node<T>> &) { return true; }, [&](const std::shared_ptr<Node<T>> &current, bool) {
+        if (current->kind == NodeKind::val) results.push_back(canon_constant(node_cast<Value<T>>(current)->value));
+        else if (current->kind == NodeKind::var) results.push_back(canon_atom(current, node_cast<Variable<T>>(current)->name, (T)1));
+        else if (current->kind == NodeKind::func) {
+            Function<T>* function = node_cast<Function<T>>(current);
+            Polynomial<T> arg = std::move(results.back());
+            std::shared_ptr<Node<T>> result = fold_func<T>(std::make_shared<Function<T>>(function->type, canon_build(arg)));
+            if (result->kind == NodeKind::val) {
+                results.back() = canon_constant(node_cast<Value<T>>(result)->value);
+                return;
+            }
+            std::string sym;
+            if (function->type == FunctionType::sin) sym = "sin(";
+            if (function->type == FunctionType::cos) sym = "cos(";
+            if (function->type == FunctionType::ln) sym = "ln(";
+            if (function->type == FunctionType::exp) sym = "exp(";
+            results.back() = canon_atom(result, sym + keys.id(canon_key(arg)) + ")", (T)1);
+        }
+        else if (current->kind == NodeKind::op) {
+            Operation<T>* operation = node_cast<Operation<T>>(current);
+            Polynomial<T> right = std::move(results.back());
+            results.pop_back();
+            Polynomial<T> left = std::move(results.back());
+            Polynomial<T> &result = results.back();
+            if (operation->type == OperationType::add) result = canon_add(std::move(left), right, (T)1);
+            else if (operation->type == OperationType::sub) result = canon_add(std::move(left), right, (T)-1);
+            else if (operation->type == OperationType::mult) result = canon_multiply(left, right, keys);
+            else if (operation->type == OperationType::div) {
+                if (right.terms.empty() && right.constant == (T)0) {
+                    std::cerr << "Division by zero!";
+                    exit(EXIT_FAILURE);
+                }
+                result = canon_multiply(left, canon_power(right, (T)-1, keys), keys);
+            }
+            else if (right.terms.empty()) result = canon_power(left, right.constant, keys);
+            else {
+                std::shared_ptr<Node<T>> power = std::make_shared<Operation<T>>(OperationType::pow, canon_build(left), canon_build(right));
+                result = canon_atom(power, "(" + keys.id(canon_key(left)) + ")^(" + keys.id(canon_key(right)) + ")", (T)1);
+            }
         }
         else {
-            std::cerr <<"\"" << *it << "\" - no such variable!";
+            std::cerr << "Something went wrong, head is an inner node of the tree.\n";
             exit(EXIT_FAILURE);
         }
-        itval++;
+    });
+    return std::move(results.back());
+}
+
+// Одночлен собирается дробью: основания с отрицательной степенью уходят в знаменатель, коэффициент - в числитель.
+template <typename T> std::shared_ptr<Node<T>> canon_build(T coefficient, const Monomial<T> &mono) {
+    std::shared_ptr<Node<T>> numerator, denominator;
+    if (coefficient != (T)1) numerator = std::make_shared<Value<T>>(coefficient);
+    for (auto it = mono.factors.begin(); it != mono.factors.end(); it++) {
+        bool inverse = canon_negative(it->second.second);
+        T exponent = inverse ? -it->second.second : it->second.second;
+        std::shared_ptr<Node<T>> factor = it->second.first;
+        if (exponent != (T)1) factor = std::make_shared<Operation<T>>(OperationType::pow, factor, std::make_shared<Value<T>>(exponent));
+        std::shared_ptr<Node<T>> &side = inverse ? denominator : numerator;
+        side = side ? std::make_shared<Operation<T>>(OperationType::mult, side, factor) : factor;
     }
-    copy.simplify();
-    return copy.head->calculate();
+    if (!numerator) numerator = std::make_shared<Value<T>>((T)1);
+    if (!denominator) return numerator;
+    return std::make_shared<Operation<T>>(OperationType::div, numerator, denominator);
+}
+
+// Сначала слагаемые с положительным коэффициентом, затем вычитаются отрицательные, свободный член - в конце.
+template <typename T> std::shared_ptr<Node<T>> canon_build(const Polynomial<T> &poly) {
+    std::shared_ptr<Node<T>> result;
+    for (auto it = poly.terms.begin(); it != poly.terms.end(); it++) {
+        if (canon_negative(it->second.first)) continue;
+        std::shared_ptr<Node<T>> term = canon_build(it->second.first, it->second.second);
+        result = result ? std::make_shared<Operation<T>>(OperationType::add, result, term) : term;
+    }
+    bool leading = !result && !canon_negative(poly.constant) && poly.constant != (T)0;
+    if (leading) result = std::make_shared<Value<T>>(poly.constant);
+    for (auto it = poly.terms.begin(); it != poly.terms.end(); it++) {
+        if (!canon_negative(it->second.first)) continue;
+        if (!result) {
+            result = canon_build(it->second.first, it->second.second);
+            continue;
+        }
+        result = std::make_shared<Operation<T>>(OperationType::sub, result, canon_build(-it->second.first, it->second.second));
+    }
+    if (!result) return std::make_shared<Value<T>>(poly.constant);
+    if (poly.constant == (T)0 || leading) return result;
+    if (canon_negative(poly.constant)) return std::make_shared<Operation<T>>(OperationType::sub, result, std::make_shared<Value<T>>(-poly.constant));
+    return std::make_shared<Operation<T>>(OperationType::add, result, std::make_shared<Value<T>>(poly.constant));
 }
 
-template <typename T> Head<T>& Head<T>::substitute(std::string __name, T __value) {
-    if (next->kind == NodeKind::var) {
-        std::shared_ptr<Variable<T>> nextvar = std::dynamic_pointer_cast<Variable<T>>(next);
-        if (nextvar->name == __name) {
-            std::shared_ptr<Value<T>> __next = std::make_shared<Value<T>>(__value);
-            next = __next;
-        }
+//---------------------------------------------------------------------------------------------------------------
+// Функции подстановки и вычисления
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T> std::unordered_set<std::string> Expression<T>::get_variables() const {
+    return variables;
+}
+
+template <typename T> Expression<T>& Expression<T>::self_substitute(std::string __name, T __value) {
+    auto pos = variables.begin();
+    while(pos != variables.end() && *pos != __name) pos++;
+    if (pos == variables.end()) {
+        std::cerr <<"\"" << __name << "\" - no such variable!";
+        exit(EXIT_FAILURE);
+    }
+    variables.erase(pos);
+    if (store) head->next = store->bind(head->next, {{__name, __value}}, false);
+    else {
+        own_func(head->next);
+        head->substitute(__name, __value);
     }
-    else next->substitute(__name, __value);
     return *this;
 }
 
-template <typename T> T Head<T>::calculate() {
-    return next->calculate();
+template <typename T> Expression<T> Expression<T>::substitute(std::string __name, T __value) const {
+    Expression<T> copy = *this;
+    copy.self_substitute(__name, __value);
+    return copy;
 }
 
-template <typename T> Operation<T>& Operation<T>::substitute(std::string __name, T __value) {
-    if (left->kind == NodeKind::var) {
-        std::shared_ptr<Variable<T>> leftvar = std::dynamic_pointer_cast<Variable<T>>(left);
-        if (leftvar->name == __name) {
-            std::shared_ptr<Value<T>> __left = std::make_shared<Value<T>>(__value);
-            left = __left;
+template <typename T> Expression<T> Expression<T>::bind(const std::map<std::string, T> &values) const {
+    std::unordered_set<std::string> rest = variables;
+    for (auto it = values.begin(); it != values.end(); it++) {
+        if (rest.erase(it->first) == 0) {
+            std::cerr <<"\"" << it->first << "\" - no such variable!";
+            exit(EXIT_FAILURE);
         }
     }
-    else left->substitute(__name, __value);
-    if (right->kind == NodeKind::var) {
-        std::shared_ptr<Variable<T>> rightvar = std::dynamic_pointer_cast<Variable<T>>(right);
-        if (rightvar->name == __name) {
-            std::shared_ptr<Value<T>> __right = std::make_shared<Value<T>>(__value);
-            right = __right;
+    if (store) {
+        Expression<T> result(std::make_shared<Head<T>>(store->bind(head->next, values)), rest);
+        result.store = store;
+        return result;
+    }
+    return Expression<T>(std::make_shared<Head<T>>(bind_func(head->next, values)), rest);
+}
+
+template <typename T> T Expression<T>::calculate(std::vector<std::string> vars, std::vector<T> vals) const {
+    if (vars.size() > vals.size()) {
+        std::cerr << "More variables than values!";
+        exit(EXIT_FAILURE);
+    }
+    else if (vars.size() < vals.size()) {
+        std::cerr << "More values than variables!";
+        exit(EXIT_FAILURE);
+    }
+    std::map<std::string, T> values;
+    for (unsigned i = 0; i < vars.size(); i++) {
+        if (!values.emplace(vars[i], vals[i]).second) {
+            std::cerr <<"\"" << vars[i] << "\" - variable is given twice!";
+            exit(EXIT_FAILURE);
+        }
+    }
+    return bind(values).head->calculate();
+}
+
+// Новое дерево строится снизу вверх: потомки уже связаны и свернуты, когда до них доходит родитель.
+template <typename T> std::shared_ptr<Node<T>> bind_func(std::shared_ptr<Node<T>> node, const std::map<std::string, T> &values) {
+    std::vector<std::shared_ptr<Node<T>>> results;
+    walk_func<T>(node, [](const std::shared_ptr<Node<T>> &) { return true; }, [&](const std::shared_ptr<Node<T>> &current, bool) {
+        if (current->kind == NodeKind::var) {
+            Variable<T>* variable = node_cast<Variable<T>>(current);
+            auto found = values.find(variable->name);
+            if (found != values.end()) results.push_back(std::make_shared<Value<T>>(found->second));
+            else results.push_back(std::make_shared<Variable<T>>(variable->name));
+        }
+        else if (current->kind == NodeKind::val) results.push_back(std::make_shared<Value<T>>(node_cast<Value<T>>(current)->value));
+        else if (current->kind == NodeKind::func) {
+            Function<T>* function = node_cast<Function<T>>(current);
+            results.back() = fold_func<T>(std::make_shared<Function<T>>(function->type, std::move(results.back())));
+        }
+        else if (current->kind == NodeKind::op) {
+            Operation<T>* operation = node_cast<Operation<T>>(current);
+            std::shared_ptr<Node<T>> right = std::move(results.back());
+            results.pop_back();
+            results.back() = fold_func<T>(std::make_shared<Operation<T>>(operation->type, std::move(results.back()), std::move(right)));
+        }
+    });
+    return results.back();
+}
+
+// Переменные с именем __name заменяются числом прямо в полях родителей. Спускаться нужно только во внутренние ноды,
+// поэтому в стеке лежат только они.
+template <typename T> void subst_func(Node<T>* node, const std::string &__name, T __value) {
+    std::vector<Node<T>*> stack = {node};
+    auto visit = [&](std::shared_ptr<Node<T>> &child) {
+        if (child->kind == NodeKind::var) {
+            if (node_cast<Variable<T>>(child)->name == __name) child = std::make_shared<Value<T>>(__value);
+        }
+        else if (child->kind != NodeKind::val) stack.push_back(child.get());
+    };
+    while (!stack.empty()) {
+        Node<T>* current = stack.back();
+        stack.pop_back();
+        if (current->kind == NodeKind::head) visit(static_cast<Head<T>*>(current)->next);
+        else if (current->kind == NodeKind::func) visit(static_cast<Function<T>*>(current)->arg);
+        else if (current->kind == NodeKind::op) {
+            Operation<T>* operation = static_cast<Operation<T>*>(current);
+            visit(operation->right);
+            visit(operation->left);
         }
     }
-    else right->substitute(__name, __value);
-    return *this;
 }
 
-template <typename T> T Operation<T>::calculate() {
-    if (type == OperationType::add) return left->calculate() + right->calculate();
-    if (type == OperationType::sub) return left->calculate() - right->calculate();
-    if (type == OperationType::mult) return left->calculate() * right->calculate();
-    if (type == OperationType::div) return left->calculate() / right->calculate();
-    if (type == OperationType::pow) return std::pow(left->calculate(), right->calculate());
+template <typename T> T calc_operation(OperationType type, T left, T right) {
+    if (type == OperationType::add) return left + right;
+    if (type == OperationType::sub) return left - right;
+    if (type == OperationType::mult) return left * right;
+    if (type == OperationType::div) return left / right;
+    if (type == OperationType::pow) return std::pow(left, right);
     std::cerr << "Something went wrong, an operation has no type.\n";
     exit(EXIT_FAILURE);
 }
 
+template <typename T> T calc_function(FunctionType type, T arg) {
+    if (type == FunctionType::sin) return std::sin(arg);
+    if (type == FunctionType::cos) return std::cos(arg);
+    if (type == FunctionType::ln) return std::log(arg);
+    if (type == FunctionType::exp) return std::exp(arg);
+    std::cerr << "Something went wrong, a function has no type.\n";
+    exit(EXIT_FAILURE);
+}
+
+// Значения потомков копятся в стеке: функция заменяет верхнее значение, операция сворачивает два верхних в одно.
+// Свертка констант вычисляет операции над двумя числами, поэтому для листа стек не заводится вовсе.
+template <typename T> T calc_func(const std::shared_ptr<Node<T>> &node) {
+    if (node->kind == NodeKind::val) return node_cast<Value<T>>(node)->value;
+    std::vector<T> values;
+    walk_func<T>(node, [](const std::shared_ptr<Node<T>> &) { return true; }, [&](const std::shared_ptr<Node<T>> &current, bool) {
+        visit_node(current.get(), node_handlers{
+            [&](Value<T> &value) { values.push_back(value.value); },
+            [&](Variable<T> &variable) { values.push_back(variable.calculate()); },
+            [&](Function<T> &function) { values.back() = calc_function(function.type, values.back()); },
+            [&](Operation<T> &operation) {
+                T right = values.back();
+                values.pop_back();
+                values.back() = calc_operation(operation.type, values.back(), right);
+            },
+            [](Head<T> &) {}
+        });
+    });
+    return values.back();
+}
+
+template <typename T> Head<T>& Head<T>::substitute(std::string __name, T __value) {
+    subst_func<T>(this, __name, __value);
+    return *this;
+}
+
+template <typename T> T Head<T>::calculate() const {
+    return calc_func(next);
+}
+
+template <typename T> Operation<T>& Operation<T>::substitute(std::string __name, T __value) {
+    subst_func<T>(this, __name, __value);
+    return *this;
+}
+
+template <typename T> T Operation<T>::calculate() const {
+    return calc_operation(type, calc_func(left), calc_func(right));
+}
+
 template <typename T> Function<T>& Function<T>::substitute(std::string __name, T __value) {
-    if (arg->kind == NodeKind::var) {
-        std::shared_ptr<Variable<T>> argvar = std::dynamic_pointer_cast<Variable<T>>(arg);
-        if (argvar->name == __name) {
-            std::shared_ptr<Value<T>> __arg = std::make_shared<Value<T>>(__value);
-            arg = __arg;
-        }
-    }
-    else arg->substitute(__name, __value);
+    subst_func<T>(this, __name, __value);
     return *this;
 }
 
-template <typename T> T Function<T>::calculate() {
-    if (type == FunctionType::sin) return std::sin(arg->calculate());
-    if (type == FunctionType::cos) return std::cos(arg->calculate());
-    if (type == FunctionType::ln) return std::log(arg->calculate());
-    if (type == FunctionType::exp) return std::exp(arg->calculate());
-    std::cerr << "Something went wrong, a function has no type.\n";
-    exit(EXIT_FAILURE);
+template <typename T> T Function<T>::calculate() const {
+    return calc_function(type, calc_func(arg));
 }
 
 template <typename T> Variable<T>& Variable<T>::substitute(std::string __name, T __value) {
@@ -856,7 +1962,7 @@ template <typename T> Variable<T>& Variable<T>::substitute(std::string __name, T
     return *this;
 }
 
-template <typename T> T Variable<T>::calculate() {
+template <typename T> T Variable<T>::calculate() const {
     std::cerr << "Something went wrong, trying to calcualte a variable.\n" << "Variable name: " << name << "\n";
     exit(EXIT_FAILURE);
     return -1;
@@ -866,7 +1972,7 @@ template <typename T> Value<T>& Value<T>::substitute(std::string __name, T __val
     return *this;
 }
 
-template <typename T> T Value<T>::calculate() {
+template <typename T> T Value<T>::calculate() const {
     return value;
 }
 
@@ -878,397 +1984,1735 @@ template <typename T> T Value<T>::calculate() {
 template <typename T> Expression<T> Expression<T>::differentiate(std::string __name) const {
     Expression<T> copy = Expression<T>(*this);
     copy.simplify();
-    copy.head->next = diff_func(head->next, __name);
+    if (copy.store) copy.head->next = copy.store->differentiate(copy.head->next, __name);
+    else copy.head->next = diff_func(copy.head->next, __name);
     copy.simplify();
     return copy;
 }
 
+template <typename T> bool Expression<T>::differentiate(std::string __name, Expression<T> &result, std::string &error) const {
+    result = *this;
+    if (!result.simplify(error)) return false;
+    if (result.store) result.head->next = result.store->differentiate(result.head->next, __name);
+    else result.head->next = diff_func(result.head->next, __name);
+    return result.simplify(error);
+}
+
+// Производные потомков копятся в стеке, и родитель собирает свою производную из них по тем же правилам, что и раньше:
+// константный множитель или делитель не дифференцируется, степень с числовым показателем понижается, остальные
+// степени идут через exp(g ln f). Исходные поддеревья, которые входят в производную, копируются, поэтому результат -
+// обычное дерево без общих нод, и его можно дальше упрощать на месте.
 template <typename T> std::shared_ptr<Node<T>> diff_func(std::shared_ptr<Node<T>> node, std::string __name) {
-    if (node->kind == NodeKind::head) {
-        std::shared_ptr<Head<T>> head = std::dynamic_pointer_cast<Head<T>>(node);
-        head->next = diff_func(head->next, __name);
-    }
-    else if (node->kind == NodeKind::op) {
-        std::shared_ptr<Operation<T>> operation = std::dynamic_pointer_cast<Operation<T>>(node);
-        if (operation->type == OperationType::add ||
-            operation->type == OperationType::sub) {
-            operation->left = diff_func(operation->left, __name);
-            operation->right = diff_func(operation->right, __name);
-        }
-        else if (operation->type == OperationType::mult) {
-            if (operation->right->kind == NodeKind::val || 
-                (operation->right->kind == NodeKind::var && 
-                std::dynamic_pointer_cast<Variable<T>>(operation->right)->name != __name))
-                operation->left = diff_func(operation->left, __name);
-            else if (operation->left->kind == NodeKind::val || 
-                (operation->left->kind == NodeKind::var && 
-                std::dynamic_pointer_cast<Variable<T>>(operation->left)->name != __name))
-                operation->right = diff_func(operation->right, __name);
-            else {
-                std::shared_ptr<Operation<T>> left = std::make_shared<Operation<T>>(OperationType::mult, diff_func(operation->left->clone(), __name), operation->right);
-                std::shared_ptr<Operation<T>> right = std::make_shared<Operation<T>>(OperationType::mult, diff_func(operation->right->clone(), __name), operation->left);
-                operation->left = left;
-                operation->right = right;
-                operation->type = OperationType::add;
-            }
+    std::vector<std::shared_ptr<Node<T>>> results;
+    auto mult = [](std::shared_ptr<Node<T>> left, std::shared_ptr<Node<T>> right) -> std::shared_ptr<Node<T>> {
+        return std::make_shared<Operation<T>>(OperationType::mult, std::move(left), std::move(right));
+    };
+    auto constant = [&](const std::shared_ptr<Node<T>> &operand) {
+        return operand->kind == NodeKind::val || (operand->kind == NodeKind::var && node_cast<Variable<T>>(operand)->name != __name);
+    };
+    auto diff_function = [&](const Function<T> &function, const std::shared_ptr<Node<T>> &current) {
+        std::shared_ptr<Node<T>> &result = results.back();
+        std::shared_ptr<Node<T>> inner = std::move(result);
+        if (function.type == FunctionType::sin) result = mult(inner, std::make_shared<Function<T>>(FunctionType::cos, clone_func(function.arg)));
+        else if (function.type == FunctionType::cos) {
+            std::shared_ptr<Node<T>> sinus = std::make_shared<Function<T>>(FunctionType::sin, clone_func(function.arg));
+            result = mult(inner, mult(std::make_shared<Value<T>>((T)-1), sinus));
+        }
+        else if (function.type == FunctionType::ln) result = std::make_shared<Operation<T>>(OperationType::div, inner, clone_func(function.arg));
+        else result = mult(inner, clone_func(current));
+    };
+    auto diff_operation = [&](const Operation<T> &operation, const std::shared_ptr<Node<T>> &current) {
+        const std::shared_ptr<Node<T>> &left = operation.left;
+        const std::shared_ptr<Node<T>> &right = operation.right;
+        std::shared_ptr<Node<T>> dright = std::move(results.back());
+        results.pop_back();
+        std::shared_ptr<Node<T>> dleft = std::move(results.back());
+        std::shared_ptr<Node<T>> &result = results.back();
+        if (operation.type == OperationType::add || operation.type == OperationType::sub) {
+            result = std::make_shared<Operation<T>>(operation.type, dleft, dright);
+        }
+        else if (operation.type == OperationType::mult) {
+            if (constant(right)) result = mult(dleft, clone_func(right));
+            else if (constant(left)) result = mult(clone_func(left), dright);
+            else result = std::make_shared<Operation<T>>(OperationType::add, mult(dleft, clone_func(right)), mult(dright, clone_func(left)));
         }
-        else if (operation->type == OperationType::div) {
-            if (operation->right->kind == NodeKind::val || 
-                (operation->right->kind == NodeKind::var && 
-                std::dynamic_pointer_cast<Variable<T>>(operation->right)->name != __name)) 
-                operation->left = diff_func(operation->left, __name);
+        else if (operation.type == OperationType::div) {
+            if (constant(right)) result = std::make_shared<Operation<T>>(OperationType::div, dleft, clone_func(right));
             else {
-                std::shared_ptr<Operation<T>> left = std::make_shared<Operation<T>>(OperationType::mult, diff_func(operation->left->clone(), __name), operation->right);
-                std::shared_ptr<Operation<T>> right = std::make_shared<Operation<T>>(OperationType::mult, diff_func(operation->right->clone(), __name), operation->left);
-                std::shared_ptr<Operation<T>> num = std::make_shared<Operation<T>>(OperationType::sub, left, right);
-                std::shared_ptr<Operation<T>> denom = std::make_shared<Operation<T>>(OperationType::pow, operation->right->clone(), std::make_shared<Value<T>>(2));
-                operation->left = num;
-                operation->right = denom;
+                std::shared_ptr<Node<T>> num = std::make_shared<Operation<T>>(OperationType::sub, mult(dleft, clone_func(right)), mult(dright, clone_func(left)));
+                std::shared_ptr<Node<T>> denom = std::make_shared<Operation<T>>(OperationType::pow, clone_func(right), std::make_shared<Value<T>>(2));
+                result = std::make_shared<Operation<T>>(OperationType::div, num, denom);
             }
         }
-        else if (operation->type == OperationType::pow) {
-            if (operation->right->kind == NodeKind::val) {
-                std::shared_ptr<Value<T>> value = std::dynamic_pointer_cast<Value<T>>(operation->right);
-                std::shared_ptr<Node<T>> left = value->clone();
-                value->value -= 1;
-                std::shared_ptr<Node<T>> inner = std::make_shared<Operation<T>>(OperationType::mult, left, node);
-                std::shared_ptr<Node<T>> outer = std::make_shared<Operation<T>>(OperationType::mult, inner, diff_func(operation->left->clone(), __name));
-                node = outer;
+        else if (operation.type == OperationType::pow) {
+            if (right->kind == NodeKind::val) {
+                T power = node_cast<Value<T>>(right)->value;
+                std::shared_ptr<Node<T>> lowered = std::make_shared<Operation<T>>(OperationType::pow, clone_func(left), std::make_shared<Value<T>>(power - (T)1));
+                result = mult(mult(std::make_shared<Value<T>>(power), lowered), dleft);
             }
             else {
-                std::shared_ptr<Node<T>> logarithm = std::make_shared<Function<T>>(FunctionType::ln, operation->left);
-                std::shared_ptr<Node<T>> in_power = std::make_shared<Operation<T>>(OperationType::mult, operation->right, logarithm);
-                std::shared_ptr<Node<T>> outer = std::make_shared<Operation<T>>(OperationType::mult, diff_func(in_power, __name), node);
-                node = outer;
+                // (f ^ g)' = (g ln f)' * f ^ g, где (ln f)' = f' / f.
+                std::shared_ptr<Node<T>> dlog = std::make_shared<Operation<T>>(OperationType::div, dleft, clone_func(left));
+                std::shared_ptr<Node<T>> dpower;
+                if (constant(right)) dpower = mult(clone_func(right), dlog);
+                else dpower = std::make_shared<Operation<T>>(OperationType::add,
+                    mult(dright, std::make_shared<Function<T>>(FunctionType::ln, clone_func(left))), mult(dlog, clone_func(right)));
+                result = mult(dpower, clone_func(current));
             }
         }
+    };
+    walk_func<T>(node, [](const std::shared_ptr<Node<T>> &) { return true; }, [&](const std::shared_ptr<Node<T>> &current, bool) {
+        visit_node(current.get(), node_handlers{
+            [&](Value<T> &) { results.push_back(std::make_shared<Value<T>>((T)0)); },
+            [&](Variable<T> &variable) { results.push_back(std::make_shared<Value<T>>(variable.name == __name ? (T)1 : (T)0)); },
+            [&](Head<T> &head) {
+                head.next = std::move(results.back());
+                results.back() = current;
+            },
+            [&](Function<T> &function) { diff_function(function, current); },
+            [&](Operation<T> &operation) { diff_operation(operation, current); }
+        });
+    });
+    return results.back();
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Хранилище нод и работа с DAG
+//---------------------------------------------------------------------------------------------------------------
+
+// Константы в ключе сравниваются и хэшируются побитово (same_bits): по == ноды 0 и -0 слились бы в одну, хотя 1 / x
+// для них разный, а NaN не совпадал бы даже сам с собой и каждый раз давал новую ноду.
+inline std::size_t value_hash(double number) {
+    return std::hash<uint64_t>()(std::bit_cast<uint64_t>(number));
+}
+
+inline std::size_t value_hash(std::complex<double> number) {
+    return value_hash(number.real()) * 31 + value_hash(number.imag());
+}
+
+template <typename T> bool NodeKey<T>::operator==(const NodeKey<T> &other) const {
+    return kind == other.kind && type == other.type && left == other.left && right == other.right && same_bits(value, other.value) && name == other.name;
+}
+
+template <typename T> std::size_t NodeKeyHash<T>::operator()(const NodeKey<T> &key) const {
+    std::size_t hash = (std::size_t)key.kind * 16 + (std::size_t)key.type;
+    hash = hash * 1000003 ^ std::hash<const Node<T>*>()(key.left);
+    hash = hash * 1000003 ^ std::hash<const Node<T>*>()(key.right);
+    hash = hash * 1000003 ^ value_hash(key.value);
+    hash = hash * 1000003 ^ std::hash<std::string>()(key.name);
+    return hash;
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::insert(NodeKey<T> key, std::shared_ptr<Node<T>> node) {
+    table.emplace(key, node);
+    members.insert(node.get());
+    return node;
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::value(T __value) {
+    NodeKey<T> key = {NodeKind::val, 0, nullptr, nullptr, __value, ""};
+    auto found = table.find(key);
+    if (found != table.end()) return found->second;
+    return insert(key, std::make_shared<Value<T>>(__value));
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::variable(std::string __name) {
+    NodeKey<T> key = {NodeKind::var, 0, nullptr, nullptr, T(), __name};
+    auto found = table.find(key);
+    if (found != table.end()) return found->second;
+    return insert(key, std::make_shared<Variable<T>>(__name));
+}
+
+template <typename T> NodeStore<T>::NodeStore(bool __folding) {
+    folding = __folding;
+}
+
+template <typename T> bool NodeStore<T>::folds() const {
+    return folding;
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::function(FunctionType __type, std::shared_ptr<Node<T>> __arg) {
+    if (members.find(__arg.get()) == members.end()) __arg = intern(__arg);
+    if (folding) {
+        std::shared_ptr<Node<T>> folded = fold_function(__type, __arg, [&](T number) { return value(number); });
+        if (folded) return folded;
+    }
+    NodeKey<T> key = {NodeKind::func, (char)__type, __arg.get(), nullptr, T(), ""};
+    auto found = table.find(key);
+    if (found != table.end()) return found->second;
+    return insert(key, std::make_shared<Function<T>>(__type, __arg));
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::operation(OperationType __type, std::shared_ptr<Node<T>> __left, std::shared_ptr<Node<T>> __right) {
+    if (members.find(__left.get()) == members.end()) __left = intern(__left);
+    if (members.find(__right.get()) == members.end()) __right = intern(__right);
+    if (folding) {
+        std::shared_ptr<Node<T>> folded = fold_operation(__type, __left, __right, [&](T number) { return value(number); });
+        if (folded) return folded;
     }
-    else if (node->kind == NodeKind::func) {
-        std::shared_ptr<Function<T>> function = std::dynamic_pointer_cast<Function<T>>(node);
-        std::shared_ptr<Node<T>> arg = function->arg->clone();
-        std::shared_ptr<Node<T>> inner = diff_func(function->arg->clone(), __name)->clone();
-        if (function->type == FunctionType::sin) {
-            std::shared_ptr<Function<T>> outer = std::make_shared<Function<T>>(FunctionType::cos, arg);
-            std::shared_ptr<Operation<T>> diff = std::make_shared<Operation<T>>(OperationType::mult, inner, outer);
-            node = diff;
+    NodeKey<T> key = {NodeKind::op, (char)__type, __left.get(), __right.get(), T(), ""};
+    auto found = table.find(key);
+    if (found != table.end()) return found->second;
+    return insert(key, std::make_shared<Operation<T>>(__type, __left, __right));
+}
+
+template <typename T> std::size_t NodeStore<T>::size() const {
+    return table.size();
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::intern(std::shared_ptr<Node<T>> node) {
+    Memo memo;
+    return intern(node, memo);
+}
+
+// Все проходы по хранилищу устроены одинаково: обход без рекурсии, в ноду с готовым результатом в memo не спускаемся,
+// а результаты потомков копятся в стеке results и забираются родителем.
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::intern(std::shared_ptr<Node<T>> node, Memo &memo) {
+    std::vector<std::shared_ptr<Node<T>>> results;
+    walk_func<T>(node, [&](const std::shared_ptr<Node<T>> &current) {
+        return members.find(current.get()) == members.end() && memo.find(current.get()) == memo.end();
+    }, [&](const std::shared_ptr<Node<T>> &current, bool entered) {
+        if (!entered) {
+            if (members.find(current.get()) != members.end()) results.push_back(current);
+            else results.push_back(memo[current.get()]);
+            return;
         }
-        else if (function->type == FunctionType::cos) {
-            std::shared_ptr<Function<T>> sinus = std::make_shared<Function<T>>(FunctionType::sin, arg);
-            std::shared_ptr<Operation<T>> outer = std::make_shared<Operation<T>>(OperationType::mult, std::make_shared<Value<T>>((T)-1), sinus);
-            std::shared_ptr<Operation<T>> diff = std::make_shared<Operation<T>>(OperationType::mult, inner, outer);
-            node = diff;
+        std::shared_ptr<Node<T>> result;
+        if (current->kind == NodeKind::val) result = value(node_cast<Value<T>>(current)->value);
+        else if (current->kind == NodeKind::var) result = variable(node_cast<Variable<T>>(current)->name);
+        else if (current->kind == NodeKind::func) {
+            result = function(node_cast<Function<T>>(current)->type, std::move(results.back()));
+            results.pop_back();
         }
-        else if (function->type == FunctionType::ln) {
-            std::shared_ptr<Operation<T>> diff = std::make_shared<Operation<T>>(OperationType::div, inner, arg);
-            node = diff;
+        else if (current->kind == NodeKind::op) {
+            std::shared_ptr<Node<T>> right = std::move(results.back());
+            results.pop_back();
+            result = operation(node_cast<Operation<T>>(current)->type, std::move(results.back()), right);
+            results.pop_back();
         }
-        else if (function->type == FunctionType::exp) {
-            std::shared_ptr<Operation<T>> diff = std::make_shared<Operation<T>>(OperationType::mult, inner, function);
-            node = diff;
+        else {
+            result = std::move(results.back());
+            results.pop_back();
         }
-    }
-    else if (node->kind == NodeKind::var) {
-        std::shared_ptr<Variable<T>> variable = std::dynamic_pointer_cast<Variable<T>>(node);
-        if (variable->name == __name) node = std::make_shared<Value<T>>((T)1);
-        else node = std::make_shared<Value<T>>((T)0);
-    }
-    else if (node->kind == NodeKind::val) node = std::make_shared<Value<T>>((T)0);
-    return node;
+        memo[current.get()] = result;
+        results.push_back(result);
+    });
+    return results.back();
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::simplify(std::shared_ptr<Node<T>> node, std::string *error) {
+    Memo memo;
+    return simplify(intern(node), memo, error);
+}
+
+// Правила свертки те же, что и в simpl_func (fold_func), только потомки не меняются на месте, а строится новая нода.
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::simplify(std::shared_ptr<Node<T>> node, Memo &memo, std::string *error) {
+    std::vector<std::shared_ptr<Node<T>>> results;
+    walk_func<T>(node, [&](const std::shared_ptr<Node<T>> &current) {
+        return memo.find(current.get()) == memo.end();
+    }, [&](const std::shared_ptr<Node<T>> &current, bool entered) {
+        if (!entered) {
+            results.push_back(memo[current.get()]);
+            return;
+        }
+        std::shared_ptr<Node<T>> result = current;
+        if (current->kind == NodeKind::func) {
+            result = intern(fold_func<T>(function(node_cast<Function<T>>(current)->type, std::move(results.back())), error));
+            results.pop_back();
+        }
+        else if (current->kind == NodeKind::op) {
+            std::shared_ptr<Node<T>> right = std::move(results.back());
+            results.pop_back();
+            result = intern(fold_func<T>(operation(node_cast<Operation<T>>(current)->type, std::move(results.back()), right), error));
+            results.pop_back();
+        }
+        else if (current->kind == NodeKind::head) {
+            result = std::move(results.back());
+            results.pop_back();
+        }
+        memo[current.get()] = result;
+        results.push_back(result);
+    });
+    return results.back();
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::bind(std::shared_ptr<Node<T>> node, const std::map<std::string, T> &values, bool fold) {
+    Memo memo;
+    return bind(intern(node), values, fold, memo);
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::bind(std::shared_ptr<Node<T>> node, const std::map<std::string, T> &values, bool fold, Memo &memo) {
+    std::vector<std::shared_ptr<Node<T>>> results;
+    walk_func<T>(node, [&](const std::shared_ptr<Node<T>> &current) {
+        return memo.find(current.get()) == memo.end();
+    }, [&](const std::shared_ptr<Node<T>> &current, bool entered) {
+        if (!entered) {
+            results.push_back(memo[current.get()]);
+            return;
+        }
+        std::shared_ptr<Node<T>> result = current;
+        if (current->kind == NodeKind::var) {
+            auto bound = values.find(node_cast<Variable<T>>(current)->name);
+            if (bound != values.end()) result = value(bound->second);
+        }
+        else if (current->kind == NodeKind::func) {
+            result = function(node_cast<Function<T>>(current)->type, std::move(results.back()));
+            results.pop_back();
+            if (fold) result = intern(fold_func<T>(result));
+        }
+        else if (current->kind == NodeKind::op) {
+            std::shared_ptr<Node<T>> right = std::move(results.back());
+            results.pop_back();
+            result = operation(node_cast<Operation<T>>(current)->type, std::move(results.back()), right);
+            results.pop_back();
+            if (fold) result = intern(fold_func<T>(result));
+        }
+        else if (current->kind == NodeKind::head) {
+            result = std::move(results.back());
+            results.pop_back();
+        }
+        memo[current.get()] = result;
+        results.push_back(result);
+    });
+    return results.back();
+}
+
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::differentiate(std::shared_ptr<Node<T>> node, std::string __name) {
+    Memo memo;
+    return differentiate(intern(node), __name, memo);
+}
+
+// Те же правила, что и в diff_func, но производная каждой общей ноды строится один раз и потом переиспользуется.
+// Копировать поддеревья не нужно: ноды хранилища не меняются, и на них можно ссылаться сколько угодно раз.
+template <typename T> std::shared_ptr<Node<T>> NodeStore<T>::differentiate(std::shared_ptr<Node<T>> node, std::string __name, Memo &memo) {
+    std::vector<std::shared_ptr<Node<T>>> results;
+    auto constant = [&](const std::shared_ptr<Node<T>> &operand) {
+        return operand->kind == NodeKind::val || (operand->kind == NodeKind::var && node_cast<Variable<T>>(operand)->name != __name);
+    };
+    walk_func<T>(node, [&](const std::shared_ptr<Node<T>> &current) {
+        return memo.find(current.get()) == memo.end();
+    }, [&](const std::shared_ptr<Node<T>> &current, bool entered) {
+        if (!entered) {
+            results.push_back(memo[current.get()]);
+            return;
+        }
+        std::shared_ptr<Node<T>> result;
+        if (current->kind == NodeKind::val) result = value((T)0);
+        else if (current->kind == NodeKind::var) result = value(node_cast<Variable<T>>(current)->name == __name ? (T)1 : (T)0);
+        else if (current->kind == NodeKind::op) {
+            Operation<T>* op = node_cast<Operation<T>>(current);
+            std::shared_ptr<Node<T>> left = op->left;
+            std::shared_ptr<Node<T>> right = op->right;
+            std::shared_ptr<Node<T>> dright = std::move(results.back());
+            results.pop_back();
+            std::shared_ptr<Node<T>> dleft = std::move(results.back());
+            results.pop_back();
+            if (op->type == OperationType::add || op->type == OperationType::sub) result = operation(op->type, dleft, dright);
+            else if (op->type == OperationType::mult) {
+                if (constant(right)) result = operation(OperationType::mult, dleft, right);
+                else if (constant(left)) result = operation(OperationType::mult, left, dright);
+                else result = operation(OperationType::add, operation(OperationType::mult, dleft, right), operation(OperationType::mult, dright, left));
+            }
+            else if (op->type == OperationType::div) {
+                if (constant(right)) result = operation(OperationType::div, dleft, right);
+                else {
+                    std::shared_ptr<Node<T>> num = operation(OperationType::sub, operation(OperationType::mult, dleft, right), operation(OperationType::mult, dright, left));
+                    result = operation(OperationType::div, num, operation(OperationType::pow, right, value((T)2)));
+                }
+            }
+            else if (op->type == OperationType::pow) {
+                if (right->kind == NodeKind::val) {
+                    T power = node_cast<Value<T>>(right)->value;
+                    std::shared_ptr<Node<T>> lowered = operation(OperationType::pow, left, value(power - (T)1));
+                    result = operation(OperationType::mult, operation(OperationType::mult, value(power), lowered), dleft);
+                }
+                else {
+                    // (f ^ g)' = (g ln f)' * f ^ g, где (ln f)' = f' / f.
+                    std::shared_ptr<Node<T>> dlog = operation(OperationType::div, dleft, left);
+                    std::shared_ptr<Node<T>> dpower;
+                    if (constant(right)) dpower = operation(OperationType::mult, right, dlog);
+                    else dpower = operation(OperationType::add, operation(OperationType::mult, dright, function(FunctionType::ln, left)), operation(OperationType::mult, dlog, right));
+                    result = operation(OperationType::mult, dpower, current);
+                }
+            }
+        }
+        else if (current->kind == NodeKind::func) {
+            Function<T>* func = node_cast<Function<T>>(current);
+            std::shared_ptr<Node<T>> arg = func->arg;
+            std::shared_ptr<Node<T>> inner = std::move(results.back());
+            results.pop_back();
+            if (func->type == FunctionType::sin) result = operation(OperationType::mult, inner, function(FunctionType::cos, arg));
+            else if (func->type == FunctionType::cos) {
+                std::shared_ptr<Node<T>> outer = operation(OperationType::mult, value((T)-1), function(FunctionType::sin, arg));
+                result = operation(OperationType::mult, inner, outer);
+            }
+            else if (func->type == FunctionType::ln) result = operation(OperationType::div, inner, arg);
+            else if (func->type == FunctionType::exp) result = operation(OperationType::mult, inner, current);
+        }
+        else {
+            result = std::move(results.back());
+            results.pop_back();
+        }
+        memo[current.get()] = result;
+        results.push_back(result);
+    });
+    return results.back();
+}
+
+template <typename T> Expression<T>& Expression<T>::share() {
+    if (!store) store = std::make_shared<NodeStore<T>>();
+    head->next = store->intern(head->next);
+    return *this;
+}
+
+template <typename T> Expression<T>& Expression<T>::share(std::shared_ptr<NodeStore<T>> __store) {
+    store = std::move(__store);
+    head->next = store->intern(head->next);
+    return *this;
+}
+
+template <typename T> std::size_t count_func(std::shared_ptr<Node<T>> node, std::unordered_set<const Node<T>*> *seen) {
+    std::size_t count = 0;
+    walk_func<T>(node, [&](const std::shared_ptr<Node<T>> &current) {
+        return seen->insert(current.get()).second;
+    }, [&](const std::shared_ptr<Node<T>> &, bool entered) {
+        if (entered) count++;
+    });
+    return count;
 }
 
+template <typename T> std::size_t Expression<T>::count_nodes() const {
+    std::unordered_set<const Node<T>*> seen;
+    return count_func(head->next, &seen);
+}
 
 //---------------------------------------------------------------------------------------------------------------
-// Функции для парсинга:
+// Плоское хранение
 //---------------------------------------------------------------------------------------------------------------
 
-void skip_spaces(std::string::iterator *it, std::string::iterator end) {
-    while (*it < end && **it == ' ') (*it)++;
+template <typename T> FlatExpression<T> Expression<T>::flatten() const {
+    return FlatExpression<T>(*this);
 }
 
-double parse_number(std::string::iterator *it, std::string::iterator end) {
-    auto start = *it;
-    while (*it < end && **it >= '0' && **it <= '9') (*it)++;
-    if (**it == '.' && *it + 1 < end && *(*it + 1) <= '9' && *(*it + 1) >= '0' ) {
-        (*it)++;
-        while (**it > '0' && **it < '9' && *it < end) (*it)++;
-    }
-    return std::stod(std::string(start, *it));
+template <typename T> FlatExpression<T>::FlatExpression(const Expression<T> &expr) {
+    std::unordered_map<const Node<T>*, uint32_t> memo;
+    flatten(expr.head->next, memo);
 }
 
-std::string parse_string(std::string::iterator *it, std::string::iterator end) {
-    auto start = *it;
-    while (*it < end && ((**it >= 'a' && **it <= 'z') || (**it >= 'A' && ** it <= 'Z') || **it == '_' || (**it >= '0' && **it <= '9'))) (*it)++;
-    return std::string(start, *it);
+// Общие поддеревья DAG записываются один раз, и на них ссылаются по индексу.
+// Обход без рекурсии сам дает нужный порядок: запись ноды появляется сразу после записей ее потомков.
+template <typename T> uint32_t FlatExpression<T>::flatten(std::shared_ptr<Node<T>> node, std::unordered_map<const Node<T>*, uint32_t> &memo) {
+    std::vector<uint32_t> results;
+    walk_func<T>(node, [&](const std::shared_ptr<Node<T>> &current) {
+        return memo.find(current.get()) == memo.end();
+    }, [&](const std::shared_ptr<Node<T>> &current, bool entered) {
+        if (!entered) {
+            results.push_back(memo[current.get()]);
+            return;
+        }
+        FlatNode record = {current->kind, 0, 0, 0};
+        if (current->kind == NodeKind::val) {
+            record.left = constants.size();
+            constants.push_back(node_cast<Value<T>>(current)->value);
+        }
+        else if (current->kind == NodeKind::var) record.left = name_index(node_cast<Variable<T>>(current)->name);
+        else if (current->kind == NodeKind::func) {
+            record.type = (char)node_cast<Function<T>>(current)->type;
+            record.left = results.back();
+            results.pop_back();
+        }
+        else if (current->kind == NodeKind::op) {
+            record.type = (char)node_cast<Operation<T>>(current)->type;
+            record.right = results.back();
+            results.pop_back();
+            record.left = results.back();
+            results.pop_back();
+        }
+        else return;
+        nodes.push_back(record);
+        memo[current.get()] = nodes.size() - 1;
+        results.push_back(nodes.size() - 1);
+    });
+    return results.back();
 }
 
-void skip_all(std::string::iterator *it, std::string::iterator end) {
-    while (*it < end && **it != ')') {
-        (*it)++;
-        if (**it == '(') skip_all(it, end);
+template <typename T> uint32_t FlatExpression<T>::name_index(std::string __name) {
+    for (uint32_t i = 0; i < names.size(); i++) {
+        if (names[i] == __name) return i;
+    }
+    names.push_back(__name);
+    return names.size() - 1;
+}
+
+// Обратно собирается обычное дерево: общие поддеревья копируются, так как ноды дерева меняются на месте.
+// Записи уже идут от потомков к родителям, поэтому хватает одного прохода по массиву: первая ссылка на запись
+// забирает собранную ноду, каждая следующая - ее копию.
+template <typename T, typename Name> std::shared_ptr<Node<T>> flat_expand(const FlatNode* nodes, uint32_t index, const T* constants, Name name) {
+    std::vector<std::shared_ptr<Node<T>>> built(index + 1);
+    std::vector<bool> taken(index + 1, false);
+    auto take = [&](uint32_t i) {
+        if (taken[i]) return clone_func(built[i]);
+        taken[i] = true;
+        return built[i];
+    };
+    for (uint32_t i = 0; i <= index; i++) {
+        const FlatNode &record = nodes[i];
+        if (record.kind == NodeKind::val) built[i] = std::make_shared<Value<T>>(constants[record.left]);
+        else if (record.kind == NodeKind::var) built[i] = std::make_shared<Variable<T>>(name(record.left));
+        else if (record.kind == NodeKind::func) built[i] = std::make_shared<Function<T>>((FunctionType)record.type, take(record.left));
+        else {
+            std::shared_ptr<Node<T>> left = take(record.left);
+            built[i] = std::make_shared<Operation<T>>((OperationType)record.type, left, take(record.right));
+        }
     }
+    return built[index];
+}
+
+template <typename T> std::shared_ptr<Node<T>> FlatExpression<T>::expand(uint32_t index) const {
+    return flat_expand<T>(nodes.data(), index, constants.data(), [this](uint32_t i) { return names[i]; });
 }
 
-void find_end(std::string::iterator *it, std::string::iterator end) {
-    while (*it < end && **it != ' ') {
-        if (**it == '(') skip_all(it, end);
-        (*it)++;
+template <typename T> Expression<T> FlatExpression<T>::expand() const {
+    std::unordered_set<std::string> vars(names.begin(), names.end());
+    return Expression<T>(std::make_shared<Head<T>>(expand(nodes.size() - 1)), vars);
+}
+
+template <typename T> std::string FlatExpression<T>::to_string() const {
+    return expand().to_string();
+}
+
+// scratch - по одному значению на запись, vals - значения переменных в порядке names.
+// Тип значений U может отличаться от T (например, дуальные числа): константы приводятся к U,
+// а функции вызываются без std::, чтобы нашлись перегрузки для U.
+template <typename T, typename U> U flat_step(const FlatNode &record, const T* constants, const U* vals, const U* scratch) {
+    using std::sin;
+    using std::cos;
+    using std::log;
+    using std::exp;
+    using std::pow;
+    if (record.kind == NodeKind::val) return U(constants[record.left]);
+    if (record.kind == NodeKind::var) return vals[record.left];
+    if (record.kind == NodeKind::func) {
+        const U &arg = scratch[record.left];
+        switch ((FunctionType)record.type) {
+            case FunctionType::sin: return sin(arg);
+            case FunctionType::cos: return cos(arg);
+            case FunctionType::ln: return log(arg);
+            case FunctionType::exp: return exp(arg);
+        }
     }
+    const U &left = scratch[record.left];
+    const U &right = scratch[record.right];
+    switch ((OperationType)record.type) {
+        case OperationType::add: return left + right;
+        case OperationType::sub: return left - right;
+        case OperationType::mult: return left * right;
+        case OperationType::div: return left / right;
+        case OperationType::pow: return pow(left, right);
+    }
+    return U();
+}
+
+template <typename T, typename U> U flat_evaluate(const FlatNode* nodes, uint32_t count, const T* constants, const U* vals, U* scratch) {
+    for (uint32_t i = 0; i < count; i++) scratch[i] = flat_step<T, U>(nodes[i], constants, vals, scratch);
+    return scratch[count - 1];
+}
+
+template <typename T> template <typename U> U FlatExpression<T>::evaluate(const U* vals, U* scratch) const {
+    return flat_evaluate<T, U>(nodes.data(), nodes.size(), constants.data(), vals, scratch);
+}
+
+template <typename T> T FlatExpression<T>::calculate(const T* vals, T* scratch) const {
+    return evaluate<T>(vals, scratch);
 }
 
-std::shared_ptr<Node<double>> parse_real(std::string::iterator *it, std::string::iterator end, std::unordered_set<std::string> *vars) {
-    std::shared_ptr<Node<double>> current = nullptr;
-    while (*it < end && **it && **it != ')') {
-        if (**it == ' ') skip_spaces(it, end);
-        else if (**it == '(') {
-            (*it)++;
-            current = parse_real(it, end, vars);
-            (*it)++;
+// Раскладывает значения по порядку names и проверяет, что заданы все переменные и только они.
+template <typename T> template <typename U> std::vector<U> FlatExpression<T>::order(std::vector<std::string> vars, std::vector<U> vals) const {
+    if (vars.size() != vals.size()) {
+        std::cerr << "Number of variables does not match number of values!";
+        exit(EXIT_FAILURE);
+    }
+    std::vector<U> ordered(names.size());
+    std::vector<bool> given(names.size(), false);
+    for (unsigned i = 0; i < vars.size(); i++) {
+        auto pos = std::find(names.begin(), names.end(), vars[i]);
+        if (pos == names.end()) {
+            std::cerr <<"\"" << vars[i] << "\" - no such variable!";
+            exit(EXIT_FAILURE);
         }
-        else if (**it >= '0' && **it <= '9') current = std::make_shared<Value<double>>(parse_number(it, end));
-        else if ((**it >= 'a' && **it <= 'z') || (**it >= 'A' && **it <= 'Z')) {
-            std::string word = parse_string(it, end);
-            if (word == "sin") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<double>>(FunctionType::sin, parse_real(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
-                    exit(EXIT_FAILURE);
-                }
-            }
-            else if (word == "cos") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<double>>(FunctionType::cos, parse_real(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
-                    exit(EXIT_FAILURE);
-                }
+        ordered[pos - names.begin()] = vals[i];
+        given[pos - names.begin()] = true;
+    }
+    for (unsigned i = 0; i < names.size(); i++) {
+        if (!given[i]) {
+            std::cerr << "Something went wrong, trying to calcualte a variable.\n" << "Variable name: " << names[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    return ordered;
+}
+
+template <typename T> T FlatExpression<T>::calculate(std::vector<std::string> vars, std::vector<T> vals) const {
+    std::vector<T> ordered = order(vars, vals);
+    std::vector<T> scratch(nodes.size());
+    return calculate(ordered.data(), scratch.data());
+}
+
+// Обратный режим автоматического дифференцирования. Плоская запись - это и есть лента: прямой проход calculate
+// оставляет в scratch значение каждой ноды, затем один обратный проход от корня к листьям накапливает в adjoint
+// производную корня по каждой ноде. grad получает производные по переменным в порядке names.
+template <typename T> template <typename U> U FlatExpression<T>::gradient(const U* vals, U* grad, U* scratch, U* adjoint) const {
+    using std::sin;
+    using std::cos;
+    using std::log;
+    using std::pow;
+    const U zero = U((T)0), one = U((T)1);
+    U value = evaluate<U>(vals, scratch);
+    std::fill(adjoint, adjoint + nodes.size(), zero);
+    std::fill(grad, grad + names.size(), zero);
+    adjoint[nodes.size() - 1] = one;
+    for (uint32_t i = nodes.size(); i-- > 0;) {
+        const FlatNode &record = nodes[i];
+        U adj = adjoint[i];
+        if constexpr (std::is_same_v<U, T>) {
+            if (adj == zero) continue;
+        }
+        if (record.kind == NodeKind::var) grad[record.left] += adj;
+        else if (record.kind == NodeKind::func) {
+            U arg = scratch[record.left];
+            switch ((FunctionType)record.type) {
+                case FunctionType::sin: adjoint[record.left] += adj * cos(arg); break;
+                case FunctionType::cos: adjoint[record.left] -= adj * sin(arg); break;
+                case FunctionType::ln: adjoint[record.left] += adj / arg; break;
+                case FunctionType::exp: adjoint[record.left] += adj * scratch[i]; break;
             }
-            else if (word == "exp") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<double>>(FunctionType::exp, parse_real(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
-                    exit(EXIT_FAILURE);
-                }
+        }
+        else if (record.kind == NodeKind::op) {
+            U left = scratch[record.left];
+            U right = scratch[record.right];
+            switch ((OperationType)record.type) {
+                case OperationType::add:
+                    adjoint[record.left] += adj;
+                    adjoint[record.right] += adj;
+                    break;
+                case OperationType::sub:
+                    adjoint[record.left] += adj;
+                    adjoint[record.right] -= adj;
+                    break;
+                case OperationType::mult:
+                    adjoint[record.left] += adj * right;
+                    adjoint[record.right] += adj * left;
+                    break;
+                case OperationType::div:
+                    adjoint[record.left] += adj / right;
+                    adjoint[record.right] -= adj * left / (right * right);
+                    break;
+                // Степень с числом в показателе дифференцируется как в diff_func, без логарифма основания,
+                // иначе x ^ 2 в нуле давало бы 0 * ln(0).
+                case OperationType::pow:
+                    adjoint[record.left] += adj * right * pow(left, right - one);
+                    if (nodes[record.right].kind != NodeKind::val) adjoint[record.right] += adj * scratch[i] * log(left);
+                    break;
             }
-            else if (word == "ln") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<double>>(FunctionType::ln, parse_real(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
-                    exit(EXIT_FAILURE);
+        }
+    }
+    return value;
+}
+
+// Структура гессиана без вычислений: какие пары переменных вообще могут взаимодействовать.
+// Для каждой записи считается множество переменных, от которых она зависит. Сложение и вычитание линейны
+// и новых пар не дают, произведение связывает переменные левого операнда с правым, частное - еще и знаменателя
+// с собой, а степень и функции - все свои переменные попарно. Оценка сверху: лишняя пара даст просто ноль.
+template <typename T> std::vector<bool> FlatExpression<T>::hessian_pattern() const {
+    std::size_t n = names.size();
+    std::size_t words = (n + 63) / 64;
+    std::vector<uint64_t> deps(nodes.size() * words, 0);
+    std::vector<bool> pattern(n * n, false);
+    auto connect = [&](uint32_t a, uint32_t b) {
+        for (std::size_t i = 0; i < n; i++) {
+            if (!(deps[a * words + i / 64] >> (i % 64) & 1)) continue;
+            for (std::size_t j = 0; j < n; j++) {
+                if (deps[b * words + j / 64] >> (j % 64) & 1) {
+                    pattern[i * n + j] = true;
+                    pattern[j * n + i] = true;
                 }
             }
-            else {
-                vars->insert(word);
-                current = std::make_shared<Variable<double>>(word);
+        }
+    };
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        const FlatNode &record = nodes[i];
+        if (record.kind == NodeKind::var) deps[i * words + record.left / 64] |= (uint64_t)1 << (record.left % 64);
+        else if (record.kind == NodeKind::func) {
+            for (std::size_t w = 0; w < words; w++) deps[i * words + w] = deps[record.left * words + w];
+            connect(i, i);
+        }
+        else if (record.kind == NodeKind::op) {
+            for (std::size_t w = 0; w < words; w++) deps[i * words + w] = deps[record.left * words + w] | deps[record.right * words + w];
+            OperationType type = (OperationType)record.type;
+            if (type == OperationType::mult) connect(record.left, record.right);
+            if (type == OperationType::div) {
+                connect(record.left, record.right);
+                connect(record.right, record.right);
             }
+            if (type == OperationType::pow) connect(i, i);
         }
-        else if (**it == '+') {
-            (*it)++;
-            skip_spaces(it, end);
-            std::shared_ptr<Operation<double>> operation = std::make_shared<Operation<double>>(OperationType::add, current, parse_real(it, end, vars));
-            current = operation;
-        }
-        else if (**it == '-') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<double>> operation = std::make_shared<Operation<double>>(OperationType::sub, current, parse_real(it, copy, vars));
-            current = operation;
-        }
-        else if (**it == '*') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<double>> operation = std::make_shared<Operation<double>>(OperationType::mult, current, parse_real(it, copy, vars));
-            current = operation;
-        }
-        else if (**it == '/') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<double>> operation = std::make_shared<Operation<double>>(OperationType::div, current, parse_real(it, copy, vars));
-            current = operation;
-        }
-        else if (**it == '^') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<double>> operation = std::make_shared<Operation<double>>(OperationType::pow, current, parse_real(it, copy, vars));
-            current = operation;
+    }
+    return pattern;
+}
+
+template <typename T> template <typename U> std::vector<U> Expression<T>::point_values(const FlatExpression<T> &flat, const std::map<std::string, U> &point) const {
+    std::vector<U> vals(flat.names.size());
+    for (uint32_t i = 0; i < flat.names.size(); i++) {
+        auto found = point.find(flat.names[i]);
+        if (found == point.end()) {
+            std::cerr << "Something went wrong, trying to calcualte a variable.\n" << "Variable name: " << flat.names[i] << "\n";
+            exit(EXIT_FAILURE);
         }
-        else {
-            std::cerr << "Non-algebraic expression! Met wrong symbol:" << (int)**it << "\n";
+        vals[i] = found->second;
+    }
+    for (auto it = point.begin(); it != point.end(); it++) {
+        if (variables.find(it->first) == variables.end()) {
+            std::cerr <<"\"" << it->first << "\" - no such variable!";
             exit(EXIT_FAILURE);
         }
     }
-    return current;
-}
-
-std::shared_ptr<Node<std::complex<double>>> parse_complex(std::string::iterator *it, std::string::iterator end, std::unordered_set<std::string> *vars) {
-    std::shared_ptr<Node<std::complex<double>>> current = nullptr;
-    while (*it < end && **it != ')') {
-        if (**it == ' ') skip_spaces(it, end);
-        else if (**it == '(') {
-            (*it)++;
-            current = parse_complex(it, end, vars);
-            (*it)++;
-        }
-        else if (**it >= '0' && **it <= '9') {
-            double first = parse_number(it, end);
-            if (**it == ' ') skip_spaces(it, end);
-            if (**it == '+') {
-                (*it)++;
-                if (**it == ' ') skip_spaces(it, end);
-                if (**it >= '0' && **it <= '9') {
-                    double second = parse_number(it, end);
-                    if (**it == 'i') {
-                        current = std::make_shared<Value<std::complex<double>>>(std::complex<double>(first, second));
-                        (*it)++;
-                        if (*it < end && ((**it >= 'a' && **it <= 'z') || (**it <= 'Z' && **it >= 'A'))) {
-                            std::cerr << "Cannot parse expression, expected a complex number!\n";
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                    else {
-                        std::shared_ptr<Value<std::complex<double>>> left = std::make_shared<Value<std::complex<double>>>(std::complex<double>(first, 0));
-                        std::shared_ptr<Value<std::complex<double>>> right = std::make_shared<Value<std::complex<double>>>(std::complex<double>(second, 0));
-                        current = std::make_shared<Operation<std::complex<double>>>(OperationType::add, left, right);
-                    }
+    return vals;
+}
+
+template <typename T> Gradient<T> Expression<T>::gradient(const std::map<std::string, T> &point) const {
+    FlatExpression<T> flat = flatten();
+    std::vector<T> vals = point_values(flat, point);
+    std::vector<T> grad(flat.names.size()), scratch(flat.nodes.size()), adjoint(flat.nodes.size());
+    Gradient<T> result;
+    result.value = flat.gradient(vals.data(), grad.data(), scratch.data(), adjoint.data());
+    for (auto it = variables.begin(); it != variables.end(); it++) result.partials[*it] = (T)0;
+    for (uint32_t i = 0; i < flat.names.size(); i++) result.partials[flat.names[i]] = grad[i];
+    return result;
+}
+
+// Второй операнд дописывается в конец со сдвигом индексов, после него - новый корень.
+template <typename T> FlatExpression<T>& FlatExpression<T>::combine(OperationType __type, const FlatExpression<T> &other) {
+    if (&other == this) return combine(__type, FlatExpression<T>(other));
+    uint32_t left = nodes.size() - 1;
+    uint32_t offset = nodes.size();
+    uint32_t constants_offset = constants.size();
+    std::vector<uint32_t> renamed(other.names.size());
+    for (uint32_t i = 0; i < other.names.size(); i++) renamed[i] = name_index(other.names[i]);
+    nodes.reserve(nodes.size() + other.nodes.size() + 1);
+    for (const FlatNode &record : other.nodes) {
+        FlatNode copy = record;
+        if (copy.kind == NodeKind::val) copy.left += constants_offset;
+        else if (copy.kind == NodeKind::var) copy.left = renamed[copy.left];
+        else {
+            copy.left += offset;
+            copy.right += offset;
+        }
+        nodes.push_back(copy);
+    }
+    constants.insert(constants.end(), other.constants.begin(), other.constants.end());
+    nodes.push_back({NodeKind::op, (char)__type, left, (uint32_t)nodes.size() - 1});
+    return *this;
+}
+
+template <typename T> FlatExpression<T>& FlatExpression<T>::apply(FunctionType __type) {
+    nodes.push_back({NodeKind::func, (char)__type, (uint32_t)nodes.size() - 1, 0});
+    return *this;
+}
+
+template <typename T> FlatExpression<T>& FlatExpression<T>::operator +=(const FlatExpression<T> &other) {
+    return combine(OperationType::add, other);
+}
+
+template <typename T> FlatExpression<T> FlatExpression<T>::operator +(const FlatExpression<T> &other) const {
+    FlatExpression<T> copy(*this);
+    copy.combine(OperationType::add, other);
+    return copy;
+}
+
+template <typename T> FlatExpression<T>& FlatExpression<T>::operator -=(const FlatExpression<T> &other) {
+    return combine(OperationType::sub, other);
+}
+
+template <typename T> FlatExpression<T> FlatExpression<T>::operator -(const FlatExpression<T> &other) const {
+    FlatExpression<T> copy(*this);
+    copy.combine(OperationType::sub, other);
+    return copy;
+}
+
+template <typename T> FlatExpression<T>& FlatExpression<T>::operator *=(const FlatExpression<T> &other) {
+    return combine(OperationType::mult, other);
+}
+
+template <typename T> FlatExpression<T> FlatExpression<T>::operator *(const FlatExpression<T> &other) const {
+    FlatExpression<T> copy(*this);
+    copy.combine(OperationType::mult, other);
+    return copy;
+}
+
+template <typename T> FlatExpression<T>& FlatExpression<T>::operator /=(const FlatExpression<T> &other) {
+    return combine(OperationType::div, other);
+}
+
+template <typename T> FlatExpression<T> FlatExpression<T>::operator /(const FlatExpression<T> &other) const {
+    FlatExpression<T> copy(*this);
+    copy.combine(OperationType::div, other);
+    return copy;
+}
+
+template <typename T> FlatExpression<T>& FlatExpression<T>::operator ^=(const FlatExpression<T> &other) {
+    return combine(OperationType::pow, other);
+}
+
+template <typename T> FlatExpression<T> FlatExpression<T>::operator ^(const FlatExpression<T> &other) const {
+    FlatExpression<T> copy(*this);
+    copy.combine(OperationType::pow, other);
+    return copy;
+}
+
+template <typename T> FlatExpression<T> sin(FlatExpression<T> e) {
+    e.apply(FunctionType::sin);
+    return e;
+}
+
+template <typename T> FlatExpression<T> cos(FlatExpression<T> e) {
+    e.apply(FunctionType::cos);
+    return e;
+}
+
+template <typename T> FlatExpression<T> ln(FlatExpression<T> e) {
+    e.apply(FunctionType::ln);
+    return e;
+}
+
+template <typename T> FlatExpression<T> exp(FlatExpression<T> e) {
+    e.apply(FunctionType::exp);
+    return e;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Дуальные числа
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T, std::size_t N> Dual<T, N>::Dual() {
+    value = T();
+    tangent.fill(T());
+}
+
+template <typename T, std::size_t N> Dual<T, N>::Dual(T __value) {
+    value = __value;
+    tangent.fill(T());
+}
+
+template <typename T, std::size_t N> Dual<T, N>::Dual(T __value, std::array<T, N> __tangent) {
+    value = __value;
+    tangent = __tangent;
+}
+
+template <typename T, std::size_t N> Dual<T, N> operator+(const Dual<T, N> &a, const Dual<T, N> &b) {
+    Dual<T, N> result(a.value + b.value);
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = a.tangent[i] + b.tangent[i];
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N> operator-(const Dual<T, N> &a, const Dual<T, N> &b) {
+    Dual<T, N> result(a.value - b.value);
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = a.tangent[i] - b.tangent[i];
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N> operator*(const Dual<T, N> &a, const Dual<T, N> &b) {
+    Dual<T, N> result(a.value * b.value);
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = a.tangent[i] * b.value + a.value * b.tangent[i];
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N> operator/(const Dual<T, N> &a, const Dual<T, N> &b) {
+    Dual<T, N> result(a.value / b.value);
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = (a.tangent[i] * b.value - a.value * b.tangent[i]) / (b.value * b.value);
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N>& operator+=(Dual<T, N> &a, const Dual<T, N> &b) {
+    a = a + b;
+    return a;
+}
+
+template <typename T, std::size_t N> Dual<T, N>& operator-=(Dual<T, N> &a, const Dual<T, N> &b) {
+    a = a - b;
+    return a;
+}
+
+// Производная по показателю требует логарифма основания, поэтому считается, только если показатель от чего-то зависит.
+template <typename T, std::size_t N> Dual<T, N> pow(const Dual<T, N> &a, const Dual<T, N> &b) {
+    Dual<T, N> result(std::pow(a.value, b.value));
+    T base = b.value * std::pow(a.value, b.value - (T)1);
+    for (std::size_t i = 0; i < N; i++) {
+        result.tangent[i] = base * a.tangent[i];
+        if (b.tangent[i] != (T)0) result.tangent[i] += result.value * std::log(a.value) * b.tangent[i];
+    }
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N> sin(const Dual<T, N> &a) {
+    Dual<T, N> result(std::sin(a.value));
+    T outer = std::cos(a.value);
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = outer * a.tangent[i];
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N> cos(const Dual<T, N> &a) {
+    Dual<T, N> result(std::cos(a.value));
+    T outer = -std::sin(a.value);
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = outer * a.tangent[i];
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N> log(const Dual<T, N> &a) {
+    Dual<T, N> result(std::log(a.value));
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = a.tangent[i] / a.value;
+    return result;
+}
+
+template <typename T, std::size_t N> Dual<T, N> exp(const Dual<T, N> &a) {
+    Dual<T, N> result(std::exp(a.value));
+    for (std::size_t i = 0; i < N; i++) result.tangent[i] = result.value * a.tangent[i];
+    return result;
+}
+
+// tangents[i] - направления для переменной vars[i]: k-я касательная результата - производная по k-му направлению.
+template <typename T> template <std::size_t N> Dual<T, N> Expression<T>::calculate_dual(std::vector<std::string> vars, std::vector<T> vals, std::vector<std::array<T, N>> tangents) const {
+    if (vals.size() != tangents.size()) {
+        std::cerr << "Number of values does not match number of tangents!";
+        exit(EXIT_FAILURE);
+    }
+    FlatExpression<T> flat = flatten();
+    std::vector<Dual<T, N>> duals;
+    duals.reserve(vals.size());
+    for (unsigned i = 0; i < vals.size(); i++) duals.emplace_back(vals[i], tangents[i]);
+    std::vector<Dual<T, N>> ordered = flat.order(vars, duals);
+    std::vector<Dual<T, N>> scratch(flat.nodes.size());
+    return flat.evaluate(ordered.data(), scratch.data());
+}
+
+template <typename T> T Expression<T>::derivative(std::string __name, std::vector<std::string> vars, std::vector<T> vals) const {
+    std::vector<std::array<T, 1>> tangents;
+    for (unsigned i = 0; i < vars.size(); i++) tangents.push_back({vars[i] == __name ? (T)1 : (T)0});
+    return calculate_dual<1>(vars, vals, tangents).tangent[0];
+}
+
+// Гессиан считается прямым режимом поверх обратного: обратный проход gradient идет над дуальными числами,
+// и касательные градиента - это произведения гессиана на направления, заданные в касательных переменных.
+// За один проход считается 4 столбца. В разреженном режиме столбцы, у которых нет общих ненулевых строк,
+// раскрашиваются в один цвет и считаются одним направлением - сумма их не смешивает, а столбцы без
+// взаимодействий не считаются вовсе.
+template <typename T> Hessian<T> Expression<T>::hessian(const std::map<std::string, T> &point, bool sparse) const {
+    const std::size_t width = 4;
+    const unsigned none = (unsigned)-1;
+    FlatExpression<T> flat = flatten();
+    std::vector<T> vals = point_values(flat, point);
+    std::size_t n = flat.names.size();
+    std::vector<unsigned> color(n, none);
+    std::vector<bool> pattern;
+    unsigned colors = 0;
+    if (sparse) {
+        pattern = flat.hessian_pattern();
+        for (std::size_t j = 0; j < n; j++) {
+            std::vector<bool> forbidden(colors, false);
+            bool used = false;
+            for (std::size_t i = 0; i < n; i++) {
+                if (!pattern[i * n + j]) continue;
+                used = true;
+                for (std::size_t k = 0; k < j; k++) {
+                    if (pattern[i * n + k] && color[k] != none) forbidden[color[k]] = true;
                 }
             }
-            else current = std::make_shared<Value<std::complex<double>>>(std::complex<double>(first, 0));
-        }
-        else if ((**it >= 'a' && **it <= 'z') || (**it >= 'A' && **it <= 'Z')) {
-            std::string word = parse_string(it, end);
-            if (word == "sin") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<std::complex<double>>>(FunctionType::sin, parse_complex(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
-                    exit(EXIT_FAILURE);
-                }
+            if (!used) continue;
+            color[j] = std::find(forbidden.begin(), forbidden.end(), false) - forbidden.begin();
+            if (color[j] == colors) colors++;
+        }
+    }
+    else {
+        for (std::size_t j = 0; j < n; j++) color[j] = j;
+        colors = n;
+    }
+    std::vector<Dual<T, width>> seeds(n), grad(n), scratch(flat.nodes.size()), adjoint(flat.nodes.size());
+    std::vector<T> matrix(n * n, (T)0);
+    Hessian<T> result;
+    result.passes = 0;
+    result.gradient.assign(n, (T)0);
+    for (unsigned first = 0; first == 0 || first < colors; first += width) {
+        for (std::size_t i = 0; i < n; i++) {
+            seeds[i] = Dual<T, width>(vals[i]);
+            for (std::size_t k = 0; k < width; k++) {
+                if (color[i] == first + k) seeds[i].tangent[k] = (T)1;
             }
-            else if (word == "cos") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<std::complex<double>>>(FunctionType::sin, parse_complex(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
-                    exit(EXIT_FAILURE);
-                }
+        }
+        result.value = flat.gradient(seeds.data(), grad.data(), scratch.data(), adjoint.data()).value;
+        for (std::size_t i = 0; i < n; i++) result.gradient[i] = grad[i].value;
+        for (std::size_t j = 0; j < n; j++) {
+            if (color[j] == none || color[j] < first || color[j] >= first + width) continue;
+            for (std::size_t i = j; i < n; i++) {
+                if (sparse && !pattern[i * n + j]) continue;
+                matrix[i * n + j] = grad[i].tangent[color[j] - first];
+                matrix[j * n + i] = matrix[i * n + j];
             }
-            else if (word == "exp") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<std::complex<double>>>(FunctionType::sin, parse_complex(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
-                    exit(EXIT_FAILURE);
-                }
+        }
+        result.passes++;
+    }
+    result.names = std::vector<std::string>(variables.begin(), variables.end());
+    std::sort(result.names.begin(), result.names.end());
+    std::size_t m = result.names.size();
+    std::vector<std::size_t> position(n);
+    for (std::size_t i = 0; i < n; i++) position[i] = std::find(result.names.begin(), result.names.end(), flat.names[i]) - result.names.begin();
+    std::vector<T> gradient(m, (T)0);
+    result.matrix.assign(m * m, (T)0);
+    for (std::size_t i = 0; i < n; i++) {
+        gradient[position[i]] = result.gradient[i];
+        for (std::size_t j = 0; j < n; j++) result.matrix[position[i] * m + position[j]] = matrix[i * n + j];
+    }
+    result.gradient = gradient;
+    return result;
+}
+
+template <typename T> std::map<std::string, T> Expression<T>::hessian_vector(const std::map<std::string, T> &point, const std::map<std::string, T> &direction) const {
+    FlatExpression<T> flat = flatten();
+    std::vector<T> vals = point_values(flat, point);
+    for (auto it = direction.begin(); it != direction.end(); it++) {
+        if (variables.find(it->first) == variables.end()) {
+            std::cerr <<"\"" << it->first << "\" - no such variable!";
+            exit(EXIT_FAILURE);
+        }
+    }
+    std::size_t n = flat.names.size();
+    std::vector<Dual<T, 1>> seeds(n), grad(n), scratch(flat.nodes.size()), adjoint(flat.nodes.size());
+    for (std::size_t i = 0; i < n; i++) {
+        auto found = direction.find(flat.names[i]);
+        seeds[i] = Dual<T, 1>(vals[i], {found == direction.end() ? (T)0 : found->second});
+    }
+    flat.gradient(seeds.data(), grad.data(), scratch.data(), adjoint.data());
+    std::map<std::string, T> result;
+    for (auto it = variables.begin(); it != variables.end(); it++) result[*it] = (T)0;
+    for (std::size_t i = 0; i < n; i++) result[flat.names[i]] = grad[i].tangent[0];
+    return result;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Интервальная арифметика
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T> Interval<T>::Interval() : lower(T()), upper(T()), faults(0) {}
+
+template <typename T> Interval<T>::Interval(T value) : lower(value), upper(value), faults(0) {}
+
+template <typename T> Interval<T>::Interval(T __lower, T __upper, unsigned char __faults) : lower(__lower), upper(__upper), faults(__faults) {}
+
+template <typename T> bool Interval<T>::contains(T value) const {
+    return lower <= value && value <= upper;
+}
+
+// Границы после вычисления сдвигаются наружу на одно представимое число: сложение и деление округляют правильно,
+// а sin, exp, log и pow в libm ошибаются меньше чем на единицу последнего разряда.
+template <typename T> T interval_down(T value) {
+    return std::isinf(value) ? value : std::nextafter(value, -std::numeric_limits<T>::infinity());
+}
+
+template <typename T> T interval_up(T value) {
+    return std::isinf(value) ? value : std::nextafter(value, std::numeric_limits<T>::infinity());
+}
+
+template <typename T> Interval<T> interval_outward(T lower, T upper, unsigned char faults) {
+    return Interval<T>(interval_down(lower), interval_up(upper), faults);
+}
+
+template <typename T> Interval<T> interval_whole(unsigned char faults) {
+    return Interval<T>(-std::numeric_limits<T>::infinity(), std::numeric_limits<T>::infinity(), faults);
+}
+
+template <typename T> Interval<T> operator+(const Interval<T> &a, const Interval<T> &b) {
+    return interval_outward(a.lower + b.lower, a.upper + b.upper, a.faults | b.faults);
+}
+
+template <typename T> Interval<T> operator-(const Interval<T> &a, const Interval<T> &b) {
+    return interval_outward(a.lower - b.upper, a.upper - b.lower, a.faults | b.faults);
+}
+
+// Ноль на бесконечность дает ноль: бесконечная граница - это предел, а не значение.
+template <typename T> Interval<T> operator*(const Interval<T> &a, const Interval<T> &b) {
+    auto product = [](T x, T y) { return x == (T)0 || y == (T)0 ? (T)0 : x * y; };
+    T corners[4] = {product(a.lower, b.lower), product(a.lower, b.upper), product(a.upper, b.lower), product(a.upper, b.upper)};
+    return interval_outward(*std::min_element(corners, corners + 4), *std::max_element(corners, corners + 4), a.faults | b.faults);
+}
+
+// Обратное значение. Если интервал задевает ноль, это возможное деление на ноль; с нулем на краю результат - луч.
+template <typename T> Interval<T> interval_reciprocal(const Interval<T> &a) {
+    const T infinity = std::numeric_limits<T>::infinity();
+    if (a.lower > (T)0 || a.upper < (T)0) return interval_outward((T)1 / a.upper, (T)1 / a.lower, a.faults);
+    unsigned char faults = a.faults | Interval<T>::division;
+    if (a.lower == (T)0 && a.upper > (T)0) return Interval<T>(interval_down((T)1 / a.upper), infinity, faults);
+    if (a.upper == (T)0 && a.lower < (T)0) return Interval<T>(-infinity, interval_up((T)1 / a.lower), faults);
+    return interval_whole<T>(faults);
+}
+
+template <typename T> Interval<T> operator/(const Interval<T> &a, const Interval<T> &b) {
+    if (b.lower == b.upper && b.lower != (T)0) {
+        T first = a.lower / b.lower, second = a.upper / b.lower;
+        return interval_outward(std::min(first, second), std::max(first, second), a.faults | b.faults);
+    }
+    return a * interval_reciprocal(b);
+}
+
+// Есть ли в [lower, upper] точка phase + 2 pi k. Сравнение с запасом: pi приближенное, и лишний экстремум
+// только расширяет границы, а пропущенный сузил бы их неверно.
+template <typename T> bool interval_hits(T lower, T upper, T phase) {
+    const T period = 2 * std::numbers::pi_v<T>;
+    T slack = 4 * std::numeric_limits<T>::epsilon() * std::max({(T)1, std::abs(lower), std::abs(upper)});
+    T k = std::ceil((lower - slack - phase) / period);
+    return phase + k * period <= upper + slack;
+}
+
+// Экстремумы синуса и косинуса внутри интервала ищутся по периоду; интервал длиннее периода дает [-1, 1].
+template <typename T> Interval<T> interval_periodic(const Interval<T> &a, T maximum, T minimum, T (*function)(T)) {
+    if (std::isinf(a.lower) || std::isinf(a.upper) || a.upper - a.lower >= 2 * std::numbers::pi_v<T>) return Interval<T>((T)-1, (T)1, a.faults);
+    T first = function(a.lower), second = function(a.upper);
+    T lower = interval_hits(a.lower, a.upper, minimum) ? (T)-1 : interval_down(std::min(first, second));
+    T upper = interval_hits(a.lower, a.upper, maximum) ? (T)1 : interval_up(std::max(first, second));
+    return Interval<T>(std::max(lower, (T)-1), std::min(upper, (T)1), a.faults);
+}
+
+template <typename T> Interval<T> sin(const Interval<T> &a) {
+    return interval_periodic<T>(a, std::numbers::pi_v<T> / 2, -std::numbers::pi_v<T> / 2, [](T x) { return std::sin(x); });
+}
+
+template <typename T> Interval<T> cos(const Interval<T> &a) {
+    return interval_periodic<T>(a, (T)0, std::numbers::pi_v<T>, [](T x) { return std::cos(x); });
+}
+
+// Часть интервала не правее нуля - вне области определения: логарифм там не считается, но отмечается.
+template <typename T> Interval<T> log(const Interval<T> &a) {
+    if (a.lower > (T)0) return interval_outward(std::log(a.lower), std::log(a.upper), a.faults);
+    unsigned char faults = a.faults | Interval<T>::logarithm;
+    if (a.upper <= (T)0) return interval_whole<T>(faults);
+    return Interval<T>(-std::numeric_limits<T>::infinity(), interval_up(std::log(a.upper)), faults);
+}
+
+template <typename T> Interval<T> exp(const Interval<T> &a) {
+    return Interval<T>(std::max((T)0, interval_down(std::exp(a.lower))), interval_up(std::exp(a.upper)), a.faults);
+}
+
+// Целый показатель-число: степень монотонна на каждой полуоси, четная степень интервала через ноль начинается с нуля,
+// отрицательная - обратное значение (основание с нулем - деление на ноль). Иначе на [0, inf) x ^ y монотонна
+// по каждому аргументу, так что крайние значения - в углах. Отрицательное основание с дробным показателем
+// отмечается, но с целыми k из показателя дает +-|x| ^ k: модуль оценивается по углам |x| и k, а знак известен,
+// только если такое k одно.
+template <typename T> Interval<T> pow(const Interval<T> &a, const Interval<T> &b) {
+    unsigned char faults = a.faults | b.faults;
+    if (b.lower == b.upper && std::isfinite(b.lower) && std::trunc(b.lower) == b.lower && std::abs(b.lower) < (T)(1ull << 53)) {
+        T n = b.lower;
+        if (n == (T)0) return Interval<T>((T)1, (T)1, faults);
+        T m = std::abs(n), first = std::pow(a.lower, m), second = std::pow(a.upper, m);
+        Interval<T> result;
+        if (std::fmod(m, (T)2) != (T)0 || a.lower >= (T)0) result = interval_outward(first, second, faults);
+        else if (a.upper <= (T)0) result = interval_outward(second, first, faults);
+        else result = Interval<T>((T)0, interval_up(std::max(first, second)), faults);
+        if (result.lower < (T)0 && a.lower >= (T)0) result.lower = (T)0;
+        return n > (T)0 ? result : interval_reciprocal(result);
+    }
+    if (a.lower < (T)0) faults |= Interval<T>::power;
+    T first = std::ceil(b.lower), last = std::floor(b.upper);
+    bool integers = a.lower < (T)0 && first <= last;
+    T negative_lower = std::numeric_limits<T>::infinity(), negative_upper = -negative_lower;
+    if (integers) {
+        T near = a.upper < (T)0 ? -a.upper : (T)0, far = -a.lower;
+        if (near == (T)0 && first < (T)0) faults |= Interval<T>::division;
+        T magnitudes[4] = {std::pow(near, first), std::pow(near, last), std::pow(far, first), std::pow(far, last)};
+        T smallest = interval_down(*std::min_element(magnitudes, magnitudes + 4));
+        T largest = interval_up(*std::max_element(magnitudes, magnitudes + 4));
+        negative_lower = -largest;
+        negative_upper = largest;
+        if (first == last && std::fmod(first, (T)2) == (T)0) negative_lower = std::max((T)0, smallest);
+        else if (first == last) negative_upper = -std::max((T)0, smallest);
+    }
+    if (a.upper < (T)0) return integers ? Interval<T>(negative_lower, negative_upper, faults) : interval_whole<T>(faults);
+    T base = std::max(a.lower, (T)0);
+    if (base == (T)0 && b.lower < (T)0) faults |= Interval<T>::division;
+    T corners[4] = {std::pow(base, b.lower), std::pow(base, b.upper), std::pow(a.upper, b.lower), std::pow(a.upper, b.upper)};
+    T lower = *std::min_element(corners, corners + 4), upper = *std::max_element(corners, corners + 4);
+    lower = std::max((T)0, interval_down(lower));
+    return Interval<T>(std::min(lower, negative_lower), std::max(interval_up(upper), negative_upper), faults);
+}
+
+// Один проход по плоской записи над интервалами. Переменные box должны совпадать с переменными выражения.
+template <typename T> Interval<T> Expression<T>::calculate_interval(const std::map<std::string, Interval<T>> &box) const {
+    FlatExpression<T> flat = flatten();
+    std::vector<Interval<T>> vals = point_values(flat, box);
+    std::vector<Interval<T>> scratch(flat.nodes.size());
+    return flat.evaluate(vals.data(), scratch.data());
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Компиляция в байткод и интерпретатор
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T> Program<T> Expression<T>::compile() const {
+    std::vector<std::string> vars(variables.begin(), variables.end());
+    std::sort(vars.begin(), vars.end());
+    return compile(vars);
+}
+
+template <typename T> Program<T> Expression<T>::compile(std::vector<std::string> vars) const {
+    for (auto it = variables.begin(); it != variables.end(); it++) {
+        if (std::find(vars.begin(), vars.end(), *it) == vars.end()) {
+            std::cerr << "\"" << *it << "\" - variable has no slot!";
+            exit(EXIT_FAILURE);
+        }
+    }
+    Expression<T> copy = *this;
+    copy.simplify();
+    return Program<T>(copy.head->next, vars);
+}
+
+template <typename T> Program<T>::Program(std::shared_ptr<Node<T>> node, std::vector<std::string> __slots) {
+    slots = __slots;
+    count_uses(node);
+    unsigned constants_count = 0;
+    for (auto it = uses.begin(); it != uses.end(); it++) {
+        if (it->first->kind == NodeKind::val) constants_count++;
+        else if (it->first->kind != NodeKind::var && it->second > 1) shared++;
+    }
+    constants.reserve(constants_count);
+    temp_base = slots.size() + constants_count + shared;
+    result = lower(node, 0);
+    registers = make_registers();
+    uses.clear();
+    lowered.clear();
+}
+
+// Первый проход считает, сколько родителей у каждой ноды, чтобы заранее знать раскладку регистров
+// и какие ноды - общие поддеревья, значение которых нужно сохранить для повторного использования.
+template <typename T> void Program<T>::count_uses(std::shared_ptr<Node<T>> node) {
+    walk_func<T>(node, [&](const std::shared_ptr<Node<T>> &current) {
+        return ++uses[current.get()] == 1;
+    }, [](const std::shared_ptr<Node<T>> &, bool) {});
+}
+
+// Возвращает регистр, в котором окажется значение ноды. top - номер первого свободного временного регистра:
+// временные значения распределяются как стек, поэтому их нужно не больше, чем глубина дерева.
+// Вместо рекурсии - стек кадров: stage говорит, какой потомок уже разобран, а регистр последнего разобранного
+// потомка лежит в reg.
+template <typename T> unsigned Program<T>::lower(std::shared_ptr<Node<T>> node, unsigned top) {
+    struct Frame {
+        Node<T>* node;
+        unsigned top;
+        int stage;
+        unsigned left;
+    };
+    unsigned base = temp_base;
+    unsigned reg = 0;
+    std::vector<Frame> frames;
+    frames.push_back({node.get(), top, 0, 0});
+    // Значение внутренней ноды: общие поддеревья получают свой регистр навсегда, остальные - вершину стека временных.
+    auto emit = [&](Node<T>* current, unsigned current_top, Instruction instruction) {
+        if (uses[current] > 1) {
+            instruction.dest = temp_base - shared + shared_next++;
+            lowered[current] = instruction.dest;
+        }
+        else {
+            instruction.dest = base + current_top;
+            if (current_top + 1 > temporaries) temporaries = current_top + 1;
+        }
+        code.push_back(instruction);
+        return instruction.dest;
+    };
+    while (!frames.empty()) {
+        Frame frame = frames.back();
+        Node<T>* current = frame.node;
+        if (frame.stage == 0) {
+            auto done = lowered.find(current);
+            if (done != lowered.end()) {
+                reg = done->second;
+                frames.pop_back();
+                continue;
             }
-            else if (word == "ln") {
-                if (**it == '(') {
-                    (*it)++;
-                    current = std::make_shared<Function<std::complex<double>>>(FunctionType::sin, parse_complex(it, end, vars));
-                    (*it)++;
-                }
-                else {
-                    std::cerr << "Function has no argument!\n";
+            if (current->kind == NodeKind::val) {
+                constants.push_back(static_cast<Value<T>*>(current)->value);
+                lowered[current] = slots.size() + constants.size() - 1;
+                reg = slots.size() + constants.size() - 1;
+                frames.pop_back();
+                continue;
+            }
+            if (current->kind == NodeKind::var) {
+                int index = slot(static_cast<Variable<T>*>(current)->name);
+                if (index < 0) {
+                    std::cerr << "\"" << static_cast<Variable<T>*>(current)->name << "\" - variable has no slot!";
                     exit(EXIT_FAILURE);
                 }
+                reg = index;
+                frames.pop_back();
+                continue;
             }
-            else if (word == "i") {
-                current = std::make_shared<Value<std::complex<double>>>(std::complex<double>(0, 1));
-            }
+            frames.back().stage = 1;
+            if (current->kind == NodeKind::func) frames.push_back({static_cast<Function<T>*>(current)->arg.get(), frame.top, 0, 0});
+            else if (current->kind == NodeKind::op) frames.push_back({static_cast<Operation<T>*>(current)->left.get(), frame.top, 0, 0});
             else {
-                vars->insert(word);
-                current = std::make_shared<Variable<std::complex<double>>>(word);
+                std::cerr << "Something went wrong, head is an inner node of the tree.\n";
+                exit(EXIT_FAILURE);
             }
+            continue;
         }
-        else if (**it == '+') {
-            (*it)++;
-            skip_spaces(it, end);
-            std::shared_ptr<Operation<std::complex<double>>> operation = std::make_shared<Operation<std::complex<double>>>(OperationType::add, current, parse_complex(it, end, vars));
-            current = operation;
-        }
-        else if (**it == '-') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<std::complex<double>>> operation = std::make_shared<Operation<std::complex<double>>>(OperationType::sub, current, parse_complex(it, copy, vars));
-            current = operation;
-        }
-        else if (**it == '*') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<std::complex<double>>> operation = std::make_shared<Operation<std::complex<double>>>(OperationType::mult, current, parse_complex(it, copy, vars));
-            current = operation;
-        }
-        else if (**it == '/') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<std::complex<double>>> operation = std::make_shared<Operation<std::complex<double>>>(OperationType::div, current, parse_complex(it, copy, vars));
-            current = operation;
-        }
-        else if (**it == '^') {
-            (*it)++;
-            skip_spaces(it, end);
-            auto copy = *it;
-            find_end(&copy, end);
-            std::shared_ptr<Operation<std::complex<double>>> operation = std::make_shared<Operation<std::complex<double>>>(OperationType::pow, current, parse_complex(it, copy, vars));
-            current = operation;
+        if (current->kind == NodeKind::func) {
+            Function<T>* function = static_cast<Function<T>*>(current);
+            Instruction instruction{};
+            if (function->type == FunctionType::sin) instruction.code = OpCode::sin;
+            if (function->type == FunctionType::cos) instruction.code = OpCode::cos;
+            if (function->type == FunctionType::ln) instruction.code = OpCode::ln;
+            if (function->type == FunctionType::exp) instruction.code = OpCode::exp;
+            instruction.left = reg;
+            instruction.right = reg;
+            frames.pop_back();
+            reg = emit(current, frame.top, instruction);
+            continue;
         }
-        else {
-            std::cerr << "Non-algebraic expression! Met wrong symbol:" << **it << "\n";
-            exit(EXIT_FAILURE);
+        Operation<T>* operation = static_cast<Operation<T>*>(current);
+        if (frame.stage == 1) {
+            frames.back().stage = 2;
+            frames.back().left = reg;
+            frames.push_back({operation->right.get(), reg == base + frame.top ? frame.top + 1 : frame.top, 0, 0});
+            continue;
+        }
+        Instruction instruction{};
+        if (operation->type == OperationType::add) instruction.code = OpCode::add;
+        if (operation->type == OperationType::sub) instruction.code = OpCode::sub;
+        if (operation->type == OperationType::mult) instruction.code = OpCode::mult;
+        if (operation->type == OperationType::div) instruction.code = OpCode::div;
+        if (operation->type == OperationType::pow) instruction.code = OpCode::pow;
+        instruction.left = frame.left;
+        instruction.right = reg;
+        frames.pop_back();
+        reg = emit(current, frame.top, instruction);
+    }
+    return reg;
+}
+
+template <typename T> int Program<T>::slot(std::string __name) const {
+    for (unsigned i = 0; i < slots.size(); i++) {
+        if (slots[i] == __name) return i;
+    }
+    return -1;
+}
+
+template <typename T> unsigned Program<T>::registers_count() const {
+    return slots.size() + constants.size() + shared + temporaries;
+}
+
+template <typename T> std::vector<T> Program<T>::make_registers() const {
+    std::vector<T> regs(registers_count());
+    std::copy(constants.begin(), constants.end(), regs.begin() + slots.size());
+    return regs;
+}
+
+template <typename T> T Program<T>::run(const T* vals, T* regs) const {
+    std::copy(vals, vals + slots.size(), regs);
+    for (const Instruction& instruction : code) {
+        T left = regs[instruction.left];
+        T right = regs[instruction.right];
+        switch (instruction.code) {
+            case OpCode::add: regs[instruction.dest] = left + right; break;
+            case OpCode::sub: regs[instruction.dest] = left - right; break;
+            case OpCode::mult: regs[instruction.dest] = left * right; break;
+            case OpCode::div: regs[instruction.dest] = left / right; break;
+            case OpCode::pow: regs[instruction.dest] = std::pow(left, right); break;
+            case OpCode::sin: regs[instruction.dest] = std::sin(left); break;
+            case OpCode::cos: regs[instruction.dest] = std::cos(left); break;
+            case OpCode::ln: regs[instruction.dest] = std::log(left); break;
+            case OpCode::exp: regs[instruction.dest] = std::exp(left); break;
         }
     }
-    return current;
+    return regs[result];
+}
+
+template <typename T> T Program<T>::run(const T* vals) {
+    return run(vals, registers.data());
+}
+
+template <typename T> T Program<T>::run(const std::vector<T> &vals) {
+    if (vals.size() != slots.size()) {
+        std::cerr << "Number of values does not match number of slots!";
+        exit(EXIT_FAILURE);
+    }
+    return run(vals.data(), registers.data());
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Пакетное вычисление
+//---------------------------------------------------------------------------------------------------------------
+
+// Точки обрабатываются блоками по Program::block штук: каждая инструкция проходит по всему блоку сразу,
+// а регистр занимает block подряд идущих значений. Столбцы входных переменных читаются напрямую, без копирования.
+// Для double сложение, вычитание, умножение и деление идут через SIMD (AVX-512, AVX или SSE2 - что разрешено
+// флагами сборки, см. опцию SGA_NATIVE). Эти операции округляются по IEEE точно так же, как скалярные,
+// а функции и pow вызывают ту же libm поэлементно, поэтому расхождение с run() - 0 ULP.
+
+#if defined(__AVX512F__)
+typedef __m512d simd_double;
+const unsigned simd_width = 8;
+inline simd_double simd_load(const double* p) { return _mm512_loadu_pd(p); }
+inline void simd_store(double* p, simd_double v) { _mm512_storeu_pd(p, v); }
+inline simd_double simd_add(simd_double a, simd_double b) { return _mm512_add_pd(a, b); }
+inline simd_double simd_sub(simd_double a, simd_double b) { return _mm512_sub_pd(a, b); }
+inline simd_double simd_mult(simd_double a, simd_double b) { return _mm512_mul_pd(a, b); }
+inline simd_double simd_div(simd_double a, simd_double b) { return _mm512_div_pd(a, b); }
+#elif defined(__AVX__)
+typedef __m256d simd_double;
+const unsigned simd_width = 4;
+inline simd_double simd_load(const double* p) { return _mm256_loadu_pd(p); }
+inline void simd_store(double* p, simd_double v) { _mm256_storeu_pd(p, v); }
+inline simd_double simd_add(simd_double a, simd_double b) { return _mm256_add_pd(a, b); }
+inline simd_double simd_sub(simd_double a, simd_double b) { return _mm256_sub_pd(a, b); }
+inline simd_double simd_mult(simd_double a, simd_double b) { return _mm256_mul_pd(a, b); }
+inline simd_double simd_div(simd_double a, simd_double b) { return _mm256_div_pd(a, b); }
+#elif defined(__SSE2__)
+typedef __m128d simd_double;
+const unsigned simd_width = 2;
+inline simd_double simd_load(const double* p) { return _mm_loadu_pd(p); }
+inline void simd_store(double* p, simd_double v) { _mm_storeu_pd(p, v); }
+inline simd_double simd_add(simd_double a, simd_double b) { return _mm_add_pd(a, b); }
+inline simd_double simd_sub(simd_double a, simd_double b) { return _mm_sub_pd(a, b); }
+inline simd_double simd_mult(simd_double a, simd_double b) { return _mm_mul_pd(a, b); }
+inline simd_double simd_div(simd_double a, simd_double b) { return _mm_div_pd(a, b); }
+#else
+typedef double simd_double;
+const unsigned simd_width = 1;
+inline simd_double simd_load(const double* p) { return *p; }
+inline void simd_store(double* p, simd_double v) { *p = v; }
+inline simd_double simd_add(simd_double a, simd_double b) { return a + b; }
+inline simd_double simd_sub(simd_double a, simd_double b) { return a - b; }
+inline simd_double simd_mult(simd_double a, simd_double b) { return a * b; }
+inline simd_double simd_div(simd_double a, simd_double b) { return a / b; }
+#endif
+
+// Поэлементный вариант: одна инструкция над n значениями.
+template <typename T> void scalar_kernel(OpCode code, const T* left, const T* right, T* dest, unsigned n) {
+    switch (code) {
+        case OpCode::add: for (unsigned i = 0; i < n; i++) dest[i] = left[i] + right[i]; break;
+        case OpCode::sub: for (unsigned i = 0; i < n; i++) dest[i] = left[i] - right[i]; break;
+        case OpCode::mult: for (unsigned i = 0; i < n; i++) dest[i] = left[i] * right[i]; break;
+        case OpCode::div: for (unsigned i = 0; i < n; i++) dest[i] = left[i] / right[i]; break;
+        case OpCode::pow: for (unsigned i = 0; i < n; i++) dest[i] = std::pow(left[i], right[i]); break;
+        case OpCode::sin: for (unsigned i = 0; i < n; i++) dest[i] = std::sin(left[i]); break;
+        case OpCode::cos: for (unsigned i = 0; i < n; i++) dest[i] = std::cos(left[i]); break;
+        case OpCode::ln: for (unsigned i = 0; i < n; i++) dest[i] = std::log(left[i]); break;
+        case OpCode::exp: for (unsigned i = 0; i < n; i++) dest[i] = std::exp(left[i]); break;
+    }
+}
+
+template <typename T> void batch_kernel(OpCode code, const T* left, const T* right, T* dest, unsigned n) {
+    scalar_kernel<T>(code, left, right, dest, n);
+}
+
+// Арифметика над double - векторными инструкциями, хвост блока и функции - поэлементно.
+template <> inline void batch_kernel<double>(OpCode code, const double* left, const double* right, double* dest, unsigned n) {
+    unsigned i = 0;
+    switch (code) {
+        case OpCode::add:
+            for (; i + simd_width <= n; i += simd_width) simd_store(dest + i, simd_add(simd_load(left + i), simd_load(right + i)));
+            break;
+        case OpCode::sub:
+            for (; i + simd_width <= n; i += simd_width) simd_store(dest + i, simd_sub(simd_load(left + i), simd_load(right + i)));
+            break;
+        case OpCode::mult:
+            for (; i + simd_width <= n; i += simd_width) simd_store(dest + i, simd_mult(simd_load(left + i), simd_load(right + i)));
+            break;
+        case OpCode::div:
+            for (; i + simd_width <= n; i += simd_width) simd_store(dest + i, simd_div(simd_load(left + i), simd_load(right + i)));
+            break;
+        default:
+            break;
+    }
+    if (i < n) scalar_kernel<double>(code, left + i, right + i, dest + i, n - i);
 }
 
-Expression<double> construct_real(std::string input) {
-    std::string::iterator it = input.begin();
-    std::string::iterator end = input.end();
+// Константы размножаются по всему блоку один раз, дальше они ничем не отличаются от обычных регистров.
+template <typename T> std::vector<T> Program<T>::make_batch_registers() const {
+    std::vector<T> regs(registers_count() * block);
+    for (unsigned i = 0; i < constants.size(); i++) {
+        std::fill(regs.begin() + (slots.size() + i) * block, regs.begin() + (slots.size() + i + 1) * block, constants[i]);
+    }
+    return regs;
+}
+
+template <typename T> void Program<T>::run_batch(const T* const* columns, T* out, std::size_t n, T* regs) const {
+    for (std::size_t offset = 0; offset < n; offset += block) {
+        unsigned count = n - offset < block ? n - offset : block;
+        auto source = [&](unsigned reg) -> const T* {
+            if (reg < slots.size()) return columns[reg] + offset;
+            return regs + (std::size_t)reg * block;
+        };
+        for (const Instruction& instruction : code) {
+            batch_kernel<T>(instruction.code, source(instruction.left), source(instruction.right), regs + (std::size_t)instruction.dest * block, count);
+        }
+        std::copy(source(result), source(result) + count, out + offset);
+    }
+}
+
+template <typename T> void Program<T>::run_batch(const std::vector<const T*> &columns, T* out, std::size_t n) {
+    if (columns.size() != slots.size()) {
+        std::cerr << "Number of columns does not match number of slots!";
+        exit(EXIT_FAILURE);
+    }
+    if (batch_registers.empty()) batch_registers = make_batch_registers();
+    run_batch(columns.data(), out, n, batch_registers.data());
+}
+
+template <typename T> void Expression<T>::calculate_batch(std::vector<std::string> vars, std::vector<const T*> columns, T* out, std::size_t n) const {
+    if (vars.size() != columns.size()) {
+        std::cerr << "Number of variables does not match number of columns!";
+        exit(EXIT_FAILURE);
+    }
+    compile(vars).run_batch(columns, out, n);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+// Функции для парсинга:
+//---------------------------------------------------------------------------------------------------------------
+
+// Без error ошибка в записи печатается и завершает программу, как везде в библиотеке. С error запоминается первая
+// ошибка, и parse возвращает nullptr.
+template <typename T> Parser<T>::Parser(std::string_view __input, std::unordered_set<std::string> *__vars, std::string *__error) {
+    input = __input;
+    vars = __vars;
+    error = __error;
+}
+
+constexpr int precedence(char sym) {
+    if (sym == '+' || sym == '-') return 1;
+    if (sym == '*' || sym == '/') return 2;
+    if (sym == '^') return 3;
+    return 0;
+}
+
+template <typename T> void Parser<T>::skip_spaces() {
+    while (pos < input.size() && input[pos] == ' ') pos++;
+}
+
+template <typename T> bool Parser<T>::at_word() const {
+    return pos < input.size() && ((input[pos] >= 'a' && input[pos] <= 'z') || (input[pos] >= 'A' && input[pos] <= 'Z') || input[pos] == '_');
+}
+
+template <typename T> std::string_view Parser<T>::read_word() {
+    std::size_t start = pos;
+    while (pos < input.size() && ((input[pos] >= 'a' && input[pos] <= 'z') || (input[pos] >= 'A' && input[pos] <= 'Z') || input[pos] == '_' || (input[pos] >= '0' && input[pos] <= '9'))) pos++;
+    return input.substr(start, pos - start);
+}
+
+template <typename T> bool Parser<T>::at_number() const {
+    return pos < input.size() && ((input[pos] >= '0' && input[pos] <= '9') || input[pos] == '.');
+}
+
+// На месте операнда - конец строки или чужой символ. На месте оператора лишний символ внутри незакрытой скобки
+// значит, что скобку забыли закрыть.
+template <typename T> std::shared_ptr<Node<T>> Parser<T>::fail_symbol(bool operand) {
+    if (operand && pos >= input.size()) fail("Non-algebraic expression! Unexpected end of input.");
+    else if (operand || open == 0) fail("Non-algebraic expression! Met wrong symbol:" + std::string(1, input[pos]));
+    else fail("Non-algebraic expression! Expected symbol: )");
+    return nullptr;
+}
+
+template <typename T> void Parser<T>::fail(std::string message) {
+    if (!error) {
+        std::cerr << message << "\n";
+        exit(EXIT_FAILURE);
+    }
+    if (!failed) *error = std::move(message);
+    failed = true;
+}
+
+// Сила связывания отложенного оператора в удвоенной шкале приоритетов: унарные операторы (5) - между * и / (4) и ^ (6).
+// Скобки и функции (0) операторами не сворачиваются, их закрывает только ')'.
+template <typename T> int Parser<T>::strength(const Pending &pending) const {
+    if (pending.kind == Pending::binary) return 2 * precedence(pending.sym);
+    if (pending.kind == Pending::negate || pending.kind == Pending::scale) return 5;
+    return 0;
+}
+
+// Применяет верхний отложенный оператор к верхним операндам.
+template <typename T> void Parser<T>::reduce() {
+    Pending pending = std::move(operators.back());
+    operators.pop_back();
+    if (pending.kind == Pending::binary) {
+        std::shared_ptr<Node<T>> right = std::move(operands.back());
+        operands.pop_back();
+        operands.back() = combine(pending.sym, std::move(operands.back()), std::move(right));
+    }
+    else if (pending.kind == Pending::negate) {
+        std::shared_ptr<Node<T>> &operand = operands.back();
+        if (operand->kind == NodeKind::val) operand = std::make_shared<Value<T>>(-node_cast<Value<T>>(operand)->value);
+        else operand = std::make_shared<Operation<T>>(OperationType::mult, std::make_shared<Value<T>>((T)-1), std::move(operand));
+    }
+    else operands.back() = std::make_shared<Operation<T>>(OperationType::mult, std::move(pending.value), std::move(operands.back()));
+}
+
+// Операнд считается прочитанным, когда в стеке операндов прибавилась запись. Функция, открытая скобка, унарный минус
+// и число перед именем ("3x") кладут только отложенный оператор - после них снова ждем операнд.
+template <typename T> std::shared_ptr<Node<T>> Parser<T>::parse() {
+    bool expect_operand = true;
+    while (true) {
+        skip_spaces();
+        if (expect_operand) {
+            if (pos >= input.size()) return fail_symbol(true);
+            std::size_t before = operands.size();
+            char sym = input[pos];
+            if (sym == '-') {
+                pos++;
+                skip_spaces();
+                if (at_number()) push_number(true);
+                else operators.push_back({Pending::negate, '-', FunctionType::sin, nullptr});
+            }
+            else if (sym == '+') pos++;
+            else if (sym == '(') {
+                pos++;
+                open++;
+                operators.push_back({Pending::paren, '(', FunctionType::sin, nullptr});
+            }
+            else if (at_number()) push_number(false);
+            else if (at_word()) push_word();
+            else return fail_symbol(true);
+            if (failed) return nullptr;
+            expect_operand = operands.size() == before;
+            continue;
+        }
+        if (pos >= input.size()) break;
+        char sym = input[pos];
+        if (sym == ')') {
+            if (open == 0) return fail_symbol(false);
+            while (operators.back().kind != Pending::paren && operators.back().kind != Pending::function) reduce();
+            pos++;
+            open--;
+            if (operators.back().kind == Pending::function) operands.back() = std::make_shared<Function<T>>(operators.back().type, std::move(operands.back()));
+            operators.pop_back();
+            continue;
+        }
+        int current = 2 * precedence(sym);
+        if (current == 0) return fail_symbol(false);
+        pos++;
+        // ^ правоассоциативна, поэтому равный по силе ^ в стеке не сворачивается.
+        while (!operators.empty() && (strength(operators.back()) > current || (strength(operators.back()) == current && sym != '^'))) reduce();
+        operators.push_back({Pending::binary, sym, FunctionType::sin, nullptr});
+        expect_operand = true;
+    }
+    if (open > 0) return fail_symbol(false);
+    while (!operators.empty()) reduce();
+    return operands.back();
+}
+
+// Запись вида "12 + 6i" сразу становится одним комплексным числом, как её и печатает two_string.
+template <typename T> std::shared_ptr<Node<T>> Parser<T>::combine(char sym, std::shared_ptr<Node<T>> left, std::shared_ptr<Node<T>> right) {
+    OperationType type;
+    if (sym == '+') type = OperationType::add;
+    if (sym == '-') type = OperationType::sub;
+    if (sym == '*') type = OperationType::mult;
+    if (sym == '/') type = OperationType::div;
+    if (sym == '^') type = OperationType::pow;
+    if constexpr (std::is_same_v<T, std::complex<double>>) {
+        if ((sym == '+' || sym == '-') && left->kind == NodeKind::val && right->kind == NodeKind::val) {
+            T real = node_cast<Value<T>>(left)->value;
+            T imag = node_cast<Value<T>>(right)->value;
+            if (real.imag() == 0 && imag.real() == 0) return std::make_shared<Value<T>>(sym == '+' ? real + imag : real - imag);
+        }
+    }
+    return std::make_shared<Operation<T>>(type, left, right);
+}
+
+template <typename T> std::shared_ptr<Node<T>> Parser<T>::parse_number(bool negative) {
+    double number = 0;
+    std::from_chars_result read = std::from_chars(input.data() + pos, input.data() + input.size(), number);
+    if (read.ec != std::errc()) {
+        fail("Cannot parse a number!");
+        return nullptr;
+    }
+    pos = read.ptr - input.data();
+    if (negative) number = -number;
+    if constexpr (std::is_same_v<T, std::complex<double>>) {
+        if (pos < input.size() && input[pos] == 'i' && (pos + 1 == input.size() || !(std::isalnum((unsigned char)input[pos + 1]) || input[pos + 1] == '_'))) {
+            pos++;
+            return std::make_shared<Value<T>>(T(0, number));
+        }
+    }
+    return std::make_shared<Value<T>>((T)number);
+}
+
+// Число вплотную перед именем умножается на следующий операнд вместе с его степенью: "3x ^ 2" = 3 * (x ^ 2).
+template <typename T> void Parser<T>::push_number(bool negative) {
+    std::shared_ptr<Node<T>> value = parse_number(negative);
+    if (!value) return;
+    if (at_word()) operators.push_back({Pending::scale, '*', FunctionType::sin, value});
+    else operands.push_back(value);
+}
+
+template <typename T> void Parser<T>::push_word() {
+    std::string_view word = read_word();
+    FunctionType type;
+    bool function = true;
+    if (word == "sin") type = FunctionType::sin;
+    else if (word == "cos") type = FunctionType::cos;
+    else if (word == "ln") type = FunctionType::ln;
+    else if (word == "exp") type = FunctionType::exp;
+    else function = false;
+    if (function) {
+        skip_spaces();
+        if (pos >= input.size() || input[pos] != '(') {
+            fail("Function has no argument!");
+            return;
+        }
+        pos++;
+        open++;
+        operators.push_back({Pending::function, '(', type, nullptr});
+        return;
+    }
+    if constexpr (std::is_same_v<T, std::complex<double>>) {
+        if (word == "i") {
+            operands.push_back(std::make_shared<Value<T>>(T(0, 1)));
+            return;
+        }
+    }
+    std::string name(word);
+    vars->insert(name);
+    operands.push_back(std::make_shared<Variable<T>>(name));
+}
+
+inline std::shared_ptr<Node<double>> parse_real(std::string_view input, std::unordered_set<std::string> *vars) {
+    return Parser<double>(input, vars).parse();
+}
+
+inline std::shared_ptr<Node<std::complex<double>>> parse_complex(std::string_view input, std::unordered_set<std::string> *vars) {
+    return Parser<std::complex<double>>(input, vars).parse();
+}
+
+inline Expression<double> construct_real(std::string_view input) {
     std::unordered_set<std::string> __vars = {};
-    std::shared_ptr<Head<double>> __head = std::make_shared<Head<double>>(parse_real(&it, end, &__vars));
+    std::shared_ptr<Head<double>> __head = std::make_shared<Head<double>>(parse_real(input, &__vars));
     return Expression<double>(__head, __vars);
 }
 
-Expression<std::complex<double>> construct_complex(std::string input) {
-    std::string::iterator it = input.begin();
-    std::string::iterator end = input.end();
+inline bool construct_real(std::string_view input, Expression<double> &result, std::string &error) {
+    std::unordered_set<std::string> __vars = {};
+    std::shared_ptr<Node<double>> root = Parser<double>(input, &__vars, &error).parse();
+    if (!root) return false;
+    result = Expression<double>(std::make_shared<Head<double>>(root), __vars);
+    return true;
+}
+
+inline bool construct_complex(std::string_view input, Expression<std::complex<double>> &result, std::string &error) {
+    std::unordered_set<std::string> __vars = {};
+    std::shared_ptr<Node<std::complex<double>>> root = Parser<std::complex<double>>(input, &__vars, &error).parse();
+    if (!root) return false;
+    result = Expression<std::complex<double>>(std::make_shared<Head<std::complex<double>>>(root), __vars);
+    return true;
+}
+
+inline Expression<std::complex<double>> construct_complex(std::string_view input) {
     std::unordered_set<std::string> __vars = {};
-    std::shared_ptr<Head<std::complex<double>>> __head = std::make_shared<Head<std::complex<double>>>(parse_complex(&it, end, &__vars));
+    std::shared_ptr<Head<std::complex<double>>> __head = std::make_shared<Head<std::complex<double>>>(parse_complex(input, &__vars));
     return Expression<std::complex<double>>(__head, __vars);
 }
 
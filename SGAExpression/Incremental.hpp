@@ -0,0 +1,132 @@
+#ifndef INCREMENTAL_HEADER
+#define INCREMENTAL_HEADER
+#include "Expression.hpp"
+
+// Вычислитель с памятью для циклов, где за шаг меняются одна-две переменные из многих. Хранит последнее значение
+// каждого подвыражения и для каждой переменной - список зависящих от нее записей плоской формы (ее конус).
+// set только запоминает новое значение, а value пересчитывает объединение конусов измененных переменных снизу вверх;
+// все остальные подвыражения, включая exp, ln и sin от неизменных входов, берутся из памяти.
+// Одинаковые поддеревья перед построением объединяются (share), так что каждое считается один раз.
+// Все буферы выделяются в конструкторе: set и value не делают ни одной аллокации.
+template <typename T> class IncrementalEvaluator {
+    private:
+        FlatExpression<T> flat;
+        std::vector<T> vals;
+        std::vector<T> values;
+        std::vector<uint32_t> cone_begin;
+        std::vector<uint32_t> cone;
+        std::vector<uint32_t> pending;
+        std::vector<uint32_t> cursor;
+        std::vector<char> changed;
+        void recompute(uint32_t index);
+    public:
+        uint64_t recomputed = 0;
+        IncrementalEvaluator(const Expression<T> &expr, const std::map<std::string, T> &point);
+        const std::vector<std::string>& names() const;
+        uint32_t slot(std::string_view name) const;
+        void set(uint32_t slot, T value);
+        void set(std::string_view name, T value);
+        T value();
+};
+
+// Конусы строятся по одному проходу на переменную: запись зависит от переменной, если это она сама или от нее
+// зависит потомок. Записи идут от потомков к родителям, поэтому конус сразу упорядочен для пересчета.
+template <typename T> IncrementalEvaluator<T>::IncrementalEvaluator(const Expression<T> &expr, const std::map<std::string, T> &point) {
+    Expression<T> shared = expr;
+    shared.share();
+    flat = shared.flatten();
+    const uint32_t count = flat.nodes.size(), slots = flat.names.size();
+    vals.resize(slots);
+    for (uint32_t v = 0; v < slots; v++) {
+        auto found = point.find(flat.names[v]);
+        if (found == point.end()) {
+            std::cerr << "Something went wrong, trying to calcualte a variable.\n" << "Variable name: " << flat.names[v] << "\n";
+            exit(EXIT_FAILURE);
+        }
+        vals[v] = found->second;
+    }
+    for (auto it = point.begin(); it != point.end(); it++) {
+        if (std::find(flat.names.begin(), flat.names.end(), it->first) == flat.names.end()) {
+            std::cerr << "\"" << it->first << "\" - no such variable!";
+            exit(EXIT_FAILURE);
+        }
+    }
+    values.resize(count);
+    flat_evaluate<T, T>(flat.nodes.data(), count, flat.constants.data(), vals.data(), values.data());
+
+    std::vector<char> depends(count);
+    cone_begin.push_back(0);
+    for (uint32_t v = 0; v < slots; v++) {
+        for (uint32_t i = 0; i < count; i++) {
+            const FlatNode &record = flat.nodes[i];
+            if (record.kind == NodeKind::var) depends[i] = record.left == v;
+            else if (record.kind == NodeKind::func) depends[i] = depends[record.left];
+            else if (record.kind == NodeKind::op) depends[i] = depends[record.left] || depends[record.right];
+            else depends[i] = 0;
+            if (depends[i]) cone.push_back(i);
+        }
+        cone_begin.push_back(cone.size());
+    }
+    pending.reserve(slots);
+    cursor.resize(slots);
+    changed.resize(slots);
+}
+
+template <typename T> const std::vector<std::string>& IncrementalEvaluator<T>::names() const {
+    return flat.names;
+}
+
+template <typename T> uint32_t IncrementalEvaluator<T>::slot(std::string_view name) const {
+    for (uint32_t v = 0; v < flat.names.size(); v++) {
+        if (flat.names[v] == name) return v;
+    }
+    std::cerr << "\"" << name << "\" - no such variable!";
+    exit(EXIT_FAILURE);
+}
+
+// Новое значение, совпадающее со старым, ничего не портит. Сравнение побитовое: при == смена 0.0 на -0.0
+// оставила бы в памяти 1 / x = inf вместо -inf.
+template <typename T> void IncrementalEvaluator<T>::set(uint32_t slot, T value) {
+    if (same_bits(vals[slot], value)) return;
+    vals[slot] = value;
+    if (!changed[slot]) {
+        changed[slot] = 1;
+        pending.push_back(slot);
+    }
+}
+
+template <typename T> void IncrementalEvaluator<T>::set(std::string_view name, T value) {
+    set(slot(name), value);
+}
+
+template <typename T> void IncrementalEvaluator<T>::recompute(uint32_t index) {
+    values[index] = flat_step<T, T>(flat.nodes[index], flat.constants.data(), vals.data(), values.data());
+    recomputed++;
+}
+
+// Конусы нескольких переменных сливаются как упорядоченные списки: общая запись считается один раз и только после
+// всех своих потомков.
+template <typename T> T IncrementalEvaluator<T>::value() {
+    if (pending.size() == 1) {
+        for (uint32_t k = cone_begin[pending[0]]; k < cone_begin[pending[0] + 1]; k++) recompute(cone[k]);
+    }
+    else if (!pending.empty()) {
+        for (uint32_t v : pending) cursor[v] = cone_begin[v];
+        while (true) {
+            uint32_t next = UINT32_MAX;
+            for (uint32_t v : pending) {
+                if (cursor[v] < cone_begin[v + 1]) next = std::min(next, cone[cursor[v]]);
+            }
+            if (next == UINT32_MAX) break;
+            recompute(next);
+            for (uint32_t v : pending) {
+                if (cursor[v] < cone_begin[v + 1] && cone[cursor[v]] == next) cursor[v]++;
+            }
+        }
+    }
+    for (uint32_t v : pending) changed[v] = 0;
+    pending.clear();
+    return values.back();
+}
+
+#endif
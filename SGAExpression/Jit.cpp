@@ -0,0 +1,282 @@
+#include "Jit.hpp"
+#include <cstring>
+#include <fstream>
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define SGA_JIT_NATIVE
+#endif
+
+namespace {
+
+// Где лежит значение: регистр xmm, входной массив (адрес в rbx), пул констант (адресуется от rip) или слот стека.
+struct Place {
+    enum Kind : char {xmm, input, constant, stack} kind;
+    unsigned index;
+    bool operator==(const Place &other) const { return kind == other.kind && index == other.index; }
+};
+
+// Минимальный ассемблер: только то, что нужно для скалярной арифметики над double.
+// Константы адресуются относительно rip, а пул кладется после кода, поэтому смещения дописываются в finish().
+class Assembler {
+    private:
+        struct Fixup {
+            std::size_t position;
+            unsigned constant;
+        };
+        std::vector<Fixup> fixups;
+        std::size_t frame_position = 0;
+        void byte(uint8_t value) { bytes.push_back(value); }
+        void dword(uint32_t value) { for (int i = 0; i < 4; i++) byte((value >> (8 * i)) & 0xFF); }
+        void qword(uint64_t value) { for (int i = 0; i < 8; i++) byte((value >> (8 * i)) & 0xFF); }
+    public:
+        std::vector<uint8_t> bytes;
+        // Инструкция вида prefix 0F opcode с регистром reg и вторым операндом place.
+        void sse(uint8_t prefix, uint8_t opcode, unsigned reg, Place place) {
+            byte(prefix);
+            uint8_t rex = 0x40 | ((reg & 8) ? 4 : 0) | ((place.kind == Place::xmm && (place.index & 8)) ? 1 : 0);
+            if (rex != 0x40) byte(rex);
+            byte(0x0F);
+            byte(opcode);
+            uint8_t field = (reg & 7) << 3;
+            switch (place.kind) {
+                case Place::xmm: byte(0xC0 | field | (place.index & 7)); break;
+                case Place::input: byte(0x80 | field | 3); dword(8 * place.index); break;
+                case Place::stack: byte(0x80 | field | 4); byte(0x24); dword(8 * place.index); break;
+                case Place::constant:
+                    byte(field | 5);
+                    fixups.push_back({bytes.size(), place.index});
+                    dword(0);
+                    break;
+            }
+        }
+        void move(Place to, Place from) {
+            if (to == from) return;
+            if (to.kind == Place::xmm && from.kind == Place::xmm) sse(0x66, 0x28, to.index, from);
+            else if (to.kind == Place::xmm) sse(0xF2, 0x10, to.index, from);
+            else sse(0xF2, 0x11, from.index, to);
+        }
+        void prologue() {
+            byte(0x53);
+            byte(0x48); byte(0x89); byte(0xFB);
+            byte(0x48); byte(0x81); byte(0xEC);
+            frame_position = bytes.size();
+            dword(0);
+        }
+        void call(const void* function) {
+            byte(0x48); byte(0xB8);
+            qword((uint64_t)function);
+            byte(0xFF); byte(0xD0);
+        }
+        // Кадр выравнивается на 16: после push rbx стек уже выровнен, как требует ABI при вызове libm.
+        void epilogue(unsigned stack_slots) {
+            uint32_t frame = (8 * stack_slots + 15) & ~15u;
+            std::memcpy(bytes.data() + frame_position, &frame, 4);
+            byte(0x48); byte(0x81); byte(0xC4);
+            dword(frame);
+            byte(0x5B);
+            byte(0xC3);
+        }
+        void finish(const std::vector<double> &constants) {
+            while (bytes.size() % 8) byte(0xCC);
+            std::size_t pool = bytes.size();
+            for (double constant : constants) {
+                uint64_t raw;
+                std::memcpy(&raw, &constant, 8);
+                qword(raw);
+            }
+            for (const Fixup &fixup : fixups) {
+                int32_t offset = pool + 8 * fixup.constant - (fixup.position + 4);
+                std::memcpy(bytes.data() + fixup.position, &offset, 4);
+            }
+        }
+};
+
+typedef double (*Unary)(double);
+typedef double (*Binary)(double, double);
+
+}
+
+JitFunction::JitFunction(const Expression<double> &expr) {
+    program = expr.compile();
+    compile(expr.to_string());
+}
+
+JitFunction::JitFunction(const Expression<double> &expr, std::vector<std::string> vars) {
+    program = expr.compile(vars);
+    compile(expr.to_string());
+}
+
+JitFunction::JitFunction(JitFunction &&other) {
+    *this = std::move(other);
+}
+
+JitFunction& JitFunction::operator=(JitFunction &&other) {
+    if (this == &other) return *this;
+    release();
+    program = std::move(other.program);
+    entry = other.entry;
+    memory = other.memory;
+    mapped = other.mapped;
+    length = other.length;
+    other.entry = nullptr;
+    other.memory = nullptr;
+    other.mapped = 0;
+    other.length = 0;
+    return *this;
+}
+
+JitFunction::~JitFunction() {
+    release();
+}
+
+void JitFunction::release() {
+#if defined(SGA_JIT_NATIVE)
+    if (memory) munmap(memory, mapped);
+#endif
+    memory = nullptr;
+    entry = nullptr;
+}
+
+// Перевод идет по байткоду, а не по дереву: в нем уже учтены общие поддеревья и порядок вычисления.
+// Каждая инструкция дает новое значение; регистры выделяются линейным сканированием по времени жизни значений,
+// и регистр операнда освобождается до выбора регистра результата, так что "a = a + b" не требует копирования.
+void JitFunction::compile(const std::string &name) {
+#if defined(SGA_JIT_NATIVE)
+    const std::vector<Instruction> &code = program.code;
+    unsigned slots_count = program.slots.size();
+    unsigned constants_end = slots_count + program.constants.size();
+    std::size_t n = code.size();
+    auto squared = [&](const Instruction &instruction) {
+        return instruction.code == OpCode::pow && instruction.right >= slots_count && instruction.right < constants_end
+            && program.constants[instruction.right - slots_count] == 2.0;
+    };
+    auto calls = [&](const Instruction &instruction) {
+        return instruction.code >= OpCode::pow && !squared(instruction);
+    };
+
+    // Для каждого регистра программы - какое значение (номер инструкции) в нем сейчас лежит.
+    std::vector<long> current(program.registers_count(), -1);
+    std::vector<long> left(n), right(n);
+    std::vector<std::size_t> last(n);
+    for (std::size_t i = 0; i < n; i++) {
+        left[i] = current[code[i].left];
+        right[i] = current[code[i].right];
+        last[i] = i;
+        if (left[i] >= 0) last[left[i]] = i;
+        if (right[i] >= 0) last[right[i]] = i;
+        current[code[i].dest] = i;
+    }
+    long result = current[program.result];
+    if (result >= 0) last[result] = n;
+    std::vector<std::size_t> calls_before(n + 1, 0);
+    for (std::size_t i = 0; i < n; i++) calls_before[i + 1] = calls_before[i] + (calls(code[i]) ? 1 : 0);
+
+    std::vector<Place> home(n);
+    auto place = [&](unsigned reg, long value) {
+        if (value >= 0) return home[value];
+        if (reg < slots_count) return Place{Place::input, reg};
+        return Place{Place::constant, reg - slots_count};
+    };
+    std::vector<bool> busy(16, false);
+    busy[0] = busy[1] = true;
+    unsigned stack_slots = 0;
+    Assembler as;
+    as.prologue();
+    for (std::size_t i = 0; i < n; i++) {
+        const Instruction &instruction = code[i];
+        Place a = place(instruction.left, left[i]);
+        Place b = place(instruction.right, right[i]);
+        if (left[i] >= 0 && last[left[i]] == i && a.kind == Place::xmm) busy[a.index] = false;
+        if (right[i] >= 0 && last[right[i]] == i && b.kind == Place::xmm) busy[b.index] = false;
+        // Значение, которое должно пережить вызов libm, сразу кладется в стек.
+        bool crosses = last[i] > i + 1 && calls_before[std::min(last[i], n)] > calls_before[i + 1];
+        unsigned free = std::find(busy.begin(), busy.end(), false) - busy.begin();
+        if (crosses || free == busy.size()) home[i] = {Place::stack, stack_slots++};
+        else {
+            home[i] = {Place::xmm, free};
+            busy[free] = true;
+        }
+        if (calls(instruction)) {
+            as.move({Place::xmm, 0}, a);
+            if (instruction.code == OpCode::pow) as.move({Place::xmm, 1}, b);
+            if (instruction.code == OpCode::pow) as.call((const void*)(Binary)::pow);
+            if (instruction.code == OpCode::sin) as.call((const void*)(Unary)::sin);
+            if (instruction.code == OpCode::cos) as.call((const void*)(Unary)::cos);
+            if (instruction.code == OpCode::ln) as.call((const void*)(Unary)::log);
+            if (instruction.code == OpCode::exp) as.call((const void*)(Unary)::exp);
+            as.move(home[i], {Place::xmm, 0});
+            continue;
+        }
+        uint8_t opcode = 0x59;
+        if (instruction.code == OpCode::add) opcode = 0x58;
+        if (instruction.code == OpCode::sub) opcode = 0x5C;
+        if (instruction.code == OpCode::div) opcode = 0x5E;
+        if (squared(instruction)) b = a;
+        bool commutative = opcode == 0x58 || opcode == 0x59;
+        unsigned target = home[i].kind == Place::xmm ? home[i].index : 0;
+        if (b == Place{Place::xmm, target} && !(a == b)) {
+            if (commutative) std::swap(a, b);
+            else target = 0;
+        }
+        as.move({Place::xmm, target}, a);
+        as.sse(0xF2, opcode, target, b);
+        as.move(home[i], {Place::xmm, target});
+    }
+    as.move({Place::xmm, 0}, place(program.result, result));
+    as.epilogue(stack_slots);
+    length = as.bytes.size();
+    as.finish(program.constants);
+
+    // Страница сначала доступна на запись, потом только на чтение и исполнение - никогда обоими сразу.
+    std::size_t page = sysconf(_SC_PAGESIZE);
+    mapped = (as.bytes.size() + page - 1) / page * page;
+    memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        memory = nullptr;
+        return;
+    }
+    std::memcpy(memory, as.bytes.data(), as.bytes.size());
+    if (mprotect(memory, mapped, PROT_READ | PROT_EXEC) != 0) {
+        release();
+        return;
+    }
+    entry = (Entry)memory;
+
+    std::ofstream map("/tmp/perf-" + std::to_string(getpid()) + ".map", std::ios::app);
+    if (map) {
+        char line[64];
+        snprintf(line, sizeof(line), "%lx %lx ", (unsigned long)memory, (unsigned long)length);
+        map << line << "sga::jit " << name.substr(0, 120) << "\n";
+    }
+#endif
+}
+
+bool JitFunction::native() const {
+    return entry != nullptr;
+}
+
+std::size_t JitFunction::code_size() const {
+    return length;
+}
+
+const std::vector<std::string>& JitFunction::slots() const {
+    return program.slots;
+}
+
+// Запасной путь - интерпретатор. Регистры у каждого потока свои, поэтому run можно звать из нескольких потоков.
+double JitFunction::run(const double* vals) const {
+    if (entry) return entry(vals);
+    thread_local std::vector<double> regs;
+    if (regs.size() < program.registers_count()) regs.resize(program.registers_count());
+    std::copy(program.constants.begin(), program.constants.end(), regs.begin() + program.slots.size());
+    return program.run(vals, regs.data());
+}
+
+double JitFunction::run(const std::vector<double> &vals) const {
+    if (vals.size() != program.slots.size()) {
+        std::cerr << "Number of values does not match number of slots!";
+        exit(EXIT_FAILURE);
+    }
+    return run(vals.data());
+}
@@ -0,0 +1,38 @@
+#ifndef JIT_HEADER
+#define JIT_HEADER
+#include "Expression.hpp"
+
+// Машинный код для вещественных выражений: байткод Program переводится в инструкции x86-64 (скалярный SSE2)
+// прямо в памяти процесса, без вызова внешнего компилятора. Промежуточные значения распределяются по регистрам
+// xmm2..xmm15, константы лежат сразу за кодом, sin/cos/ln/exp/pow - вызовы libm.
+// Регистры xmm при вызове функции не сохраняются, поэтому значения, живущие через вызов, хранятся в стеке.
+// На других архитектурах (или если система не дала исполняемую память) используется интерпретатор байткода -
+// результат тот же, меняется только скорость, проверить можно через native().
+// Каждая функция регистрируется в /tmp/perf-<pid>.map, чтобы perf показывал ее в профиле под понятным именем.
+class JitFunction {
+    private:
+        typedef double (*Entry)(const double*);
+        Program<double> program;
+        Entry entry = nullptr;
+        void* memory = nullptr;
+        std::size_t mapped = 0;
+        std::size_t length = 0;
+        void compile(const std::string &name);
+        void release();
+    public:
+        JitFunction() = default;
+        JitFunction(const Expression<double> &expr);
+        JitFunction(const Expression<double> &expr, std::vector<std::string> vars);
+        JitFunction(const JitFunction &other) = delete;
+        JitFunction(JitFunction &&other);
+        JitFunction& operator=(const JitFunction &other) = delete;
+        JitFunction& operator=(JitFunction &&other);
+        ~JitFunction();
+        bool native() const;
+        std::size_t code_size() const;
+        const std::vector<std::string>& slots() const;
+        double run(const double* vals) const;
+        double run(const std::vector<double> &vals) const;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "Parallel.hpp"
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+ThreadPool::ThreadPool(unsigned threads_count, bool pin) {
+    if (threads_count == 0) threads_count = std::thread::hardware_concurrency();
+    if (threads_count == 0) threads_count = 1;
+    ranges = std::make_unique<Range[]>(threads_count);
+    threads.reserve(threads_count);
+    for (unsigned i = 0; i < threads_count; i++) threads.emplace_back(&ThreadPool::loop, this, i, pin);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads) thread.join();
+}
+
+unsigned ThreadPool::size() const {
+    return threads.size();
+}
+
+// Сначала - своя задача с начала отрезка. Если отрезок пуст, ищется самый длинный чужой, и его вторая половина
+// переезжает к себе: первая задача из нее выполняется сразу, остальные остаются в своем отрезке.
+bool ThreadPool::take(unsigned worker, std::size_t &index) {
+    Range &own = ranges[worker];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.begin < own.end) {
+            index = own.begin++;
+            return true;
+        }
+    }
+    while (true) {
+        unsigned victim = worker;
+        std::size_t longest = 0;
+        for (unsigned i = 0; i < threads.size(); i++) {
+            if (i == worker) continue;
+            std::lock_guard<std::mutex> lock(ranges[i].mutex);
+            if (ranges[i].end - ranges[i].begin > longest) {
+                longest = ranges[i].end - ranges[i].begin;
+                victim = i;
+            }
+        }
+        if (longest == 0) return false;
+        std::size_t begin, end;
+        {
+            std::lock_guard<std::mutex> lock(ranges[victim].mutex);
+            if (ranges[victim].begin == ranges[victim].end) continue;
+            end = ranges[victim].end;
+            begin = end - (end - ranges[victim].begin + 1) / 2;
+            ranges[victim].end = begin;
+        }
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.begin = begin + 1;
+        own.end = end;
+        index = begin;
+        return true;
+    }
+}
+
+void ThreadPool::loop(unsigned worker, bool pin) {
+#if defined(__linux__)
+    if (pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker % std::max(1u, std::thread::hardware_concurrency()), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        std::size_t index;
+        while (take(worker, index)) (*job)(index, worker);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--active == 0) done.notify_one();
+    }
+}
+
+// Задания выполняются по одному: вызывающий поток раскладывает номера по отрезкам, будит пул и ждет,
+// пока все потоки не найдут свои отрезки и чужие пустыми.
+void ThreadPool::run(std::size_t count, const std::function<void(std::size_t, unsigned)> &body) {
+    if (count == 0) return;
+    std::lock_guard<std::mutex> guard(run_mutex);
+    std::size_t workers = threads.size();
+    for (std::size_t i = 0; i < workers; i++) {
+        std::lock_guard<std::mutex> lock(ranges[i].mutex);
+        ranges[i].begin = count * i / workers;
+        ranges[i].end = count * (i + 1) / workers;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    job = &body;
+    active = workers;
+    generation++;
+    wake.notify_all();
+    done.wait(lock, [&] { return active == 0; });
+    job = nullptr;
+}
@@ -0,0 +1,87 @@
+#ifndef PARALLEL_HEADER
+#define PARALLEL_HEADER
+#include "Expression.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Пул потоков с кражей работы. Задание - это count независимых задач с номерами 0..count-1: номера делятся между
+// потоками поровну непрерывными отрезками, поток берет задачи с начала своего отрезка, а опустевший поток забирает
+// себе вторую половину самого длинного чужого отрезка. Так соседние задачи обычно достаются одному потоку,
+// а неравномерная нагрузка все равно выравнивается.
+// Потоки создаются один раз и спят между заданиями. pin - привязать i-й поток к i-му ядру (только Linux).
+class ThreadPool {
+    private:
+        struct alignas(64) Range {
+            std::mutex mutex;
+            std::size_t begin = 0;
+            std::size_t end = 0;
+        };
+        std::vector<std::thread> threads;
+        std::unique_ptr<Range[]> ranges;
+        std::mutex run_mutex;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(std::size_t, unsigned)>* job = nullptr;
+        uint64_t generation = 0;
+        unsigned active = 0;
+        bool stopping = false;
+        bool take(unsigned worker, std::size_t &index);
+        void loop(unsigned worker, bool pin);
+    public:
+        explicit ThreadPool(unsigned threads_count = 0, bool pin = false);
+        ThreadPool(const ThreadPool &other) = delete;
+        ThreadPool& operator=(const ThreadPool &other) = delete;
+        ~ThreadPool();
+        unsigned size() const;
+        void run(std::size_t count, const std::function<void(std::size_t, unsigned)> &body);
+};
+
+// Пакетное вычисление на пуле: точки режутся на куски по chunk штук (кратно Program::block), и каждый кусок -
+// отдельная задача. Программа при этом только читается, а регистры у каждого потока свои, так что одну программу
+// можно вычислять из многих потоков сразу. Каждая точка считается той же последовательностью инструкций, что и
+// в однопоточном run_batch, поэтому результат побитово один и тот же при любом числе потоков.
+template <typename T> void run_batch(const Program<T> &program, const std::vector<const T*> &columns, T* out, std::size_t n,
+    ThreadPool &pool, std::size_t chunk = 64 * Program<T>::block);
+template <typename T> void calculate_batch(const Expression<T> &expr, std::vector<std::string> vars, std::vector<const T*> columns, T* out, std::size_t n,
+    ThreadPool &pool, std::size_t chunk = 64 * Program<T>::block);
+
+//---------------------------------------------------------------------------------------------------------------
+// Параллельное пакетное вычисление
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T> void run_batch(const Program<T> &program, const std::vector<const T*> &columns, T* out, std::size_t n, ThreadPool &pool, std::size_t chunk) {
+    if (columns.size() != program.slots.size()) {
+        std::cerr << "Number of columns does not match number of slots!";
+        exit(EXIT_FAILURE);
+    }
+    chunk = chunk < Program<T>::block ? Program<T>::block : chunk / Program<T>::block * Program<T>::block;
+    // Регистры потока заводятся им самим при первой задаче - память оказывается рядом с его ядром.
+    struct Scratch {
+        std::vector<T> regs;
+        std::vector<const T*> columns;
+    };
+    std::vector<Scratch> scratch(pool.size());
+    pool.run((n + chunk - 1) / chunk, [&](std::size_t task, unsigned worker) {
+        Scratch &own = scratch[worker];
+        if (own.regs.empty()) {
+            own.regs = program.make_batch_registers();
+            own.columns.resize(columns.size());
+        }
+        std::size_t offset = task * chunk;
+        for (std::size_t i = 0; i < columns.size(); i++) own.columns[i] = columns[i] + offset;
+        program.run_batch(own.columns.data(), out + offset, std::min(chunk, n - offset), own.regs.data());
+    });
+}
+
+template <typename T> void calculate_batch(const Expression<T> &expr, std::vector<std::string> vars, std::vector<const T*> columns, T* out, std::size_t n, ThreadPool &pool, std::size_t chunk) {
+    if (vars.size() != columns.size()) {
+        std::cerr << "Number of variables does not match number of columns!";
+        exit(EXIT_FAILURE);
+    }
+    run_batch(expr.compile(vars), columns, out, n, pool, chunk);
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include "Serial.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+uint64_t blob_checksum(const char* data, std::size_t size) {
+    const uint64_t first = 0x9E3779B97F4A7C15ull, second = 0xBF58476D1CE4E5B9ull, third = 0x94D049BB133111EBull;
+    uint64_t hash = first ^ (size * second);
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = std::rotl(hash ^ (word * second), 31) * third;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    hash = std::rotl(hash ^ (tail * second), 31) * third;
+    hash ^= hash >> 30;
+    hash *= second;
+    hash ^= hash >> 27;
+    hash *= third;
+    return hash ^ (hash >> 31);
+}
+
+// Размеры секций считаются в 64 битах: огромные счетчики в поврежденном заголовке не переполняют сумму.
+bool check_blob(std::string_view data, uint8_t value_type, std::size_t value_size, BlobHeader &header, std::string &error) {
+    if (data.size() < sizeof(BlobHeader)) {
+        error = "file is too short";
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(BlobHeader));
+    if (std::memcmp(header.magic, "SGAX", 4) != 0) {
+        error = "not an expression file";
+        return false;
+    }
+    if (header.version != blob_version) {
+        error = "unsupported format version " + std::to_string(header.version);
+        return false;
+    }
+    if (header.value_type != value_type) {
+        error = value_type == 1 ? "file holds a complex expression" : "file holds a real expression";
+        return false;
+    }
+    uint64_t expected = sizeof(BlobHeader) + (uint64_t)header.constants_count * value_size + (uint64_t)header.nodes_count * sizeof(FlatNode) +
+        (uint64_t)header.names_count * 4 + header.text_bytes + header.tag_bytes;
+    if (expected != data.size()) {
+        error = "file size does not match its header";
+        return false;
+    }
+    if (reinterpret_cast<uintptr_t>(data.data()) % 8 != 0) {
+        error = "buffer is not aligned";
+        return false;
+    }
+    if (blob_checksum(data.data() + sizeof(BlobHeader), data.size() - sizeof(BlobHeader)) != header.checksum) {
+        error = "checksum mismatch";
+        return false;
+    }
+    if (header.nodes_count == 0) {
+        error = "expression is empty";
+        return false;
+    }
+    const char* section = data.data() + sizeof(BlobHeader) + (std::size_t)header.constants_count * value_size;
+    const FlatNode* nodes = reinterpret_cast<const FlatNode*>(section);
+    const uint32_t* name_ends = reinterpret_cast<const uint32_t*>(section + (std::size_t)header.nodes_count * sizeof(FlatNode));
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < header.names_count; i++) {
+        if (name_ends[i] <= previous) {
+            error = "empty variable name";
+            return false;
+        }
+        previous = name_ends[i];
+    }
+    if (previous != header.text_bytes) {
+        error = "variable table does not match its text";
+        return false;
+    }
+    for (uint32_t i = 0; i < header.nodes_count; i++) {
+        const FlatNode &record = nodes[i];
+        bool valid;
+        switch (record.kind) {
+            case NodeKind::val: valid = record.left < header.constants_count; break;
+            case NodeKind::var: valid = record.left < header.names_count; break;
+            case NodeKind::func: valid = (unsigned char)record.type <= (unsigned char)FunctionType::exp && record.left < i; break;
+            case NodeKind::op: valid = (unsigned char)record.type <= (unsigned char)OperationType::pow && record.left < i && record.right < i; break;
+            default: valid = false;
+        }
+        if (!valid) {
+            error = "malformed node " + std::to_string(i);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool write_file(const std::string &path, std::string_view data) {
+    std::string temporary = path + ".tmp." + std::to_string(getpid());
+    FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file) return false;
+    bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = std::fclose(file) == 0 && written;
+    if (written && std::rename(temporary.c_str(), path.c_str()) == 0) return true;
+    std::remove(temporary.c_str());
+    return false;
+}
+
+MappedFile::MappedFile(MappedFile &&other) : address(other.address), length(other.length) {
+    other.address = nullptr;
+    other.length = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile &&other) {
+    if (this != &other) {
+        if (address) munmap(address, length);
+        address = other.address;
+        length = other.length;
+        other.address = nullptr;
+        other.length = 0;
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    if (address) munmap(address, length);
+}
+
+bool MappedFile::open(const std::string &path, std::string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = std::strerror(errno);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        error = std::strerror(errno);
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        error = "file is empty";
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        error = std::strerror(errno);
+        return false;
+    }
+    if (address) munmap(address, length);
+    address = mapped;
+    length = info.st_size;
+    return true;
+}
+
+std::string_view MappedFile::data() const {
+    return std::string_view(static_cast<const char*>(address), length);
+}
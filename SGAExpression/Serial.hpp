@@ -0,0 +1,210 @@
+#ifndef SERIAL_HEADER
+#define SERIAL_HEADER
+#include "Expression.hpp"
+#include <bit>
+#include <cstring>
+
+// Двоичный формат выражения, версия 1. Это та же плоская запись, что и в FlatExpression, байт в байт:
+//   заголовок   48 байт (BlobHeader)
+//   константы   constants_count значений T как есть: double - 8 байт, complex<double> - 16
+//   ноды        nodes_count записей по 12 байт: u8 вид, u8 тип, 2 нулевых байта, u32 left, u32 right
+//   имена       names_count чисел u32 - концы имен в тексте, затем text_bytes байт имен подряд
+//   метка       tag_bytes байт - строка владельца файла (например, ключ кэша)
+// Числа little-endian. Ноды идут в обратном польском порядке, корень - последняя запись, а коды вида и типа - значения
+// NodeKind, OperationType и FunctionType. Константы начинаются со смещения 48, поэтому в отображенном в память файле
+// константы и ноды выровнены и читаются на месте, без копирования. Контрольная сумма покрывает все после заголовка.
+static_assert(std::endian::native == std::endian::little, "blob format is little-endian");
+static_assert(sizeof(FlatNode) == 12 && offsetof(FlatNode, left) == 4 && offsetof(FlatNode, right) == 8);
+
+const uint16_t blob_version = 1;
+
+struct BlobHeader {
+    char magic[4];
+    uint16_t version;
+    uint8_t value_type;
+    uint8_t reserved;
+    uint64_t checksum;
+    uint32_t nodes_count;
+    uint32_t constants_count;
+    uint32_t names_count;
+    uint32_t text_bytes;
+    uint32_t tag_bytes;
+    uint32_t padding[3];
+};
+static_assert(sizeof(BlobHeader) == 48);
+
+// Код типа чисел в заголовке: 1 - double, 2 - complex<double>.
+template <typename T> constexpr uint8_t blob_value_type() {
+    return std::is_same_v<T, double> ? 1 : 2;
+}
+
+// 64-битная сумма по словам для обнаружения порчи файла (не криптографическая).
+uint64_t blob_checksum(const char* data, std::size_t size);
+
+// Проверка всего файла до первого обращения к нему: заголовок, размеры секций, выравнивание, контрольная сумма,
+// а у каждой ноды - вид, тип и ссылки только на более ранние записи, константы и имена в пределах таблиц.
+bool check_blob(std::string_view data, uint8_t value_type, std::size_t value_size, BlobHeader &header, std::string &error);
+
+// Запись во временный файл рядом и переименование: читатель видит либо старый файл целиком, либо новый.
+bool write_file(const std::string &path, std::string_view data);
+
+// Файл, отображенный в память только для чтения. Освобождается в деструкторе.
+class MappedFile {
+    private:
+        void* address = nullptr;
+        std::size_t length = 0;
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile &other) = delete;
+        MappedFile& operator=(const MappedFile &other) = delete;
+        MappedFile(MappedFile &&other);
+        MappedFile& operator=(MappedFile &&other);
+        ~MappedFile();
+        bool open(const std::string &path, std::string &error);
+        std::string_view data() const;
+};
+
+template <typename T> std::string serialize(const FlatExpression<T> &flat, std::string_view tag = {});
+template <typename T> std::string serialize(const Expression<T> &expr, std::string_view tag = {});
+
+// Выражение прямо из двоичной записи: из файла через mmap (open) или из чужого буфера (attach, буфер должен жить
+// дольше и быть выровнен на 8 байт). Ноды и константы не копируются - calculate идет по отображенной памяти.
+// Конструктор с путем при ошибке завершает программу, как и остальная библиотека; open и attach возвращают false
+// и текст ошибки - для кэшей, где испорченный файл это просто промах.
+template <typename T> class ExpressionBlob {
+    private:
+        MappedFile file;
+        const uint32_t* name_ends = nullptr;
+        const char* text = nullptr;
+        std::string_view tag_text;
+    public:
+        const FlatNode* nodes = nullptr;
+        const T* constants = nullptr;
+        uint32_t nodes_count = 0;
+        uint32_t constants_count = 0;
+        uint32_t names_count = 0;
+        ExpressionBlob() = default;
+        ExpressionBlob(const std::string &path);
+        bool open(const std::string &path, std::string &error);
+        bool attach(std::string_view data, std::string &error);
+        std::string_view name(uint32_t index) const;
+        std::vector<std::string> names() const;
+        std::string_view tag() const;
+        T calculate(const T* vals, T* scratch) const;
+        FlatExpression<T> flat() const;
+        Expression<T> expand() const;
+};
+
+//---------------------------------------------------------------------------------------------------------------
+// Запись
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T> std::string serialize(const FlatExpression<T> &flat, std::string_view tag) {
+    BlobHeader header = {};
+    std::memcpy(header.magic, "SGAX", 4);
+    header.version = blob_version;
+    header.value_type = blob_value_type<T>();
+    header.nodes_count = flat.nodes.size();
+    header.constants_count = flat.constants.size();
+    header.names_count = flat.names.size();
+    for (const std::string &name : flat.names) header.text_bytes += name.size();
+    header.tag_bytes = tag.size();
+    std::string blob(sizeof(BlobHeader), '\0');
+    blob.reserve(sizeof(BlobHeader) + flat.constants.size() * sizeof(T) + flat.nodes.size() * sizeof(FlatNode) +
+        flat.names.size() * 4 + header.text_bytes + tag.size());
+    blob.append(reinterpret_cast<const char*>(flat.constants.data()), flat.constants.size() * sizeof(T));
+    // Записи собираются по полям, чтобы байты выравнивания были нулями и одинаковые выражения давали одинаковые файлы.
+    for (const FlatNode &record : flat.nodes) {
+        char bytes[12] = {(char)record.kind, record.type};
+        std::memcpy(bytes + 4, &record.left, 4);
+        std::memcpy(bytes + 8, &record.right, 4);
+        blob.append(bytes, 12);
+    }
+    uint32_t end = 0;
+    for (const std::string &name : flat.names) {
+        end += name.size();
+        blob.append(reinterpret_cast<const char*>(&end), 4);
+    }
+    for (const std::string &name : flat.names) blob += name;
+    blob += tag;
+    header.checksum = blob_checksum(blob.data() + sizeof(BlobHeader), blob.size() - sizeof(BlobHeader));
+    std::memcpy(blob.data(), &header, sizeof(BlobHeader));
+    return blob;
+}
+
+template <typename T> std::string serialize(const Expression<T> &expr, std::string_view tag) {
+    return serialize(expr.flatten(), tag);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Чтение
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T> ExpressionBlob<T>::ExpressionBlob(const std::string &path) {
+    std::string error;
+    if (!open(path, error)) {
+        std::cerr << path << ": " << error << "\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+template <typename T> bool ExpressionBlob<T>::open(const std::string &path, std::string &error) {
+    MappedFile mapped;
+    if (!mapped.open(path, error) || !attach(mapped.data(), error)) return false;
+    file = std::move(mapped);
+    return true;
+}
+
+template <typename T> bool ExpressionBlob<T>::attach(std::string_view data, std::string &error) {
+    BlobHeader header;
+    if (!check_blob(data, blob_value_type<T>(), sizeof(T), header, error)) return false;
+    const char* section = data.data() + sizeof(BlobHeader);
+    constants = reinterpret_cast<const T*>(section);
+    section += header.constants_count * sizeof(T);
+    nodes = reinterpret_cast<const FlatNode*>(section);
+    section += header.nodes_count * sizeof(FlatNode);
+    name_ends = reinterpret_cast<const uint32_t*>(section);
+    text = section + header.names_count * 4;
+    tag_text = std::string_view(text + header.text_bytes, header.tag_bytes);
+    nodes_count = header.nodes_count;
+    constants_count = header.constants_count;
+    names_count = header.names_count;
+    return true;
+}
+
+template <typename T> std::string_view ExpressionBlob<T>::name(uint32_t index) const {
+    uint32_t begin = index ? name_ends[index - 1] : 0;
+    return std::string_view(text + begin, name_ends[index] - begin);
+}
+
+template <typename T> std::vector<std::string> ExpressionBlob<T>::names() const {
+    std::vector<std::string> result;
+    result.reserve(names_count);
+    for (uint32_t i = 0; i < names_count; i++) result.push_back(std::string(name(i)));
+    return result;
+}
+
+template <typename T> std::string_view ExpressionBlob<T>::tag() const {
+    return tag_text;
+}
+
+// vals - значения переменных в порядке names(), scratch - по одному значению на ноду.
+template <typename T> T ExpressionBlob<T>::calculate(const T* vals, T* scratch) const {
+    return flat_evaluate<T, T>(nodes, nodes_count, constants, vals, scratch);
+}
+
+template <typename T> FlatExpression<T> ExpressionBlob<T>::flat() const {
+    FlatExpression<T> result;
+    result.nodes.assign(nodes, nodes + nodes_count);
+    result.constants.assign(constants, constants + constants_count);
+    result.names = names();
+    return result;
+}
+
+template <typename T> Expression<T> ExpressionBlob<T>::expand() const {
+    std::vector<std::string> vars = names();
+    std::shared_ptr<Node<T>> root = flat_expand<T>(nodes, nodes_count - 1, constants, [&](uint32_t i) { return vars[i]; });
+    return Expression<T>(std::make_shared<Head<T>>(root), std::unordered_set<std::string>(vars.begin(), vars.end()));
+}
+
+#endif
@@ -0,0 +1,445 @@
+#include "Server.hpp"
+#include "Cache.hpp"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//---------------------------------------------------------------------------------------------------------------
+// Кадры
+//---------------------------------------------------------------------------------------------------------------
+
+void put_u32(std::string &out, uint32_t value) {
+    char bytes[4];
+    for (int i = 0; i < 4; i++) bytes[i] = (char)((value >> (8 * i)) & 0xFF);
+    out.append(bytes, 4);
+}
+
+void put_double(std::string &out, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, 8);
+    put_u32(out, (uint32_t)bits);
+    put_u32(out, (uint32_t)(bits >> 32));
+}
+
+void put_string(std::string &out, std::string_view value) {
+    put_u32(out, value.size());
+    out.append(value.data(), value.size());
+}
+
+FrameReader::FrameReader(std::string_view __data) : data(__data) {}
+
+bool FrameReader::take(std::size_t size) {
+    if (!ok || data.size() - pos < size) ok = false;
+    return ok;
+}
+
+uint8_t FrameReader::u8() {
+    if (!take(1)) return 0;
+    return (uint8_t)data[pos++];
+}
+
+uint32_t FrameReader::u32() {
+    if (!take(4)) return 0;
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)(uint8_t)data[pos++] << (8 * i);
+    return value;
+}
+
+double FrameReader::f64() {
+    uint64_t bits = u32();
+    bits |= (uint64_t)u32() << 32;
+    double value;
+    std::memcpy(&value, &bits, 8);
+    return ok ? value : 0.0;
+}
+
+std::string_view FrameReader::string() {
+    uint32_t size = u32();
+    if (!take(size)) return {};
+    std::string_view value = data.substr(pos, size);
+    pos += size;
+    return value;
+}
+
+bool FrameReader::finished() const {
+    return ok && pos == data.size();
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static sockaddr_un socket_address(const std::string &path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path is too long: " << path << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Сервер
+//---------------------------------------------------------------------------------------------------------------
+
+ExpressionServer::ExpressionServer(std::string __path) : path(std::move(__path)) {
+    if (pipe(wake) != 0) {
+        std::cerr << "Cannot create a pipe: " << std::strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(wake[0]);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = socket_address(path);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 128) != 0) {
+        std::cerr << "Cannot listen on " << path << ": " << std::strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(listener);
+}
+
+ExpressionServer::~ExpressionServer() {
+    if (listener >= 0) close(listener);
+    close(wake[0]);
+    close(wake[1]);
+    unlink(path.c_str());
+}
+
+std::size_t ExpressionServer::size() const {
+    return residents.size();
+}
+
+void ExpressionServer::stop() {
+    char byte = 0;
+    while (write(wake[1], &byte, 1) < 0 && errno == EINTR) {}
+}
+
+// Библиотека сообщает об ошибках текстом в stderr и exit, а сервер не должен падать от неверной формулы, поэтому
+// build строит выражение через варианты construct_real, simplify и differentiate, возвращающие ошибку.
+// Каждый parse, diff и substitute, вернувший handle, добавляет ему ссылку, release снимает одну.
+bool ExpressionServer::resident(const std::string &key, const std::function<bool(Expression<double>&, std::string&)> &build, uint32_t &handle, std::string &error) {
+    auto found = memo.find(key);
+    if (found != memo.end()) {
+        handle = found->second;
+        residents.at(handle).references++;
+        return true;
+    }
+    Resident entry;
+    if (!build(entry.expression, error)) return false;
+    entry.program = entry.expression.compile();
+    entry.registers = entry.program.make_registers();
+    entry.keys.push_back(key);
+    handle = next_handle++;
+    residents.emplace(handle, std::move(entry));
+    memo.emplace(key, handle);
+    return true;
+}
+
+void ExpressionServer::handle(std::string_view request, std::string &response) {
+    FrameReader reader(request);
+    Command command = (Command)reader.u8();
+    uint32_t id = reader.u32();
+    std::string payload, error;
+    auto find = [&](uint32_t handle) -> Resident* {
+        auto found = residents.find(handle);
+        if (found == residents.end()) {
+            error = "no such handle: " + std::to_string(handle);
+            return nullptr;
+        }
+        return &found->second;
+    };
+    if (command == Command::parse) {
+        std::string_view text = reader.string();
+        uint32_t handle;
+        if (!reader.finished()) error = "malformed request";
+        else if (resident("parse:" + ExpressionCache<double>::normalise(text), [&](Expression<double> &expression, std::string &failure) {
+            return construct_real(text, expression, failure) && expression.simplify(failure);
+        }, handle, error)) put_u32(payload, handle);
+    }
+    else if (command == Command::eval) {
+        Resident* entry = find(reader.u32());
+        uint32_t n = reader.u32();
+        std::size_t slots = entry ? entry->program.slots.size() : 0;
+        if (entry && (!reader.ok || (uint64_t)n * 8 != request.size() - 13)) error = "malformed request";
+        else if (entry && (slots ? n % slots : n) != 0) error = "expected a multiple of " + std::to_string(slots) + " values, got " + std::to_string(n);
+        else if (entry) {
+            std::size_t points = slots ? n / slots : 1;
+            double vals[64];
+            std::vector<double> many(slots > 64 ? slots : 0);
+            double* point_vals = slots > 64 ? many.data() : vals;
+            payload.reserve(points * 8);
+            for (std::size_t point = 0; point < points; point++) {
+                for (std::size_t i = 0; i < slots; i++) point_vals[i] = reader.f64();
+                put_double(payload, entry->program.run(point_vals, entry->registers.data()));
+            }
+        }
+    }
+    else if (command == Command::diff || command == Command::substitute) {
+        uint32_t base = reader.u32();
+        std::string name(reader.string());
+        double value = command == Command::substitute ? reader.f64() : 0.0;
+        Resident* entry = find(base);
+        uint32_t handle;
+        if (entry && !reader.finished()) error = "malformed request";
+        else if (!entry) {}
+        else if (command == Command::diff) {
+            const Expression<double> &source = entry->expression;
+            if (resident("diff:" + std::to_string(base) + ":" + name, [&](Expression<double> &expression, std::string &failure) {
+                return source.differentiate(name, expression, failure);
+            }, handle, error)) put_u32(payload, handle);
+        }
+        else if (!entry->expression.get_variables().count(name)) error = "\"" + name + "\" - no such variable";
+        else {
+            const Expression<double> &source = entry->expression;
+            std::string key = "substitute:" + std::to_string(base) + ":" + name + "=";
+            put_double(key, value);
+            if (resident(key, [&](Expression<double> &expression, std::string &failure) {
+                expression = source.substitute(name, value);
+                return expression.simplify(failure);
+            }, handle, error)) put_u32(payload, handle);
+        }
+    }
+    else if (command == Command::slots || command == Command::text || command == Command::release) {
+        uint32_t handle = reader.u32();
+        Resident* entry = find(handle);
+        if (entry && !reader.finished()) error = "malformed request";
+        else if (!entry) {}
+        else if (command == Command::slots) {
+            put_u32(payload, entry->program.slots.size());
+            for (const std::string &slot : entry->program.slots) put_string(payload, slot);
+        }
+        else if (command == Command::text) put_string(payload, entry->expression.to_string());
+        else if (--entry->references == 0) {
+            for (const std::string &key : entry->keys) memo.erase(key);
+            residents.erase(handle);
+        }
+    }
+    else error = "unknown command " + std::to_string((unsigned)command);
+
+    bool failed = !error.empty();
+    if (failed) payload = error;
+    put_u32(response, 5 + payload.size());
+    response.push_back((char)(failed ? Status::error : Status::ok));
+    put_u32(response, id);
+    response += payload;
+}
+
+// Читает все, что пришло, отвечает на все полные кадры и пишет, сколько получится. При выходном буфере больше
+// max_backlog новые кадры не читаются и не разбираются, пока ответы не уйдут. Конец данных от клиента (finished)
+// не закрывает соединение сразу: сначала отвечаем на уже пришедшие кадры и отправляем ответы. false - соединение закрыть.
+bool ExpressionServer::serve(Connection &connection) {
+    char buffer[1 << 16];
+    while (!connection.finished && connection.output.size() < max_backlog) {
+        ssize_t got = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (got > 0) {
+            connection.input.append(buffer, got);
+            continue;
+        }
+        if (got == 0) connection.finished = true;
+        else if (errno == EINTR) continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        else return false;
+    }
+    while (true) {
+        std::size_t pos = 0;
+        while (connection.output.size() < max_backlog && connection.input.size() - pos >= 4) {
+            FrameReader header(std::string_view(connection.input).substr(pos, 4));
+            uint32_t length = header.u32();
+            if (length > max_frame) return false;
+            if (connection.input.size() - pos - 4 < length) break;
+            handle(std::string_view(connection.input).substr(pos + 4, length), connection.output);
+            pos += 4 + length;
+        }
+        connection.input.erase(0, pos);
+        while (!connection.output.empty()) {
+            ssize_t sent = ::send(connection.fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL);
+            if (sent > 0) connection.output.erase(0, sent);
+            else if (sent < 0 && errno == EINTR) continue;
+            else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            else return false;
+        }
+        // Все ушло, а кадры остановились на пределе буфера - разбираем следующие, не дожидаясь poll.
+        if (!connection.output.empty() || pos == 0) break;
+    }
+    return !connection.finished || !connection.output.empty();
+}
+
+void ExpressionServer::run() {
+    std::vector<Connection> connections;
+    std::vector<pollfd> polled;
+    while (true) {
+        polled.clear();
+        polled.push_back({wake[0], POLLIN, 0});
+        polled.push_back({listener, POLLIN, 0});
+        for (const Connection &connection : connections) {
+            bool reading = !connection.finished && connection.output.size() < max_backlog;
+            polled.push_back({connection.fd, (short)((reading ? POLLIN : 0) | (connection.output.empty() ? 0 : POLLOUT)), 0});
+        }
+        if (poll(polled.data(), polled.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "poll failed: " << std::strerror(errno) << "\n";
+            exit(EXIT_FAILURE);
+        }
+        if (polled[0].revents) break;
+        std::size_t polled_connections = connections.size();
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < polled_connections; i++) {
+            Connection &connection = connections[i];
+            bool alive = true;
+            if (polled[i + 2].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) alive = serve(connection);
+            if (!alive) {
+                close(connection.fd);
+                continue;
+            }
+            if (kept != i) connections[kept] = std::move(connection);
+            kept++;
+        }
+        connections.resize(kept);
+        if (polled[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listener, nullptr, nullptr)) >= 0) {
+                set_nonblocking(fd);
+                connections.push_back({fd, "", "", false});
+            }
+        }
+    }
+    for (Connection &connection : connections) close(connection.fd);
+    char byte;
+    while (read(wake[0], &byte, 1) > 0) {}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Клиент
+//---------------------------------------------------------------------------------------------------------------
+
+ExpressionClient::ExpressionClient(std::string path) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = socket_address(path);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        std::cerr << "Cannot connect to " << path << ": " << std::strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+ExpressionClient::~ExpressionClient() {
+    if (fd >= 0) close(fd);
+}
+
+uint32_t ExpressionClient::send(Command command, const std::string &payload) {
+    uint32_t id = next_id++;
+    std::string frame;
+    frame.reserve(9 + payload.size());
+    put_u32(frame, 5 + payload.size());
+    frame.push_back((char)command);
+    put_u32(frame, id);
+    frame += payload;
+    std::size_t done = 0;
+    while (done < frame.size()) {
+        ssize_t sent = ::send(fd, frame.data() + done, frame.size() - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            std::cerr << "Connection to the server is lost\n";
+            exit(EXIT_FAILURE);
+        }
+        done += sent;
+    }
+    return id;
+}
+
+void ExpressionClient::receive(uint32_t &id, Status &status, std::string &payload) {
+    char buffer[1 << 16];
+    while (true) {
+        if (input.size() >= 4) {
+            uint32_t length = FrameReader(std::string_view(input).substr(0, 4)).u32();
+            if (length >= 5 && input.size() - 4 >= length) {
+                FrameReader reader(std::string_view(input).substr(4, 5));
+                status = (Status)reader.u8();
+                id = reader.u32();
+                payload.assign(input, 9, length - 5);
+                input.erase(0, 4 + length);
+                return;
+            }
+        }
+        ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            std::cerr << "Connection to the server is lost\n";
+            exit(EXIT_FAILURE);
+        }
+        input.append(buffer, got);
+    }
+}
+
+std::string ExpressionClient::call(Command command, const std::string &payload) {
+    uint32_t sent = send(command, payload), id;
+    Status status;
+    std::string result;
+    receive(id, status, result);
+    if (id != sent || status != Status::ok) {
+        std::cerr << "Server error: " << result << "\n";
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+uint32_t ExpressionClient::parse(std::string_view text) {
+    std::string payload;
+    put_string(payload, text);
+    return FrameReader(call(Command::parse, payload)).u32();
+}
+
+std::vector<double> ExpressionClient::eval(uint32_t handle, const std::vector<double> &vals) {
+    std::string payload;
+    put_u32(payload, handle);
+    put_u32(payload, vals.size());
+    for (double value : vals) put_double(payload, value);
+    std::string result = call(Command::eval, payload);
+    FrameReader reader(result);
+    std::vector<double> values(result.size() / 8);
+    for (double &value : values) value = reader.f64();
+    return values;
+}
+
+uint32_t ExpressionClient::diff(uint32_t handle, std::string_view name) {
+    std::string payload;
+    put_u32(payload, handle);
+    put_string(payload, name);
+    return FrameReader(call(Command::diff, payload)).u32();
+}
+
+uint32_t ExpressionClient::substitute(uint32_t handle, std::string_view name, double value) {
+    std::string payload;
+    put_u32(payload, handle);
+    put_string(payload, name);
+    put_double(payload, value);
+    return FrameReader(call(Command::substitute, payload)).u32();
+}
+
+std::vector<std::string> ExpressionClient::slots(uint32_t handle) {
+    std::string payload;
+    put_u32(payload, handle);
+    std::string result = call(Command::slots, payload);
+    FrameReader reader(result);
+    std::vector<std::string> names(reader.u32());
+    for (std::string &name : names) name = std::string(reader.string());
+    return names;
+}
+
+std::string ExpressionClient::text(uint32_t handle) {
+    std::string payload;
+    put_u32(payload, handle);
+    std::string result = call(Command::text, payload);
+    return std::string(FrameReader(result).string());
+}
+
+void ExpressionClient::release(uint32_t handle) {
+    std::string payload;
+    put_u32(payload, handle);
+    call(Command::release, payload);
+}
@@ -0,0 +1,117 @@
+#ifndef SERVER_HEADER
+#define SERVER_HEADER
+#include "Expression.hpp"
+#include <functional>
+
+// Сервер вычислений на Unix-сокете. Выражения разбираются, упрощаются и компилируются один раз и живут в сервере,
+// клиенты обращаются к ним по номеру (handle). Запросы можно отправлять подряд, не дожидаясь ответов: ответы
+// приходят в том же порядке и помечены номером запроса.
+//
+// Кадр запроса: u32 длина остатка | u8 команда | u32 номер запроса | данные команды
+// Кадр ответа:  u32 длина остатка | u8 статус  | u32 номер запроса | данные ответа (при ошибке - ее текст)
+// Числа little-endian, double - 8 байт IEEE 754, строка - u32 длина и байты.
+//
+// Команды (данные запроса -> данные ответа):
+//   parse      строка выражения                      -> u32 handle
+//   eval       u32 handle, u32 n, n double           -> n / slots значений (точки подряд, переменные в порядке slots)
+//   diff       u32 handle, строка имени переменной   -> u32 handle производной
+//   substitute u32 handle, строка имени, double      -> u32 handle результата подстановки
+//   slots      u32 handle                            -> u32 count, count строк - имена переменных по порядку
+//   text       u32 handle                            -> строка выражения
+//   release    u32 handle                            -> пусто
+// Повторный parse той же формулы (с точностью до пробелов), diff и substitute с теми же аргументами возвращают уже
+// существующий handle - выражение строится один раз. Каждый такой ответ - отдельная ссылка на handle: выражение
+// удаляется, когда на каждый полученный handle пришел свой release.
+enum class Command : uint8_t {parse = 1, eval, diff, substitute, slots, text, release};
+enum class Status : uint8_t {ok = 0, error = 1};
+
+// Кадры больше этого считаются ошибкой клиента, и соединение закрывается.
+const uint32_t max_frame = 64 << 20;
+
+// Пока у соединения неотправленных ответов больше этого, сервер не читает и не разбирает его новые запросы:
+// клиент, который пишет, но не читает, упирается в буфер сокета, а не раздувает память сервера.
+const std::size_t max_backlog = 4 << 20;
+
+void put_u32(std::string &out, uint32_t value);
+void put_double(std::string &out, double value);
+void put_string(std::string &out, std::string_view value);
+
+// Чтение данных кадра по порядку. Если данных не хватило, ok становится false, а чтения возвращают нули.
+class FrameReader {
+    private:
+        std::string_view data;
+        std::size_t pos = 0;
+        bool take(std::size_t size);
+    public:
+        bool ok = true;
+        FrameReader(std::string_view __data);
+        uint8_t u8();
+        uint32_t u32();
+        double f64();
+        std::string_view string();
+        bool finished() const;
+};
+
+// Один поток обслуживает всех клиентов через poll: неблокирующие сокеты, входной и выходной буферы на соединение.
+// Ответы на все запросы, пришедшие одним чтением, отправляются одной записью. Клиент может закрыть свою сторону
+// (shutdown) сразу после запросов: ответы на все полные кадры будут отправлены, и только потом сервер закроет соединение.
+class ExpressionServer {
+    private:
+        struct Resident {
+            Expression<double> expression;
+            Program<double> program;
+            std::vector<double> registers;
+            std::vector<std::string> keys;
+            uint32_t references = 1;
+        };
+        struct Connection {
+            int fd;
+            std::string input;
+            std::string output;
+            bool finished = false;
+        };
+        std::string path;
+        int listener = -1;
+        int wake[2] = {-1, -1};
+        std::unordered_map<uint32_t, Resident> residents;
+        std::unordered_map<std::string, uint32_t> memo;
+        uint32_t next_handle = 1;
+        bool resident(const std::string &key, const std::function<bool(Expression<double>&, std::string&)> &build, uint32_t &handle, std::string &error);
+        bool serve(Connection &connection);
+    public:
+        ExpressionServer(std::string __path);
+        ExpressionServer(const ExpressionServer &other) = delete;
+        ExpressionServer& operator=(const ExpressionServer &other) = delete;
+        ~ExpressionServer();
+        void run();
+        void stop();
+        void handle(std::string_view request, std::string &response);
+        std::size_t size() const;
+};
+
+// Клиент: send отправляет запрос и сразу возвращает его номер, receive ждет следующий ответ. Между ними можно
+// отправить сколько угодно запросов. Остальные методы - синхронные обертки для одной команды; при ошибке сервера
+// они печатают ее текст и завершают программу, как и остальная библиотека.
+class ExpressionClient {
+    private:
+        int fd = -1;
+        uint32_t next_id = 1;
+        std::string input;
+        std::string call(Command command, const std::string &payload);
+    public:
+        ExpressionClient(std::string path);
+        ExpressionClient(const ExpressionClient &other) = delete;
+        ExpressionClient& operator=(const ExpressionClient &other) = delete;
+        ~ExpressionClient();
+        uint32_t send(Command command, const std::string &payload);
+        void receive(uint32_t &id, Status &status, std::string &payload);
+        uint32_t parse(std::string_view text);
+        std::vector<double> eval(uint32_t handle, const std::vector<double> &vals);
+        uint32_t diff(uint32_t handle, std::string_view name);
+        uint32_t substitute(uint32_t handle, std::string_view name, double value);
+        std::vector<std::string> slots(uint32_t handle);
+        std::string text(uint32_t handle);
+        void release(uint32_t handle);
+};
+
+#endif
@@ -0,0 +1,628 @@
+#ifndef STATIC_HEADER
+#define STATIC_HEADER
+#include "Expression.hpp"
+#include <bit>
+
+// Выражения, разобранные при компиляции: static_expression<"x ^ 2 + 3 * x"> f; f(2.0) == 10.
+// Строка разбирается consteval-парсером по той же грамматике, что и parse_real, ошибка в формуле - ошибка компиляции.
+// Дерево хранится массивом нод прямо в параметре шаблона, а вычисление раскрывается через if constexpr
+// в линейный код без виртуальных вызовов и обращений к массиву нод - как у рукописной лямбды.
+// Переменные получают слоты по алфавиту (как Expression::compile), и operator() принимает ровно столько аргументов.
+// derivative<"x"> - производная, тоже посчитанная при компиляции, с теми же слотами.
+
+// Строковый литерал как параметр шаблона.
+template <std::size_t L> struct StaticString {
+    char data[L] = {};
+    constexpr StaticString(const char (&text)[L]) {
+        for (std::size_t i = 0; i < L; i++) data[i] = text[i];
+    }
+};
+
+// Нода массива: у операции и функции left и right - индексы потомков, у переменной left - номер слота.
+struct StaticNode {
+    NodeKind kind = NodeKind::val;
+    char type = 0;
+    uint32_t left = 0;
+    uint32_t right = 0;
+    double value = 0;
+};
+
+// Дерево на N нод. Потомки всегда раньше родителя. Имена переменных - отрезки исходной строки text.
+template <std::size_t N, std::size_t L> struct StaticTree {
+    StaticNode nodes[N] = {};
+    uint32_t size = 0;
+    uint32_t root = 0;
+    char text[L] = {};
+    uint32_t name_begin[L] = {};
+    uint32_t name_length[L] = {};
+    uint32_t variables = 0;
+    constexpr std::string_view name(uint32_t slot) const {
+        return std::string_view(text + name_begin[slot], name_length[slot]);
+    }
+};
+
+// Вызов не-constexpr функции при вычислении на этапе компиляции останавливает компиляцию, а what видно в диагностике.
+inline void static_expression_error(const char* what) {
+    std::cerr << what << "\n";
+    exit(EXIT_FAILURE);
+}
+
+// Конструкторы нод сразу сворачивают константы и тождества с 0 и 1, как fold_func, - иначе производные разрастаются.
+template <typename Tree> constexpr uint32_t static_node(Tree &tree, StaticNode node) {
+    if (tree.size == sizeof(tree.nodes) / sizeof(StaticNode)) static_expression_error("static_expression: too many nodes");
+    tree.nodes[tree.size] = node;
+    return tree.size++;
+}
+
+template <typename Tree> constexpr uint32_t static_value(Tree &tree, double value) {
+    return static_node(tree, {NodeKind::val, 0, 0, 0, value});
+}
+
+template <typename Tree> constexpr bool static_is(const Tree &tree, uint32_t index, double value) {
+    return tree.nodes[index].kind == NodeKind::val && tree.nodes[index].value == value;
+}
+
+template <typename Tree> constexpr uint32_t static_operation(Tree &tree, OperationType type, uint32_t left, uint32_t right) {
+    const StaticNode &a = tree.nodes[left];
+    const StaticNode &b = tree.nodes[right];
+    if (a.kind == NodeKind::val && b.kind == NodeKind::val) {
+        if (type == OperationType::add) return static_value(tree, a.value + b.value);
+        if (type == OperationType::sub) return static_value(tree, a.value - b.value);
+        if (type == OperationType::mult) return static_value(tree, a.value * b.value);
+        if (type == OperationType::div && b.value != 0) return static_value(tree, a.value / b.value);
+    }
+    if (type == OperationType::add && static_is(tree, left, 0)) return right;
+    if ((type == OperationType::add || type == OperationType::sub) && static_is(tree, right, 0)) return left;
+    if (type == OperationType::sub && static_is(tree, left, 0)) return static_operation(tree, OperationType::mult, static_value(tree, -1), right);
+    if (type == OperationType::mult && (static_is(tree, left, 0) || static_is(tree, right, 0))) return static_value(tree, 0);
+    if (type == OperationType::div && static_is(tree, left, 0)) return static_value(tree, 0);
+    if (type == OperationType::mult && static_is(tree, left, 1)) return right;
+    if ((type == OperationType::mult || type == OperationType::div || type == OperationType::pow) && static_is(tree, right, 1)) return left;
+    if (type == OperationType::pow && static_is(tree, right, 0)) return static_value(tree, 1);
+    return static_node(tree, {NodeKind::op, (char)type, left, right, 0});
+}
+
+template <typename Tree> constexpr uint32_t static_function(Tree &tree, FunctionType type, uint32_t arg) {
+    return static_node(tree, {NodeKind::func, (char)type, arg, arg, 0});
+}
+
+// Длинное беззнаковое число для точного перевода десятичной записи, не уложившейся в быстрый путь parse_number.
+// 4096 бит хватает: static_decimal заранее отсекает переполнение и исчезновение порядка, а значащих цифр берет не больше 800.
+struct StaticBigInt {
+    uint32_t limbs[128] = {};
+    uint32_t size = 0;
+
+    constexpr void multiply_add(uint32_t factor, uint32_t addend) {
+        uint64_t carry = addend;
+        for (uint32_t i = 0; i < size; i++) {
+            carry += (uint64_t)limbs[i] * factor;
+            limbs[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry) limbs[size++] = (uint32_t)carry;
+    }
+    constexpr void shift_left(uint32_t shift) {
+        if (!size) return;
+        uint32_t whole = shift / 32, part = shift % 32;
+        uint32_t result = size + whole + 1;
+        for (uint32_t i = result; i-- > 0;) {
+            uint64_t high = i >= whole && i - whole < size ? limbs[i - whole] : 0;
+            uint64_t low = part && i >= whole + 1 && i - whole - 1 < size ? limbs[i - whole - 1] : 0;
+            limbs[i] = (uint32_t)((high << part) | (low >> (32 - part)));
+        }
+        size = result;
+        while (size && !limbs[size - 1]) size--;
+    }
+    constexpr uint32_t bits() const {
+        if (!size) return 0;
+        uint32_t top = limbs[size - 1], count = 0;
+        while (top) {
+            top >>= 1;
+            count++;
+        }
+        return (size - 1) * 32 + count;
+    }
+    constexpr bool bit(uint32_t index) const {
+        return index / 32 < size && (limbs[index / 32] >> (index % 32)) & 1;
+    }
+    constexpr bool less(const StaticBigInt &other) const {
+        if (size != other.size) return size < other.size;
+        for (uint32_t i = size; i-- > 0;) {
+            if (limbs[i] != other.limbs[i]) return limbs[i] < other.limbs[i];
+        }
+        return false;
+    }
+    // Вычитаемое не больше уменьшаемого.
+    constexpr void subtract(const StaticBigInt &other) {
+        int64_t borrow = 0;
+        for (uint32_t i = 0; i < size; i++) {
+            int64_t difference = (int64_t)limbs[i] - (i < other.size ? other.limbs[i] : 0) - borrow;
+            borrow = difference < 0;
+            limbs[i] = (uint32_t)(difference + (borrow << 32));
+        }
+        while (size && !limbs[size - 1]) size--;
+    }
+};
+
+// Округление до ближайшего double (к четному при равенстве): число равно (head + tail) * 2^power, где tail в [0, 1)
+// и tail != 0 ровно при sticky, а head не короче 55 бит. Лишние младшие биты отбрасываются, для субнормальных чисел -
+// сколько нужно, чтобы порядок не опустился ниже -1074.
+constexpr double static_round(uint64_t head, int power, bool sticky) {
+    int length = 0;
+    for (uint64_t rest = head; rest; rest >>= 1) length++;
+    int shift = length - 53 > -1074 - power ? length - 53 : -1074 - power;
+    uint64_t mantissa = 0;
+    if (shift < 64) {
+        uint64_t dropped = head & ((1ull << shift) - 1), half = 1ull << (shift - 1);
+        mantissa = head >> shift;
+        if (dropped > half || (dropped == half && (sticky || mantissa & 1))) mantissa++;
+    }
+    else if (shift == 64 && (head > 1ull << 63 || (head == 1ull << 63 && sticky))) mantissa = 1;
+    power += shift;
+    if (mantissa == 1ull << 53) {
+        mantissa >>= 1;
+        power++;
+    }
+    if (power > 1023 - 52) static_expression_error("static_expression: number is too large");
+    if (mantissa < 1ull << 52) return std::bit_cast<double>(mantissa);
+    return std::bit_cast<double>((uint64_t)(power + 1075) << 52 | (mantissa - (1ull << 52)));
+}
+
+// Точный перевод: digits - цифры мантиссы, возможно с точкой, значение равно digits * 10^power.
+// Для power >= 0 число собирается целиком и берутся его старшие 63 бита, для power < 0 - 63 бита частного
+// digits * 2^k / 10^-power; остаток от сдвига или деления дает sticky. Цифры после 800-й значащей
+// учитываются только в sticky: середина между соседними double записывается не более чем 767 цифрами,
+// так что такие хвосты никогда не решают округление сами по себе.
+constexpr double static_decimal(std::string_view digits, int power) {
+    StaticBigInt number;
+    uint32_t count = 0;
+    bool fraction = false, sticky = false;
+    for (char sym : digits) {
+        if (sym == '.') {
+            fraction = true;
+            continue;
+        }
+        if (count < 800) {
+            number.multiply_add(10, sym - '0');
+            if (number.size) count++;
+            if (fraction) power--;
+        }
+        else {
+            sticky = sticky || sym != '0';
+            if (!fraction) power++;
+        }
+    }
+    if (!number.size) return 0;
+    // 10^(count + power - 1) <= число < 10^(count + power): с запасом вне диапазона double.
+    if ((int)count + power > 310) static_expression_error("static_expression: number is too large");
+    if ((int)count + power < -325) return 0;
+    if (power >= 0) {
+        for (int i = 0; i < power; i++) number.multiply_add(10, 0);
+        uint32_t length = number.bits();
+        if (length < 63) {
+            number.shift_left(63 - length);
+            return static_round(number.limbs[0] | (uint64_t)number.limbs[1] << 32, (int)length - 63, sticky);
+        }
+        uint64_t head = 0;
+        for (uint32_t i = length; i-- > length - 63;) head = head << 1 | number.bit(i);
+        for (uint32_t i = 0; i < length - 63 && !sticky; i++) sticky = number.bit(i);
+        return static_round(head, (int)length - 63, sticky);
+    }
+    StaticBigInt scale;
+    scale.multiply_add(1, 1);
+    for (int i = 0; i < -power; i++) scale.multiply_add(10, 0);
+    // Сдвиг выбран так, что частное занимает 63 или 64 бита; 64-битное укорачивается на один бит в sticky.
+    int shift = 63 + (int)scale.bits() - (int)number.bits();
+    if (shift >= 0) number.shift_left(shift);
+    else scale.shift_left(-shift);
+    uint64_t head = 0;
+    for (int i = 63; i >= 0; i--) {
+        StaticBigInt part = scale;
+        part.shift_left(i);
+        if (!number.less(part)) {
+            number.subtract(part);
+            head |= 1ull << i;
+        }
+    }
+    sticky = sticky || number.size;
+    if (head >> 63) {
+        sticky = sticky || head & 1;
+        head >>= 1;
+        shift--;
+    }
+    return static_round(head, -shift, sticky);
+}
+
+// Разбор повторяет Parser: приоритеты, правоассоциативная ^, унарный минус и неявное умножение "3x".
+template <typename Tree> struct StaticParser {
+    Tree &tree;
+    std::size_t length;
+    std::size_t pos = 0;
+
+    constexpr bool letter(char sym) const {
+        return (sym >= 'a' && sym <= 'z') || (sym >= 'A' && sym <= 'Z') || sym == '_';
+    }
+    constexpr bool digit(char sym) const {
+        return sym >= '0' && sym <= '9';
+    }
+    constexpr void skip_spaces() {
+        while (pos < length && tree.text[pos] == ' ') pos++;
+    }
+    constexpr bool at_word() const {
+        return pos < length && letter(tree.text[pos]);
+    }
+    constexpr void expect(char sym) {
+        skip_spaces();
+        if (pos >= length || tree.text[pos] != sym) static_expression_error("static_expression: expected ')'");
+        pos++;
+    }
+    constexpr uint32_t parse() {
+        uint32_t result = parse_expression(1);
+        skip_spaces();
+        if (pos < length) static_expression_error("static_expression: wrong symbol");
+        return result;
+    }
+    constexpr uint32_t parse_expression(int min_precedence) {
+        uint32_t left = parse_unary();
+        while (true) {
+            skip_spaces();
+            if (pos >= length) break;
+            char sym = tree.text[pos];
+            int current = precedence(sym);
+            if (current == 0 || current < min_precedence) break;
+            pos++;
+            uint32_t right = parse_expression(sym == '^' ? current : current + 1);
+            OperationType type = OperationType::add;
+            if (sym == '-') type = OperationType::sub;
+            if (sym == '*') type = OperationType::mult;
+            if (sym == '/') type = OperationType::div;
+            if (sym == '^') type = OperationType::pow;
+            left = static_node(tree, {NodeKind::op, (char)type, left, right, 0});
+        }
+        return left;
+    }
+    constexpr uint32_t parse_unary() {
+        skip_spaces();
+        if (pos < length && tree.text[pos] == '-') {
+            pos++;
+            skip_spaces();
+            if (pos < length && (digit(tree.text[pos]) || tree.text[pos] == '.')) return parse_number(true);
+            uint32_t operand = parse_expression(3);
+            if (tree.nodes[operand].kind == NodeKind::val) return static_value(tree, -tree.nodes[operand].value);
+            return static_node(tree, {NodeKind::op, (char)OperationType::mult, static_value(tree, -1), operand, 0});
+        }
+        if (pos < length && tree.text[pos] == '+') {
+            pos++;
+            return parse_unary();
+        }
+        return parse_primary();
+    }
+    constexpr uint32_t parse_primary() {
+        skip_spaces();
+        if (pos >= length) static_expression_error("static_expression: unexpected end of input");
+        if (tree.text[pos] == '(') {
+            pos++;
+            uint32_t inner = parse_expression(1);
+            expect(')');
+            return inner;
+        }
+        if (digit(tree.text[pos]) || tree.text[pos] == '.') return parse_number(false);
+        if (at_word()) return parse_word();
+        static_expression_error("static_expression: wrong symbol");
+        return 0;
+    }
+    // Быстрый путь: мантисса до 19 цифр и степень десяти. Если отброшенных ненулевых цифр нет, мантисса меньше 2^53,
+    // а степень не больше 22 по модулю, результат - одно точное умножение или деление (оба сомножителя представимы
+    // точно), то есть правильно округленное число. Остальное переводит static_decimal длинной арифметикой.
+    // Переполнение - ошибка компиляции, слишком малые числа становятся нулем.
+    constexpr uint32_t parse_number(bool negative) {
+        std::size_t begin = pos;
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        bool any = false, exact = true;
+        while (pos < length && digit(tree.text[pos])) {
+            any = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (tree.text[pos] - '0');
+                if (mantissa) digits++;
+            }
+            else {
+                exponent++;
+                exact = exact && tree.text[pos] == '0';
+            }
+            pos++;
+        }
+        if (pos < length && tree.text[pos] == '.') {
+            pos++;
+            while (pos < length && digit(tree.text[pos])) {
+                any = true;
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (tree.text[pos] - '0');
+                    if (mantissa) digits++;
+                    exponent--;
+                }
+                else exact = exact && tree.text[pos] == '0';
+                pos++;
+            }
+        }
+        if (!any) static_expression_error("static_expression: cannot parse a number");
+        std::string_view written(tree.text + begin, pos - begin);
+        int power = 0;
+        if (pos < length && (tree.text[pos] == 'e' || tree.text[pos] == 'E')) {
+            std::size_t sign = pos + 1 < length && (tree.text[pos + 1] == '+' || tree.text[pos + 1] == '-') ? 1 : 0;
+            if (pos + 1 + sign < length && digit(tree.text[pos + 1 + sign])) {
+                bool minus = sign && tree.text[pos + 1] == '-';
+                pos += 1 + sign;
+                while (pos < length && digit(tree.text[pos])) {
+                    if (power < 100000) power = power * 10 + (tree.text[pos] - '0');
+                    pos++;
+                }
+                if (minus) power = -power;
+            }
+        }
+        exponent += power;
+        double number = 0;
+        if (exact && mantissa < 1ull << 53 && exponent >= -22 && exponent <= 22) {
+            double scale = 1;
+            for (int i = 0; i < (exponent < 0 ? -exponent : exponent); i++) scale *= 10;
+            number = exponent < 0 ? (double)mantissa / scale : (double)mantissa * scale;
+        }
+        else number = static_decimal(written, power);
+        if (negative) number = -number;
+        uint32_t value = static_value(tree, number);
+        if (at_word()) return static_node(tree, {NodeKind::op, (char)OperationType::mult, value, parse_expression(3), 0});
+        return value;
+    }
+    constexpr bool word_is(std::size_t begin, std::size_t end, std::string_view word) const {
+        return std::string_view(tree.text + begin, end - begin) == word;
+    }
+    constexpr uint32_t parse_word() {
+        std::size_t begin = pos;
+        while (pos < length && (letter(tree.text[pos]) || digit(tree.text[pos]))) pos++;
+        FunctionType type = FunctionType::sin;
+        bool function = true;
+        if (word_is(begin, pos, "sin")) type = FunctionType::sin;
+        else if (word_is(begin, pos, "cos")) type = FunctionType::cos;
+        else if (word_is(begin, pos, "ln")) type = FunctionType::ln;
+        else if (word_is(begin, pos, "exp")) type = FunctionType::exp;
+        else function = false;
+        if (function) {
+            skip_spaces();
+            if (pos >= length || tree.text[pos] != '(') static_expression_error("static_expression: function has no argument");
+            pos++;
+            uint32_t arg = parse_expression(1);
+            expect(')');
+            return static_function(tree, type, arg);
+        }
+        uint32_t slot = 0;
+        while (slot < tree.variables && tree.name(slot) != std::string_view(tree.text + begin, pos - begin)) slot++;
+        if (slot == tree.variables) {
+            tree.name_begin[slot] = begin;
+            tree.name_length[slot] = pos - begin;
+            tree.variables++;
+        }
+        return static_node(tree, {NodeKind::var, 0, slot, 0, 0});
+    }
+};
+
+// Переносит в дерево точного размера только ноды, достижимые из корня. Порядок "потомки раньше" сохраняется.
+template <std::size_t M, typename Tree> consteval auto static_shrink(const Tree &tree) {
+    StaticTree<M ? M : 1, sizeof(tree.text)> result;
+    bool reachable[sizeof(tree.nodes) / sizeof(StaticNode)] = {};
+    uint32_t index[sizeof(tree.nodes) / sizeof(StaticNode)] = {};
+    reachable[tree.root] = true;
+    for (uint32_t i = tree.root + 1; i-- > 0;) {
+        if (!reachable[i] || tree.nodes[i].kind == NodeKind::val || tree.nodes[i].kind == NodeKind::var) continue;
+        reachable[tree.nodes[i].left] = true;
+        reachable[tree.nodes[i].right] = true;
+    }
+    for (uint32_t i = 0; i <= tree.root; i++) {
+        if (!reachable[i]) continue;
+        StaticNode node = tree.nodes[i];
+        if (node.kind == NodeKind::op || node.kind == NodeKind::func) {
+            node.left = index[node.left];
+            node.right = index[node.right];
+        }
+        index[i] = static_node(result, node);
+    }
+    result.root = index[tree.root];
+    for (std::size_t i = 0; i < sizeof(tree.text); i++) {
+        result.text[i] = tree.text[i];
+        result.name_begin[i] = tree.name_begin[i];
+        result.name_length[i] = tree.name_length[i];
+    }
+    result.variables = tree.variables;
+    return result;
+}
+
+template <typename Tree> consteval uint32_t static_count(const Tree &tree) {
+    bool reachable[sizeof(tree.nodes) / sizeof(StaticNode)] = {};
+    uint32_t count = 0;
+    reachable[tree.root] = true;
+    for (uint32_t i = tree.root + 1; i-- > 0;) {
+        if (!reachable[i]) continue;
+        count++;
+        if (tree.nodes[i].kind == NodeKind::val || tree.nodes[i].kind == NodeKind::var) continue;
+        reachable[tree.nodes[i].left] = true;
+        reachable[tree.nodes[i].right] = true;
+    }
+    return count;
+}
+
+// Слоты нумеруются по алфавиту: имена сортируются после разбора, номера в нодах переставляются.
+template <StaticString S> consteval auto static_parse_full() {
+    constexpr std::size_t L = sizeof(S.data);
+    StaticTree<2 * L + 2, L> tree;
+    for (std::size_t i = 0; i < L; i++) tree.text[i] = S.data[i];
+    StaticParser<StaticTree<2 * L + 2, L>> parser{tree, L - 1};
+    tree.root = parser.parse();
+    uint32_t order[L] = {}, slot[L] = {};
+    for (uint32_t i = 0; i < tree.variables; i++) order[i] = i;
+    for (uint32_t i = 1; i < tree.variables; i++) {
+        for (uint32_t j = i; j > 0 && tree.name(order[j]) < tree.name(order[j - 1]); j--) std::swap(order[j], order[j - 1]);
+    }
+    uint32_t begin[L] = {}, count[L] = {};
+    for (uint32_t i = 0; i < tree.variables; i++) {
+        slot[order[i]] = i;
+        begin[i] = tree.name_begin[order[i]];
+        count[i] = tree.name_length[order[i]];
+    }
+    for (uint32_t i = 0; i < tree.variables; i++) {
+        tree.name_begin[i] = begin[i];
+        tree.name_length[i] = count[i];
+    }
+    for (uint32_t i = 0; i < tree.size; i++) {
+        if (tree.nodes[i].kind == NodeKind::var) tree.nodes[i].left = slot[tree.nodes[i].left];
+    }
+    return tree;
+}
+
+template <StaticString S> consteval auto static_parse() {
+    constexpr auto full = static_parse_full<S>();
+    return static_shrink<static_count(full)>(full);
+}
+
+// Производная по слоту: новые ноды дописываются в конец и ссылаются на уже имеющиеся, так что дерево становится DAG
+// и подвыражения не копируются. Правила те же, что у diff_func.
+template <typename Tree> consteval auto static_diff_full(const Tree &source, uint32_t slot) {
+    constexpr std::size_t N = sizeof(source.nodes) / sizeof(StaticNode);
+    StaticTree<8 * N + 8, sizeof(source.text)> tree;
+    for (uint32_t i = 0; i < source.size; i++) tree.nodes[i] = source.nodes[i];
+    tree.size = source.size;
+    for (std::size_t i = 0; i < sizeof(source.text); i++) {
+        tree.text[i] = source.text[i];
+        tree.name_begin[i] = source.name_begin[i];
+        tree.name_length[i] = source.name_length[i];
+    }
+    tree.variables = source.variables;
+    uint32_t diff[N] = {};
+    for (uint32_t i = 0; i < source.size; i++) {
+        StaticNode node = source.nodes[i];
+        uint32_t a = node.left, b = node.right;
+        if (node.kind == NodeKind::val) diff[i] = static_value(tree, 0);
+        else if (node.kind == NodeKind::var) diff[i] = static_value(tree, node.left == slot ? 1 : 0);
+        else if (node.kind == NodeKind::func) {
+            FunctionType type = (FunctionType)node.type;
+            uint32_t inner = 0;
+            if (type == FunctionType::sin) inner = static_function(tree, FunctionType::cos, a);
+            if (type == FunctionType::cos) inner = static_operation(tree, OperationType::mult, static_value(tree, -1), static_function(tree, FunctionType::sin, a));
+            if (type == FunctionType::exp) inner = i;
+            if (type == FunctionType::ln) {
+                diff[i] = static_operation(tree, OperationType::div, diff[a], a);
+                continue;
+            }
+            diff[i] = static_operation(tree, OperationType::mult, inner, diff[a]);
+        }
+        else {
+            OperationType type = (OperationType)node.type;
+            if (type == OperationType::add || type == OperationType::sub) diff[i] = static_operation(tree, type, diff[a], diff[b]);
+            if (type == OperationType::mult) {
+                diff[i] = static_operation(tree, OperationType::add,
+                    static_operation(tree, OperationType::mult, diff[a], b),
+                    static_operation(tree, OperationType::mult, a, diff[b]));
+            }
+            if (type == OperationType::div) {
+                uint32_t top = static_operation(tree, OperationType::sub,
+                    static_operation(tree, OperationType::mult, diff[a], b),
+                    static_operation(tree, OperationType::mult, a, diff[b]));
+                diff[i] = static_operation(tree, OperationType::div, top, static_operation(tree, OperationType::pow, b, static_value(tree, 2)));
+            }
+            if (type == OperationType::pow) {
+                // Постоянная степень: c * a ^ (c - 1) * a'. Иначе (a ^ b)' = a ^ b * (b' * ln(a) + b * a' / a).
+                if (static_is(tree, diff[b], 0)) {
+                    uint32_t lower = static_operation(tree, OperationType::pow, a, static_operation(tree, OperationType::sub, b, static_value(tree, 1)));
+                    diff[i] = static_operation(tree, OperationType::mult, static_operation(tree, OperationType::mult, b, lower), diff[a]);
+                }
+                else {
+                    uint32_t sum = static_operation(tree, OperationType::add,
+                        static_operation(tree, OperationType::mult, diff[b], static_function(tree, FunctionType::ln, a)),
+                        static_operation(tree, OperationType::div, static_operation(tree, OperationType::mult, b, diff[a]), a));
+                    diff[i] = static_operation(tree, OperationType::mult, i, sum);
+                }
+            }
+        }
+    }
+    tree.root = diff[source.root];
+    return tree;
+}
+
+template <auto Tree> consteval uint32_t static_slot(std::string_view name) {
+    for (uint32_t i = 0; i < Tree.variables; i++) {
+        if (Tree.name(i) == name) return i;
+    }
+    return Tree.variables;
+}
+
+template <auto Tree, StaticString Name> consteval auto static_diff() {
+    constexpr auto full = static_diff_full(Tree, static_slot<Tree>(std::string_view(Name.data, sizeof(Name.data) - 1)));
+    return static_shrink<static_count(full)>(full);
+}
+
+template <auto Tree> struct static_tree_function {
+    static constexpr std::size_t arity = Tree.variables;
+    static constexpr std::size_t size = Tree.size;
+
+    template <uint32_t I> static constexpr double evaluate(const double* vals) {
+        constexpr StaticNode node = Tree.nodes[I];
+        if constexpr (node.kind == NodeKind::val) return node.value;
+        else if constexpr (node.kind == NodeKind::var) return vals[node.left];
+        else if constexpr (node.kind == NodeKind::func) {
+            double arg = evaluate<node.left>(vals);
+            if constexpr ((FunctionType)node.type == FunctionType::sin) return std::sin(arg);
+            else if constexpr ((FunctionType)node.type == FunctionType::cos) return std::cos(arg);
+            else if constexpr ((FunctionType)node.type == FunctionType::ln) return std::log(arg);
+            else return std::exp(arg);
+        }
+        else {
+            double left = evaluate<node.left>(vals);
+            double right = evaluate<node.right>(vals);
+            if constexpr ((OperationType)node.type == OperationType::add) return left + right;
+            else if constexpr ((OperationType)node.type == OperationType::sub) return left - right;
+            else if constexpr ((OperationType)node.type == OperationType::mult) return left * right;
+            else if constexpr ((OperationType)node.type == OperationType::div) return left / right;
+            else return std::pow(left, right);
+        }
+    }
+
+    template <typename... Args> requires (sizeof...(Args) == arity && (std::is_convertible_v<Args, double> && ...))
+    constexpr double operator()(Args... args) const {
+        const double vals[arity + 1] = {(double)args...};
+        return evaluate<Tree.root>(vals);
+    }
+
+    constexpr double operator()(const double* vals) const {
+        return evaluate<Tree.root>(vals);
+    }
+
+    static constexpr std::string_view variable(uint32_t slot) {
+        return Tree.name(slot);
+    }
+
+    template <StaticString Name> static constexpr uint32_t slot() {
+        constexpr uint32_t found = static_slot<Tree>(std::string_view(Name.data, sizeof(Name.data) - 1));
+        static_assert(found < arity, "static_expression: no such variable");
+        return found;
+    }
+
+    template <StaticString Name> using derivative = static_tree_function<static_diff<Tree, Name>()>;
+
+    // Обычное выражение с тем же деревом - чтобы упростить, напечатать или передать в остальной код.
+    static Expression<double> expression() {
+        std::unordered_set<std::string> vars;
+        for (uint32_t i = 0; i < arity; i++) vars.insert(std::string(Tree.name(i)));
+        return Expression<double>(std::make_shared<Head<double>>(build(Tree.root)), vars);
+    }
+
+    private:
+        static std::shared_ptr<Node<double>> build(uint32_t index) {
+            StaticNode node = Tree.nodes[index];
+            if (node.kind == NodeKind::val) return std::make_shared<Value<double>>(node.value);
+            if (node.kind == NodeKind::var) return std::make_shared<Variable<double>>(std::string(Tree.name(node.left)));
+            if (node.kind == NodeKind::func) return std::make_shared<Function<double>>((FunctionType)node.type, build(node.left));
+            return std::make_shared<Operation<double>>((OperationType)node.type, build(node.left), build(node.right));
+        }
+};
+
+template <StaticString S> using static_expression = static_tree_function<static_parse<S>()>;
+
+#endif
@@ -0,0 +1,117 @@
+#include "Stream.hpp"
+#include <cstring>
+
+bool parse_number(std::string_view text, double &number) {
+    if (!text.empty() && text[0] == '+') text.remove_prefix(1);
+    if (text.empty() || text[0] == '+') return false;
+    std::from_chars_result parsed = std::from_chars(text.data(), text.data() + text.size(), number);
+    return parsed.ec == std::errc() && parsed.ptr == text.data() + text.size();
+}
+
+// Мнимая часть без числа ("i", "-i") - это 1 или -1. Граница между частями - последний знак, который не начинает
+// строку и не стоит после e в показателе степени.
+bool parse_number(std::string_view text, std::complex<double> &number) {
+    if (text.empty()) return false;
+    if (text.back() != 'i') {
+        double real;
+        if (!parse_number(text, real)) return false;
+        number = real;
+        return true;
+    }
+    text.remove_suffix(1);
+    std::size_t split = 0;
+    for (std::size_t i = text.size(); i > 1; i--) {
+        char sym = text[i - 1];
+        if ((sym == '+' || sym == '-') && text[i - 2] != 'e' && text[i - 2] != 'E') {
+            split = i - 1;
+            break;
+        }
+    }
+    double real = 0.0, imag;
+    if (split && !parse_number(text.substr(0, split), real)) return false;
+    std::string_view imag_text = text.substr(split);
+    if (imag_text.empty() || imag_text == "+") imag = 1.0;
+    else if (imag_text == "-") imag = -1.0;
+    else if (!parse_number(imag_text, imag)) return false;
+    number = std::complex<double>(real, imag);
+    return true;
+}
+
+LineReader::LineReader(FILE* __file, std::size_t capacity) : file(__file), buffer(capacity) {}
+
+// Незаконченная строка в конце буфера переносится в начало, и буфер дочитывается. Если строка длиннее буфера,
+// буфер растет вдвое.
+bool LineReader::next(std::string_view &line) {
+    while (true) {
+        const char* start = buffer.data() + begin;
+        const char* newline = static_cast<const char*>(std::memchr(start, '\n', end - begin));
+        if (newline || (finished && begin < end)) {
+            std::size_t length = newline ? newline - start : end - begin;
+            begin += newline ? length + 1 : length;
+            if (length && start[length - 1] == '\r') length--;
+            line = std::string_view(start, length);
+            return true;
+        }
+        if (finished) return false;
+        if (begin) {
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size()) buffer.resize(buffer.size() * 2);
+        std::size_t read = std::fread(buffer.data() + end, 1, buffer.size() - end, file);
+        end += read;
+        if (read == 0) finished = true;
+    }
+}
+
+OutputBuffer::OutputBuffer(FILE* __file, std::size_t __capacity) : file(__file), capacity(__capacity) {
+    text.reserve(capacity);
+}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+}
+
+void OutputBuffer::reserve_line() {
+    if (text.size() + 64 > capacity) flush();
+}
+
+void OutputBuffer::flush() {
+    if (!text.empty()) std::fwrite(text.data(), 1, text.size(), file);
+    text.clear();
+    std::fflush(file);
+}
+
+static bool is_separator(char sym) {
+    return sym == ' ' || sym == '\t' || sym == ',';
+}
+
+static bool is_name(char sym) {
+    return std::isalnum((unsigned char)sym) || sym == '_';
+}
+
+bool split_fields(std::string_view line, bool assignments, std::vector<Field> &fields) {
+    fields.clear();
+    std::size_t i = 0, n = line.size();
+    while (true) {
+        while (i < n && is_separator(line[i])) i++;
+        if (i == n) return true;
+        Field field;
+        if (assignments) {
+            std::size_t start = i;
+            while (i < n && is_name(line[i])) i++;
+            if (i == start || std::isdigit((unsigned char)line[start])) return false;
+            field.name = line.substr(start, i - start);
+            while (i < n && (line[i] == ' ' || line[i] == '\t')) i++;
+            if (i == n || line[i] != '=') return false;
+            i++;
+            while (i < n && (line[i] == ' ' || line[i] == '\t')) i++;
+        }
+        std::size_t start = i;
+        while (i < n && !is_separator(line[i]) && !(assignments && line[i] == '=')) i++;
+        if (i == start) return false;
+        field.value = line.substr(start, i - start);
+        fields.push_back(field);
+    }
+}
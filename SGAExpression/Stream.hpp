@@ -0,0 +1,140 @@
+#ifndef STREAM_HEADER
+#define STREAM_HEADER
+#include "Expression.hpp"
+#include <cstdio>
+
+// Потоковое вычисление: выражение разбирается и компилируется один раз, а значения переменных приходят записями
+// из файла или stdin. Записи бывают двух видов:
+//   assignments - в каждой строке присваивания "x=1 y=2.5" (в любом порядке, через пробелы или запятые);
+//   columns     - первая строка - заголовок с именами переменных, дальше в каждой строке значения по столбцам.
+// Пустые строки пропускаются. На каждую запись выводится одна строка с результатом.
+enum class StreamFormat : char {assignments, columns};
+
+// Разбор чисел без regex. Комплексные числа записываются как "3", "-2.5", "4i", "-i", "3+4i", "1.5e-3-2i".
+// Возвращает false, если строка не число целиком.
+bool parse_number(std::string_view text, double &number);
+bool parse_number(std::string_view text, std::complex<double> &number);
+
+// Чтение строк большими блоками: строка - это string_view внутрь буфера, действительный до следующего вызова next.
+class LineReader {
+    private:
+        FILE* file;
+        std::vector<char> buffer;
+        std::size_t begin = 0;
+        std::size_t end = 0;
+        bool finished = false;
+    public:
+        LineReader(FILE* __file, std::size_t capacity = 1 << 20);
+        bool next(std::string_view &line);
+};
+
+// Вывод через один буфер, который сбрасывается в файл, когда в нем не остается места под очередную строку
+// (числа печатаются не длиннее 64 символов), и в деструкторе.
+class OutputBuffer {
+    private:
+        FILE* file;
+        std::size_t capacity;
+    public:
+        std::string text;
+        OutputBuffer(FILE* __file, std::size_t capacity = 1 << 16);
+        OutputBuffer(const OutputBuffer &other) = delete;
+        OutputBuffer& operator=(const OutputBuffer &other) = delete;
+        ~OutputBuffer();
+        void reserve_line();
+        void flush();
+};
+
+// Разбитая на поля строка записи: поля разделяются пробелами, табуляцией и запятыми.
+// В режиме присваиваний поле - "имя=значение", пробелы вокруг "=" допускаются.
+struct Field {
+    std::string_view name;
+    std::string_view value;
+};
+bool split_fields(std::string_view line, bool assignments, std::vector<Field> &fields);
+
+// Вычисляет выражение для всех записей из in и пишет результаты в out. Записи копятся блоками по Program::block
+// и считаются пакетом (run_batch), так что на запись приходится только разбор чисел и печать результата.
+// Возвращает число обработанных записей. Ошибка в записи завершает программу с номером строки, как и остальные
+// ошибки библиотеки.
+template <typename T> std::size_t stream_evaluate(const Expression<T> &expr, FILE* in, FILE* out, StreamFormat format);
+
+//---------------------------------------------------------------------------------------------------------------
+// Потоковое вычисление
+//---------------------------------------------------------------------------------------------------------------
+
+template <typename T> std::size_t stream_evaluate(const Expression<T> &expr, FILE* in, FILE* out, StreamFormat format) {
+    LineReader reader(in);
+    OutputBuffer output(out);
+    std::vector<Field> fields;
+    std::string_view line;
+    std::size_t line_number = 0;
+    Program<T> program;
+    std::vector<T> columns, results(Program<T>::block), regs;
+    std::vector<const T*> pointers;
+    std::size_t rows = 0, total = 0;
+    auto run = [&]() {
+        program.run_batch(pointers.data(), results.data(), rows, regs.data());
+        for (std::size_t i = 0; i < rows; i++) {
+            output.reserve_line();
+            write_number(output.text, results[i]);
+            output.text.push_back('\n');
+        }
+        total += rows;
+        rows = 0;
+    };
+    // Записи до ошибочной еще выводятся, чтобы было видно, где остановилось вычисление.
+    auto fail = [&](std::string message) {
+        if (rows) run();
+        output.flush();
+        std::cerr << "Line " << line_number << ": " << message << "\n";
+        exit(EXIT_FAILURE);
+    };
+
+    if (format == StreamFormat::columns) {
+        std::vector<std::string> header;
+        while (header.empty() && reader.next(line)) {
+            line_number++;
+            if (!split_fields(line, false, fields)) fail("malformed header");
+            for (const Field &field : fields) header.push_back(std::string(field.value));
+        }
+        program = expr.compile(header);
+    }
+    else program = expr.compile();
+    const std::size_t slots = program.slots.size();
+    columns.resize(slots * Program<T>::block);
+    pointers.resize(slots);
+    for (std::size_t i = 0; i < slots; i++) pointers[i] = columns.data() + i * Program<T>::block;
+    regs = program.make_batch_registers();
+    std::vector<char> assigned(slots);
+
+    while (reader.next(line)) {
+        line_number++;
+        if (!split_fields(line, format == StreamFormat::assignments, fields)) fail("malformed record");
+        if (fields.empty()) continue;
+        if (format == StreamFormat::columns) {
+            if (fields.size() != slots) fail("expected " + std::to_string(slots) + " values, got " + std::to_string(fields.size()));
+            for (std::size_t i = 0; i < slots; i++) {
+                if (!parse_number(fields[i].value, columns[i * Program<T>::block + rows])) fail("\"" + std::string(fields[i].value) + "\" is not a number");
+            }
+        }
+        else {
+            std::fill(assigned.begin(), assigned.end(), 0);
+            for (const Field &field : fields) {
+                std::size_t slot = 0;
+                while (slot < slots && program.slots[slot] != field.name) slot++;
+                if (slot == slots) fail("\"" + std::string(field.name) + "\" - no such variable");
+                if (assigned[slot]) fail("\"" + std::string(field.name) + "\" - variable is given twice");
+                if (!parse_number(field.value, columns[slot * Program<T>::block + rows])) fail("\"" + std::string(field.value) + "\" is not a number");
+                assigned[slot] = 1;
+            }
+            for (std::size_t slot = 0; slot < slots; slot++) {
+                if (!assigned[slot]) fail("\"" + program.slots[slot] + "\" - variable is not given");
+            }
+        }
+        if (++rows == Program<T>::block) run();
+    }
+    if (rows) run();
+    return total;
+}
+
+#endif
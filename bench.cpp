@@ -0,0 +1,374 @@
+#include "Expression.hpp"
+#include "Jit.hpp"
+#include "Parallel.hpp"
+#include "Serial.hpp"
+#include "Incremental.hpp"
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+
+// Микробенчмарки основных операций. Результат - JSON в stdout (или в файл --out), чтобы сравнивать коммиты:
+//   bench --seed 1 --depth 6 --width 4 --vars 3 --functions 0.3 --count 16 --time 0.2 --out result.json
+// Пакетные замеры (run_batch, run_batch_parallel) считают за одну операцию весь пакет из --points точек,
+// параллельный идет на пуле из --threads потоков (0 - по числу ядер).
+// Для каждой операции: ns/op, allocations/op (все вызовы любой формы operator new за время замера) и nodes/op -
+// среднее число различных нод во входном выражении.
+
+static std::atomic<uint64_t> allocations{0};
+
+// Заменено все семейство operator new/delete: массивы, выровненные и nothrow-формы тоже считаются, и каждая
+// форма delete освобождает память того же malloc, что и парная ей new. Выровненная память берется из aligned_alloc,
+// размер которой должен быть кратен выравниванию.
+static void* counted_alloc(std::size_t size, std::size_t alignment) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+static void* checked_alloc(std::size_t size, std::size_t alignment) {
+    if (void* p = counted_alloc(size, alignment)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) {
+    return checked_alloc(size, 0);
+}
+
+void* operator new[](std::size_t size) {
+    return checked_alloc(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return checked_alloc(size, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return checked_alloc(size, (std::size_t)alignment);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return counted_alloc(size, (std::size_t)alignment);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
+
+struct BenchConfig {
+    uint64_t seed = 1;
+    unsigned depth = 6;
+    unsigned width = 4;
+    unsigned vars = 3;
+    double functions = 0.3;
+    unsigned count = 16;
+    double time = 0.2;
+    std::size_t points = 1 << 16;
+    unsigned threads = 0;
+    std::string out;
+};
+
+// Генератор случайных выражений: сумма width поддеревьев глубины не больше depth над vars переменными,
+// functions - доля функций среди внутренних нод. Аргументы ln и знаменатели имеют вид (...) ^ 2 + c,
+// чтобы свертка констант никогда не встретила логарифм отрицательного числа или деление на ноль.
+class ExpressionGenerator {
+    private:
+        std::mt19937_64 random;
+        BenchConfig config;
+        double uniform() { return std::uniform_real_distribution<double>(0.0, 1.0)(random); }
+        unsigned pick(unsigned n) { return std::uniform_int_distribution<unsigned>(0, n - 1)(random); }
+        std::string constant() { return two_string(0.5 + pick(300) / 100.0); }
+        std::string leaf() {
+            if (uniform() < 0.3) return constant();
+            return std::string(1, 'a' + pick(config.vars));
+        }
+        std::string positive(unsigned depth) { return "(" + node(depth) + ") ^ 2 + " + constant(); }
+        std::string node(unsigned depth) {
+            if (depth == 0 || uniform() < 0.15) return leaf();
+            if (uniform() < config.functions) {
+                unsigned type = pick(4);
+                if (type == 0) return "sin(" + node(depth - 1) + ")";
+                if (type == 1) return "cos(" + node(depth - 1) + ")";
+                if (type == 2) return "exp(" + node(depth - 1) + " / 10)";
+                return "ln(" + positive(depth - 1) + ")";
+            }
+            unsigned type = pick(5);
+            if (type == 0) return "(" + node(depth - 1) + " + " + node(depth - 1) + ")";
+            if (type == 1) return "(" + node(depth - 1) + " - " + node(depth - 1) + ")";
+            if (type == 2) return node(depth - 1) + " * " + node(depth - 1);
+            if (type == 3) return "(" + node(depth - 1) + ") / (" + positive(depth - 1) + ")";
+            return "(" + node(depth - 1) + ") ^ " + std::to_string(2 + pick(2));
+        }
+    public:
+        ExpressionGenerator(const BenchConfig &__config) : random(__config.seed), config(__config) {}
+        std::string generate() {
+            std::string result = node(config.depth);
+            for (unsigned i = 1; i < config.width; i++) result += " + " + node(config.depth);
+            return result;
+        }
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocations_per_op;
+    double nodes_per_op;
+};
+
+// Замер повторяется партиями по count операций, пока не наберется config.time секунд.
+// setup готовит входы партии вне замера (например, копии выражений для упрощения на месте).
+template <typename Input> BenchResult measure(const BenchConfig &config, std::string name, double nodes,
+    std::function<std::vector<Input>()> setup, std::function<void(Input&)> operation) {
+    BenchResult result = {name, 0, 0, 0, nodes};
+    std::chrono::nanoseconds elapsed(0);
+    uint64_t allocated = 0;
+    while (elapsed.count() < config.time * 1e9 || result.iterations == 0) {
+        std::vector<Input> inputs = setup();
+        uint64_t before = allocations.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        for (Input &input : inputs) operation(input);
+        elapsed += std::chrono::steady_clock::now() - start;
+        allocated += allocations.load(std::memory_order_relaxed) - before;
+        result.iterations += inputs.size();
+    }
+    result.ns_per_op = (double)elapsed.count() / result.iterations;
+    result.allocations_per_op = (double)allocated / result.iterations;
+    return result;
+}
+
+#ifndef SGA_REVISION
+#define SGA_REVISION ""
+#endif
+
+static volatile double sink;
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string key = argv[i], value = argv[i + 1];
+        if (key == "--seed") config.seed = std::stoull(value);
+        else if (key == "--depth") config.depth = std::stoul(value);
+        else if (key == "--width") config.width = std::stoul(value);
+        else if (key == "--vars") config.vars = std::max(1ul, std::min(26ul, std::stoul(value)));
+        else if (key == "--functions") config.functions = std::stod(value);
+        else if (key == "--count") config.count = std::max(1ul, std::stoul(value));
+        else if (key == "--time") config.time = std::stod(value);
+        else if (key == "--points") config.points = std::max(1ul, std::stoul(value));
+        else if (key == "--threads") config.threads = std::stoul(value);
+        else if (key == "--out") config.out = value;
+        else {
+            std::cerr << "Unknown option: " << key << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ExpressionGenerator generator(config);
+    std::vector<std::string> sources;
+    std::vector<Expression<double>> exprs;
+    std::vector<std::string> names;
+    for (unsigned i = 0; i < config.vars; i++) names.push_back(std::string(1, 'a' + i));
+    std::vector<double> point(config.vars);
+    for (unsigned i = 0; i < config.vars; i++) point[i] = 0.3 + 0.1 * i;
+    for (unsigned i = 0; i < config.count; i++) {
+        sources.push_back(generator.generate());
+        exprs.push_back(construct_real(sources.back()));
+    }
+    double nodes = 0, simplified_nodes = 0;
+    std::vector<Expression<double>> simplified = exprs;
+    for (unsigned i = 0; i < config.count; i++) {
+        nodes += exprs[i].count_nodes();
+        simplified[i].simplify();
+        simplified_nodes += simplified[i].count_nodes();
+    }
+    nodes /= config.count;
+    simplified_nodes /= config.count;
+    // calculate требует ровно те переменные, что есть в выражении, поэтому у каждого выражения свой список.
+    std::vector<std::vector<std::string>> used(config.count);
+    std::vector<std::vector<double>> used_point(config.count);
+    for (unsigned i = 0; i < config.count; i++) {
+        std::unordered_set<std::string> present = simplified[i].get_variables();
+        for (unsigned k = 0; k < config.vars; k++) {
+            if (present.count(names[k])) {
+                used[i].push_back(names[k]);
+                used_point[i].push_back(point[k]);
+            }
+        }
+        if (used[i].empty()) {
+            std::cerr << "Generated expression has no variables, try another --seed.\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    std::vector<std::map<std::string, Interval<double>>> boxes(config.count);
+    for (unsigned i = 0; i < config.count; i++) {
+        for (std::size_t k = 0; k < used[i].size(); k++) boxes[i][used[i][k]] = Interval<double>(used_point[i][k] - 0.1, used_point[i][k] + 0.1);
+    }
+    std::vector<IncrementalEvaluator<double>> evaluators;
+    for (unsigned i = 0; i < config.count; i++) {
+        std::map<std::string, double> start;
+        for (std::size_t k = 0; k < used[i].size(); k++) start[used[i][k]] = used_point[i][k];
+        evaluators.emplace_back(simplified[i], start);
+    }
+    std::vector<std::string> blobs;
+    for (unsigned i = 0; i < config.count; i++) blobs.push_back(serialize(exprs[i]));
+    std::vector<Program<double>> programs;
+    std::vector<JitFunction> jits;
+    for (unsigned i = 0; i < config.count; i++) {
+        programs.push_back(exprs[i].compile(names));
+        jits.emplace_back(exprs[i], names);
+    }
+
+    std::vector<std::vector<double>> columns(config.vars, std::vector<double>(config.points));
+    for (unsigned k = 0; k < config.vars; k++) {
+        for (std::size_t j = 0; j < config.points; j++) columns[k][j] = point[k] + 1e-6 * j;
+    }
+    std::vector<const double*> column_pointers;
+    for (unsigned k = 0; k < config.vars; k++) column_pointers.push_back(columns[k].data());
+    std::vector<double> batch_out(config.points);
+    ThreadPool pool(config.threads);
+
+    auto indices = [&]() {
+        std::vector<unsigned> result(config.count);
+        for (unsigned i = 0; i < config.count; i++) result[i] = i;
+        return result;
+    };
+    std::vector<BenchResult> results;
+    results.push_back(measure<unsigned>(config, "construct_real", nodes, indices, [&](unsigned &i) {
+        sink = construct_real(sources[i]).count_nodes();
+    }));
+    results.push_back(measure<unsigned>(config, "construct_complex", nodes, indices, [&](unsigned &i) {
+        sink = construct_complex(sources[i]).count_nodes();
+    }));
+    results.push_back(measure<unsigned>(config, "serialize", nodes, indices, [&](unsigned &i) {
+        sink = serialize(exprs[i]).size();
+    }));
+    results.push_back(measure<unsigned>(config, "load_blob", nodes, indices, [&](unsigned &i) {
+        ExpressionBlob<double> blob;
+        std::string error;
+        sink = blob.attach(blobs[i], error) ? blob.expand().count_nodes() : 0;
+    }));
+    results.push_back(measure<unsigned>(config, "copy", nodes, indices, [&](unsigned &i) {
+        Expression<double> copy = exprs[i];
+        sink = copy.head.use_count();
+    }));
+    // Копия по конструктору делит ноды с exprs, и simplify первым делом клонировал бы дерево в own_func.
+    // Поэтому копии забирают деревья себе еще в setup, и замер видит только само упрощение.
+    auto owned = [&]() {
+        std::vector<Expression<double>> copies = exprs;
+        for (Expression<double> &copy : copies) own_func(copy.head->next);
+        return copies;
+    };
+    results.push_back(measure<Expression<double>>(config, "simplify", nodes, owned, [&](Expression<double> &expr) {
+        expr.simplify();
+    }));
+    results.push_back(measure<unsigned>(config, "differentiate", simplified_nodes, indices, [&](unsigned &i) {
+        sink = simplified[i].differentiate(used[i][0]).count_nodes();
+    }));
+    results.push_back(measure<unsigned>(config, "calculate", simplified_nodes, indices, [&](unsigned &i) {
+        sink = simplified[i].calculate(used[i], used_point[i]);
+    }));
+    results.push_back(measure<unsigned>(config, "calculate_interval", simplified_nodes, indices, [&](unsigned &i) {
+        sink = simplified[i].calculate_interval(boxes[i]).upper;
+    }));
+    // Значение меняется на каждом шаге, иначе set не портит ничего и пересчета нет.
+    std::vector<uint64_t> steps(config.count);
+    results.push_back(measure<unsigned>(config, "incremental_set", simplified_nodes, indices, [&](unsigned &i) {
+        evaluators[i].set(0, ++steps[i] % 2 ? 0.5 : 0.6);
+        sink = evaluators[i].value();
+    }));
+    results.push_back(measure<unsigned>(config, "substitute", simplified_nodes, indices, [&](unsigned &i) {
+        sink = simplified[i].substitute(used[i][0], 0.5).count_nodes();
+    }));
+    results.push_back(measure<unsigned>(config, "to_string", simplified_nodes, indices, [&](unsigned &i) {
+        sink = simplified[i].to_string().size();
+    }));
+    results.push_back(measure<unsigned>(config, "program_run", simplified_nodes, indices, [&](unsigned &i) {
+        sink = programs[i].run(point);
+    }));
+    results.push_back(measure<unsigned>(config, "jit_run", simplified_nodes, indices, [&](unsigned &i) {
+        sink = jits[i].run(point.data());
+    }));
+    results.push_back(measure<unsigned>(config, "run_batch", simplified_nodes, indices, [&](unsigned &i) {
+        programs[i].run_batch(column_pointers, batch_out.data(), config.points);
+        sink = batch_out.back();
+    }));
+    results.push_back(measure<unsigned>(config, "run_batch_parallel", simplified_nodes, indices, [&](unsigned &i) {
+        run_batch(programs[i], column_pointers, batch_out.data(), config.points, pool);
+        sink = batch_out.back();
+    }));
+
+    std::string json = "{\n  \"revision\": \"" + std::string(SGA_REVISION) + "\",\n  \"config\": {\"seed\": " + std::to_string(config.seed) + ", \"depth\": " + std::to_string(config.depth)
+        + ", \"width\": " + std::to_string(config.width) + ", \"vars\": " + std::to_string(config.vars)
+        + ", \"functions\": " + two_string(config.functions) + ", \"count\": " + std::to_string(config.count)
+        + ", \"time\": " + two_string(config.time) + ", \"points\": " + std::to_string(config.points)
+        + ", \"threads\": " + std::to_string(pool.size()) + "},\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        json += "    {\"name\": \"" + results[i].name + "\", \"iterations\": " + std::to_string(results[i].iterations)
+            + ", \"ns_per_op\": " + two_string(results[i].ns_per_op) + ", \"allocations_per_op\": " + two_string(results[i].allocations_per_op)
+            + ", \"nodes_per_op\": " + two_string(results[i].nodes_per_op) + "}" + (i + 1 < results.size() ? "," : "") + "\n";
+    }
+    json += "  ]\n}\n";
+    if (config.out.empty()) std::cout << json;
+    else std::ofstream(config.out) << json;
+}
@@ -0,0 +1,70 @@
+#include "Server.hpp"
+#include "Stream.hpp"
+#include <chrono>
+
+// Пример клиента сервера вычислений (differentiator --serve SOCKET):
+//   client SOCKET "EXPRESSION" [name=value ...]
+// Разбирает выражение на сервере, вычисляет его и все частные производные в заданной точке, затем измеряет
+// задержку одиночных запросов eval (p50 и p99) и пропускную способность запросов, отправленных подряд.
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Invalid request. Correct form: client SOCKET \"EXPRESSION\" [name=value ...]\n";
+        exit(EXIT_FAILURE);
+    }
+    ExpressionClient client(argv[1]);
+    uint32_t handle = client.parse(argv[2]);
+    std::vector<std::string> slots = client.slots(handle);
+    std::vector<double> point(slots.size(), 0.0);
+    std::vector<Field> fields;
+    for (int i = 3; i < argc; i++) {
+        double value;
+        if (!split_fields(argv[i], true, fields) || fields.size() != 1 || !parse_number(fields[0].value, value)) {
+            std::cerr << "\"" << argv[i] << "\" is not an assignment\n";
+            exit(EXIT_FAILURE);
+        }
+        auto slot = std::find(slots.begin(), slots.end(), fields[0].name);
+        if (slot == slots.end()) {
+            std::cerr << "\"" << fields[0].name << "\" - no such variable\n";
+            exit(EXIT_FAILURE);
+        }
+        point[slot - slots.begin()] = value;
+    }
+
+    std::cout << "f = " << client.text(handle) << " = " << two_string(client.eval(handle, point)[0]) << "\n";
+    for (const std::string &name : slots) {
+        uint32_t derivative = client.diff(handle, name);
+        std::vector<double> derivative_point;
+        for (const std::string &slot : client.slots(derivative)) derivative_point.push_back(point[std::find(slots.begin(), slots.end(), slot) - slots.begin()]);
+        std::cout << "df/d" << name << " = " << client.text(derivative) << " = " << two_string(client.eval(derivative, derivative_point)[0]) << "\n";
+    }
+
+    const unsigned rounds = 20000;
+    std::vector<double> latencies(rounds);
+    for (unsigned i = 0; i < rounds; i++) {
+        auto start = std::chrono::steady_clock::now();
+        client.eval(handle, point);
+        latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "eval latency: p50 " << two_string(latencies[rounds / 2]) << " us, p99 " << two_string(latencies[rounds * 99 / 100]) << " us\n";
+
+    std::string payload;
+    put_u32(payload, handle);
+    put_u32(payload, point.size());
+    for (double value : point) put_double(payload, value);
+    const unsigned pipelined = 100000, window = 256;
+    auto start = std::chrono::steady_clock::now();
+    uint32_t id;
+    Status status;
+    std::string result;
+    for (unsigned sent = 0, received = 0; received < pipelined;) {
+        while (sent < pipelined && sent - received < window) {
+            client.send(Command::eval, payload);
+            sent++;
+        }
+        client.receive(id, status, result);
+        received++;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "pipelined eval: " << two_string(pipelined / seconds) << " requests/s\n";
+}
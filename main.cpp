@@ -1,7 +1,77 @@
 #include "Expression.hpp"
+#include "Stream.hpp"
+#include "Server.hpp"
+#include "Serial.hpp"
+#include "Cache.hpp"
 #include <regex>
 #include <algorithm>
 #include <complex>
+#include <sys/stat.h>
+
+// Есть ли в строке мнимая единица: "i" в начале, после цифры, пробела или знака, и не часть более длинного имени.
+bool mentions_imaginary(std::string_view text) {
+    for (std::size_t pos = text.find('i'); pos != std::string_view::npos; pos = text.find('i', pos + 1)) {
+        char before = pos ? text[pos - 1] : ' ';
+        bool starts = std::isdigit((unsigned char)before) || before == ' ' || before == '\t' || before == '+' || before == '-';
+        bool ends = pos + 1 == text.size() || !(std::isalnum((unsigned char)text[pos + 1]) || text[pos + 1] == '_');
+        if (starts && ends) return true;
+    }
+    return false;
+}
+
+// differentiator --stream "EXPRESSION" [--columns] [--complex] [--input FILE]
+// Записи читаются из FILE или stdin, результаты пишутся в stdout по одному в строке.
+int stream(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Invalid request. Correct form: differentiator --stream \"EXPRESSION\" [--columns] [--complex] [--input FILE]\n";
+        exit(EXIT_FAILURE);
+    }
+    StreamFormat format = StreamFormat::assignments;
+    bool complex = mentions_imaginary(argv[2]);
+    FILE* in = stdin;
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--columns") format = StreamFormat::columns;
+        else if (option == "--complex") complex = true;
+        else if (option == "--input" && i + 1 < argc) {
+            in = std::fopen(argv[++i], "rb");
+            if (!in) {
+                std::cerr << "Cannot open " << argv[i] << "\n";
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            std::cerr << "Unknown option: " << option << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (complex) stream_evaluate(construct_complex(argv[2]), in, stdout, format);
+    else stream_evaluate(construct_real(argv[2]), in, stdout, format);
+    if (in != stdin) std::fclose(in);
+    return 0;
+}
+
+// Кэш производных в каталоге dir. Имя файла - контрольная сумма ключа (тип чисел, формула без пробелов и переменная),
+// а сам ключ записан в метку файла и сверяется при чтении. При попадании формула не разбирается и не
+// дифференцируется: производная читается из файла через mmap. Испорченный или чужой файл - промах, он перезаписывается.
+template <typename T> void diff_cached(const std::string &text, const std::string &name, const std::string &dir) {
+    std::string key = std::string(std::is_same_v<T, double> ? "real" : "complex") + "\n" + ExpressionCache<T>::normalise(text) + "\n" + name;
+    char file_name[32];
+    std::snprintf(file_name, sizeof(file_name), "%016llx.sgax", (unsigned long long)blob_checksum(key.data(), key.size()));
+    std::string path = dir + "/" + file_name, error;
+    ExpressionBlob<T> blob;
+    if (blob.open(path, error) && blob.tag() == key) {
+        std::cout << blob.expand() << "\n";
+        return;
+    }
+    Expression<T> expr;
+    if constexpr (std::is_same_v<T, double>) expr = construct_real(text);
+    else expr = construct_complex(text);
+    Expression<T> derivative = expr.differentiate(name);
+    std::cout << derivative << "\n";
+    mkdir(dir.c_str(), 0777);
+    if (!write_file(path, serialize(derivative, key))) std::cerr << "Cannot write cache file " << path << "\n";
+}
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
@@ -9,13 +79,17 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
     std::string type = argv[1];
-    bool complex = false;
-    for (int i = 2; i < argc; i++) {
-        if (std::regex_search(std::string(argv[i]), std::regex(R"((\d|^|\s|\+|\-)i\b)"))) {
-            complex = true;
-            break;
+    if (type == "--stream") return stream(argc, argv);
+    if (type == "--serve") {
+        if (argc != 3) {
+            std::cerr << "Invalid request. Correct form: differentiator --serve SOCKET_PATH\n";
+            exit(EXIT_FAILURE);
         }
+        ExpressionServer(argv[2]).run();
+        return 0;
     }
+    bool complex = false;
+    for (int i = 2; i < argc && !complex; i++) complex = mentions_imaginary(argv[i]);
     if (type == "--eval") {
         if (complex) {
             std::regex reg(R"(^\s*([a-zA-Z_]\w*)\s*=\s*([-+]?\d*\.?\d+)?\s*([+-]?)\s*(\d*\.?\d*)(i)?\s*$)");
@@ -63,11 +137,16 @@ int main(int argc, char* argv[]) {
         }
     }
     else if (type == "--diff") {
-        if (argc != 5 || std::string(argv[3]) != "--by") {
-            std::cerr << "Invalid request. Correct form: differentiator --diff \"EXPRESSION\" --by VARIABLE_NAME\n";
+        bool cached = argc == 7 && std::string(argv[5]) == "--cache";
+        if ((argc != 5 && !cached) || std::string(argv[3]) != "--by") {
+            std::cerr << "Invalid request. Correct form: differentiator --diff \"EXPRESSION\" --by VARIABLE_NAME [--cache DIRECTORY]\n";
             exit(EXIT_FAILURE);
         }
-        if (complex) {
+        if (cached) {
+            if (complex) diff_cached<std::complex<double>>(argv[2], argv[4], argv[6]);
+            else diff_cached<double>(argv[2], argv[4], argv[6]);
+        }
+        else if (complex) {
             Expression<std::complex<double>> expr = construct_complex(argv[2]);
             std::cout << expr.differentiate(argv[4]) << "\n";
         }
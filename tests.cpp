@@ -1,4 +1,21 @@
 #include "Expression.hpp"
+#include "Cache.hpp"
+#include "Jit.hpp"
+#include "Static.hpp"
+#include "Parallel.hpp"
+#include "Stream.hpp"
+#include "Server.hpp"
+#include "Serial.hpp"
+#include "Incremental.hpp"
+#include <fstream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <iterator>
+#include <cstring>
 
 int main()
 {
@@ -75,7 +92,7 @@ int main()
         std::string original = expr.to_string();
         std::complex<double> point(12, 7);
         std::complex<double> result = expr.calculate({"x"},{point});
-        std::string expect = "(158.80310880829 + 151.948186528497i)";
+        std::string expect = "(123.80310880829 + 71.9481865284974i)";
         std::cout << "Test 7. Calculation. Original expression: " << original << "\nPoint of calculation: " << two_string(point) << "\nResult: " << two_string(result) << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
         if (two_string(result) == expect) std::cout << "OK\n\n";
         else std::cout << "FAIL\n\n";
@@ -97,7 +114,7 @@ int main()
         std::string original = expr.to_string();
         expr = expr.differentiate("x");
         std::string result = expr.to_string();
-        std::string expect = "y * (1 / x) * sin(x) + cos(x) * y * ln(x)";
+        std::string expect = "y * ((1 / x) * sin(x) + cos(x) * ln(x))";
         std::cout << "Test 9. Differentiation of product. Original expression:" << original << "\nResult: " << result << "\n" << "Expected result:" << expect << "\n" << "Verdict: ";
         if (result == expect) std::cout << "OK\n\n";
         else std::cout << "FAIL\n\n";
@@ -137,4 +154,737 @@ int main()
         else std::cout << "FAIL\n\n";
     }
 
-} 
+    {
+        Expression<double> expr = construct_real("x ^ 2 + 3 * x - sin(y) / exp(x * y)");
+        std::string original = expr.to_string();
+        Program<double> program = expr.compile({"x", "y"});
+        double result = program.run({13.8, 0.5});
+        double expect = expr.calculate({"x", "y"}, {13.8, 0.5});
+        std::complex<double> point(12, 7);
+        Expression<std::complex<double>> cexpr = construct_complex("(10 + 5i) / x + (8 - 6i)^2 + x^2");
+        Program<std::complex<double>> cprogram = cexpr.compile();
+        std::complex<double> cresult = cprogram.run({point});
+        std::complex<double> cexpect = cexpr.calculate({"x"}, {point});
+        std::cout << "Test 13. Compiled calculation. Original expression: " << original << "\nResult: " << two_string(result) << " and " << two_string(cresult) << "\n" << "Expected result: " << two_string(expect) << " and " << two_string(cexpect) << "\n" << "Verdict: ";
+        if (two_string(result) == two_string(expect) && two_string(cresult) == two_string(cexpect)) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<double> expr = construct_real("x * y + ln(z) * w");
+        std::string original = expr.to_string();
+        expr = expr.bind({{"x", 2.0}, {"z", 1.0}});
+        std::string result = expr.to_string();
+        std::string expect = "2y";
+        std::cout << "Test 14. Partial evaluation. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<double> expr = construct_real("x ^ y + sin(x) * cos(y) - ln(x) / exp(y)");
+        std::string original = expr.to_string();
+        std::vector<double> xs, ys, results(1000);
+        for (int i = 0; i < 1000; i++) {
+            xs.push_back(0.5 + i * 0.01);
+            ys.push_back(2.0 - i * 0.003);
+        }
+        expr.calculate_batch({"x", "y"}, {xs.data(), ys.data()}, results.data(), results.size());
+        int mismatches = 0;
+        for (int i = 0; i < 1000; i++) {
+            if (results[i] != expr.calculate({"x", "y"}, {xs[i], ys[i]})) mismatches++;
+        }
+        std::cout << "Test 15. Batch calculation. Original expression: " << original << "\nMismatches: " << mismatches << "\n" << "Expected mismatches: 0\n" << "Verdict: ";
+        if (mismatches == 0) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<double> tree = construct_real("sin(exp(cos(x * y)))");
+        Expression<double> dag = construct_real("sin(exp(cos(x * y)))");
+        std::string original = tree.to_string();
+        dag.share();
+        for (int i = 0; i < 3; i++) {
+            tree = tree.differentiate("x");
+            dag = dag.differentiate("x");
+        }
+        std::string result = two_string(dag.calculate({"x", "y"}, {0.3, 0.7}));
+        std::string expect = two_string(tree.calculate({"x", "y"}, {0.3, 0.7}));
+        std::cout << "Test 16. Shared subexpressions. Original expression: " << original << "\nThird derivative nodes: " << dag.count_nodes() << " instead of " << tree.count_nodes() << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && dag.count_nodes() < tree.count_nodes()) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<double> expr = construct_real("x ^ 2 + 3 * x - ln(y)");
+        std::string original = expr.to_string();
+        FlatExpression<double> flat = expr.flatten();
+        FlatExpression<double> copy = flat;
+        flat = sin(flat * copy) + FlatExpression<double>(Expression<double>("z"));
+        std::string result = flat.to_string() + " = " + two_string(flat.calculate({"x", "y", "z"}, {1.5, 2.0, 0.25}));
+        Expression<double> tree = sin(expr * expr) + Expression<double>("z");
+        std::string expect = tree.to_string() + " = " + two_string(tree.calculate({"x", "y", "z"}, {1.5, 2.0, 0.25}));
+        std::cout << "Test 17. Flat storage. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        ExpressionCache<double> cache;
+        std::vector<std::thread> threads;
+        std::vector<double> results(4);
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back([&cache, &results, i]() {
+                std::shared_ptr<const CachedExpression<double>> entry;
+                for (int j = 0; j < 1000; j++) entry = cache.get(j % 2 ? "x ^ 2 + 3 * x" : "x^2+3*x");
+                std::vector<double> regs = entry->program.make_registers();
+                double point = 13.8;
+                results[i] = entry->program.run(&point, regs.data());
+            });
+        }
+        for (std::thread &thread : threads) thread.join();
+        CacheStats stats = cache.stats();
+        std::string result = two_string(results[0]) + ", " + std::to_string(stats.entries) + " entry, " + std::to_string(stats.hits + stats.misses) + " lookups";
+        std::string expect = "231.84, 1 entry, 4000 lookups";
+        ExpressionCache<double> small(1, 1);
+        small.get("x + 1");
+        small.get("x + 2");
+        small.get("x + 1");
+        auto key = [](std::string_view text) { return ExpressionCache<double>::normalise(text); };
+        bool keys = key("x^2+3*x") == key(" x ^ 2 + 3 * x ") && key("sin( x )") == key("sin(x)") && key("a  b") == "a b" &&
+            key("x 1") != key("x1") && key("1 2") != key("12") && key("2 x") != key("2x") && key("1e - 5") != key("1e-5") && key("1e- 5") != key("1e-5") &&
+            key("x\t+1") != key("x + 1");
+        // Неверная формула не завершает программу и не попадает в кэш.
+        ExpressionCache<double> checked;
+        std::string parse_error, division_error;
+        bool rejected = !checked.get("x + * 2", parse_error) && parse_error == "Non-algebraic expression! Met wrong symbol:*" &&
+            !checked.get("x / (1 - 1)", division_error) && division_error == "Division by zero!" && !checked.get("x\t+1") &&
+            checked.get("x + 1") && checked.stats().entries == 1 && !ExpressionCache<std::complex<double>>().get("sin z");
+        std::cout << "Test 18. Expression cache. Result: " << result << ", " << small.stats().evictions << " evictions\n" << "Expected result: " << expect << ", 2 evictions\n" << "Verdict: ";
+        if (result == expect && keys && rejected && stats.misses >= 1 && stats.misses <= 4 && small.stats().evictions == 2) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<double> expr = construct_real("x * y + sin(x) ^ y - ln(x ^ 2) / exp(y)");
+        std::string original = expr.to_string();
+        Gradient<double> gradient = expr.gradient({{"x", 0.8}, {"y", 1.7}});
+        std::string result = two_string(gradient.value) + ", " + two_string(gradient.partials["x"]) + ", " + two_string(gradient.partials["y"]);
+        std::string expect = two_string(expr.calculate({"x", "y"}, {0.8, 1.7})) + ", "
+            + two_string(expr.differentiate("x").calculate({"x", "y"}, {0.8, 1.7})) + ", "
+            + two_string(expr.differentiate("y").calculate({"x", "y"}, {0.8, 1.7}));
+        std::cout << "Test 19. Gradient. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<std::complex<double>> expr = construct_complex("exp(z * w) / (z + 2i) - cos(w) ^ 2");
+        std::string original = expr.to_string();
+        std::complex<double> z(0.5, -1.0), w(1.5, 0.25);
+        Dual<std::complex<double>, 2> dual = expr.calculate_dual<2>({"z", "w"}, {z, w}, {{1.0, 0.0}, {0.0, 1.0}});
+        std::string result = two_string(dual.tangent[0]) + ", " + two_string(dual.tangent[1]);
+        std::string expect = two_string(expr.differentiate("z").calculate({"z", "w"}, {z, w})) + ", " + two_string(expr.differentiate("w").calculate({"z", "w"}, {z, w}));
+        Expression<double> real = construct_real("x ^ 3 * sin(y)");
+        double derivative = real.derivative("x", {"x", "y"}, {2.0, 0.5});
+        std::cout << "Test 20. Dual numbers. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && two_string(derivative) == two_string(12 * std::sin(0.5))) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<double> expr = construct_real("x * y + sin(x) ^ 2 + exp(z) + a * b + ln(x / y)");
+        std::string original = expr.to_string();
+        std::map<std::string, double> point = {{"a", 1.0}, {"b", 2.0}, {"x", 0.7}, {"y", 1.3}, {"z", 0.2}};
+        std::vector<std::string> names = {"a", "b", "x", "y", "z"};
+        std::vector<double> values = {1.0, 2.0, 0.7, 1.3, 0.2};
+        Hessian<double> dense = expr.hessian(point);
+        Hessian<double> sparse = expr.hessian(point, true);
+        std::map<std::string, double> product = expr.hessian_vector(point, {{"x", 1.0}, {"y", 2.0}});
+        std::string result, expect;
+        for (std::size_t i = 0; i < names.size(); i++) {
+            for (std::size_t j = 0; j < names.size(); j++) {
+                result += two_string(sparse.matrix[i * names.size() + j]) + " ";
+                expect += two_string(expr.differentiate(names[i]).differentiate(names[j]).calculate(names, values)) + " ";
+            }
+        }
+        bool same = dense.names == names && sparse.names == names;
+        for (std::size_t i = 0; i < dense.matrix.size(); i++) same = same && std::abs(dense.matrix[i] - sparse.matrix[i]) < 1e-12;
+        same = same && std::abs(product["x"] - dense.matrix[2 * 5 + 2] - 2 * dense.matrix[2 * 5 + 3]) < 1e-12;
+        std::cout << "Test 21. Hessian. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && same && sparse.passes < dense.passes) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        std::vector<Expression<double>> exprs = {
+            construct_real("sin(x * y) ^ 2 + sin(x * y) / (ln(y) - exp(x)) + x ^ y"),
+            construct_real("(x - y) * (x + 2) / (3 - y) - cos(x) * y"),
+            construct_real("x"),
+            construct_real("2 ^ 10")
+        };
+        Expression<double> deep = construct_real("x * 20");
+        for (int k = 19; k > 0; k--) deep = construct_real("x * " + std::to_string(k)) + sin(deep) * construct_real("y - " + std::to_string(k));
+        exprs.push_back(deep);
+        std::string result, expect;
+        bool native = true;
+        for (Expression<double> &expr : exprs) {
+            JitFunction jit(expr, {"x", "y"});
+            Program<double> program = expr.compile({"x", "y"});
+            native = native && jit.native();
+            for (double x : {0.3, 1.7}) {
+                result += two_string(jit.run({x, 2.5})) + " ";
+                expect += two_string(program.run({x, 2.5})) + " ";
+            }
+        }
+        std::ifstream map("/tmp/perf-" + std::to_string(getpid()) + ".map");
+        std::string line;
+        bool mapped = false;
+        while (std::getline(map, line)) mapped = mapped || line.find("sga::jit") != std::string::npos;
+        #if defined(__x86_64__)
+        bool platform = native && mapped;
+        #else
+        bool platform = true;
+        #endif
+        std::cout << "Test 22. JIT. Original expression: " << exprs[0] << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && platform) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        Expression<double> expr = construct_real("exp(x) / cos(x)").differentiate("x");
+        std::string original = expr.to_string();
+        Expression<double> canonical = expr;
+        SimplifyReport report = canonical.canonicalize();
+        std::string result = canonical.to_string();
+        std::string expect = "(cos(x) * exp(x) + exp(x) * sin(x)) / (cos(x) ^ 2)";
+        std::vector<std::string> sources = {"x + x + x", "2 * x * 3", "x * y - y * x", "-(-x)", "x * x ^ 2 / x", "3 - x"};
+        std::vector<std::string> forms = {"3x", "6x", "0", "x", "x ^ 2", "3 - x"};
+        bool same = report.converged && report.nodes_after < report.nodes_before
+            && two_string(expr.calculate({"x"}, {0.3})) == two_string(canonical.calculate({"x"}, {0.3}));
+        for (std::size_t i = 0; i < sources.size(); i++) {
+            Expression<double> small = construct_real(sources[i]);
+            small.canonicalize();
+            same = same && small.to_string() == forms[i];
+        }
+        // Константы, различные только в 16-м знаке, - разные слагаемые.
+        Expression<double> close = construct_real("sin(x + 0.1000000000000001) - sin(x + 0.1)");
+        close.canonicalize();
+        same = same && close.to_string() != "0";
+        std::cout << "Test 23. Canonical form. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && same) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        using formula = static_expression<"sin(x * y) ^ 2 + exp(y) / ln(x) - 1.5e-1 * y ^ x">;
+        static_assert(formula::arity == 2 && formula::slot<"y">() == 1);
+        static_assert(static_expression<"x * x + 3x - -2">{}(2.0) == 12.0);
+        // Числа вне быстрого пути округляются так же, как у компилятора, а слишком малые становятся нулем.
+        static_assert(static_expression<"x * 123456789012345678901234">{}(1.0) == 123456789012345678901234.0);
+        static_assert(static_expression<"x * 8.589973e-300">{}(1.0) == 8.589973e-300);
+        static_assert(static_expression<"x * 1.7976931348623157e308">{}(1.0) == 1.7976931348623157e308);
+        static_assert(static_expression<"x * 2.4703282292062328e-324">{}(1.0) == 4.9406564584124654e-324);
+        static_assert(static_expression<"x * 1e-400 + 1">{}(1.0) == 1.0);
+        Expression<double> expr = construct_real("sin(x * y) ^ 2 + exp(y) / ln(x) - 1.5e-1 * y ^ x");
+        std::string original = expr.to_string();
+        std::string result = two_string(formula{}(1.3, 0.7)) + ", " + two_string(formula::derivative<"x">{}(1.3, 0.7))
+            + ", " + two_string(formula::derivative<"x">::derivative<"y">{}(1.3, 0.7));
+        std::string expect = two_string(expr.calculate({"x", "y"}, {1.3, 0.7})) + ", " + two_string(expr.differentiate("x").calculate({"x", "y"}, {1.3, 0.7}))
+            + ", " + two_string(expr.differentiate("x").differentiate("y").calculate({"x", "y"}, {1.3, 0.7}));
+        std::string text = static_expression<"x ^ 2 + 3 * x">::derivative<"x">::expression().to_string();
+        std::cout << "Test 24. Static expression. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && text == "2x + 3") std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Цепочки длины n: сумма n переменных и n вложенных синусов. Весь набор операций над ними проходит
+        // без переполнения стека, а время при росте n в 10 раз растет примерно в 10 раз, а не в 100 (порог 15 - это n^1.18).
+        // Малый размер прогоняется 10 раз, и его выражения живут до конца замеров: куча в обоих замерах одного размера,
+        // и отношение показывает рост алгоритма, а не то, что хэш-таблицы на 10^5 нод целиком лежат в кэше.
+        std::vector<Expression<double>> kept;
+        auto chains = [&kept](std::size_t n, std::string &summary) {
+            auto start = std::chrono::steady_clock::now();
+            std::string sum = "x";
+            for (std::size_t i = 1; i < n; i++) sum += " + x";
+            std::string nested = std::string(4 * n, ' ') + "0.5" + std::string(n, ')');
+            for (std::size_t i = 0; i < n; i++) nested.replace(4 * i, 4, "sin(");
+            bool ok = true;
+            {
+                Expression<double> expr = construct_real(sum);
+                Expression<double> copy = expr;
+                ok = ok && copy.to_string().size() == sum.size() && expr.count_nodes() == 2 * n - 1;
+                ok = ok && expr.calculate({"x"}, {0.5}) == 0.5 * n;
+                ok = ok && expr.differentiate("x").to_string() == two_string(n);
+                ok = ok && expr.substitute("x", 2.0).to_string().size() == sum.size();
+                ok = ok && expr.compile().run(std::vector<double>{0.5}) == 0.5 * n;
+                ok = ok && expr.flatten().expand().to_string() == copy.to_string();
+                Expression<double> shared = expr;
+                shared.share();
+                ok = ok && shared.count_nodes() == n && shared.store->size() == n;
+                Expression<double> canonical = expr;
+                canonical.canonicalize();
+                ok = ok && canonical.to_string() == two_string(n) + "x";
+                kept.push_back(std::move(shared));
+                kept.push_back(std::move(canonical));
+            }
+            {
+                Expression<double> expr = construct_real(nested);
+                double value = 0.5;
+                for (std::size_t i = 0; i < n; i++) value = std::sin(value);
+                ok = ok && expr.to_string() == nested && Expression<double>(expr).to_string() == nested;
+                ok = ok && std::abs(expr.head->calculate() - value) < 1e-12;
+                expr.simplify();
+                ok = ok && expr.to_string() == two_string(value);
+                Expression<double> wrapped = construct_real("x + " + nested.substr(0, 4 * n) + "x" + std::string(n, ')'));
+                ok = ok && std::abs(wrapped.compile().run(std::vector<double>{0.5}) - (0.5 + value)) < 1e-12;
+                ok = ok && std::abs(wrapped.flatten().calculate({"x"}, {0.5}) - (0.5 + value)) < 1e-12;
+                Expression<double> canonical = wrapped;
+                SimplifyReport report = canonical.canonicalize();
+                ok = ok && report.converged && std::abs(canonical.flatten().calculate({"x"}, {0.5}) - (0.5 + value)) < 1e-12;
+                kept.push_back(std::move(wrapped));
+                kept.push_back(std::move(canonical));
+            }
+            summary = ok ? "all operations match" : "mismatch";
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * (ok ? 1 : -1);
+        };
+        std::string small_summary, large_summary;
+        double small = 0;
+        for (int run = 0; run < 10; run++) small += chains(100000, small_summary) / 10;
+        double large = chains(1000000, large_summary);
+        kept.clear();
+        std::string result = "n = 10^6: " + large_summary + ", time ratio to n = 10^5: " + two_string(large / small);
+        std::string expect = "n = 10^6: all operations match, time ratio below 15";
+        std::cout << "Test 25. Chains of 10^6 nodes. Original expression: x + x + ... + x, sin(sin(...sin(0.5)...))\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (small > 0 && large > 0 && large / small < 15) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Одна и та же запись в строку-буфер (дописывается в конец), в поток и через итератор вывода.
+        const Expression<double> expr = construct_real("sin(x) ^ 3 / (x - exp(2x)) * ln(x ^ 2 + 1)").differentiate("x");
+        std::string original = expr.to_string();
+        std::string buffer = "f' = ";
+        expr.write(buffer);
+        bool appended = buffer == "f' = " + original;
+        buffer.clear();
+        expr.write(buffer);
+        std::ostringstream stream;
+        stream << expr;
+        std::string copied;
+        auto it = std::back_inserter(copied);
+        expr.write(it);
+        Expression<std::complex<double>> complex_expr = construct_complex("(12 + 6i) * z - 3i + 2.5");
+        std::ostringstream complex_stream;
+        complex_stream << complex_expr;
+        bool numbers = true;
+        for (double number : {0.1, 1.0 / 3, -0.0, 1e-7, 6.02214076e23, 123456789012345678.0, 5e-324, -2.5}) {
+            char expect_number[32];
+            snprintf(expect_number, sizeof(expect_number), "%.15g", number);
+            numbers = numbers && two_string(number) == expect_number;
+        }
+        std::string result = buffer == original && stream.str() == original && copied == original ? "buffer, stream and iterator agree" : "outputs differ";
+        std::string expect = "buffer, stream and iterator agree";
+        std::cout << "Test 26. Output writer. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && appended && numbers && complex_stream.str() == "(12 + 6i)z - 3i + 2.5") std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Разбор нод по виду без RTTI: посетитель считает ноды каждого вида, а присваивание сохраняет вид и тип ноды.
+        Expression<double> expr = construct_real("sin(x) * 2 + ln(y) ^ 3");
+        std::string original = expr.to_string();
+        std::array<int, 5> counts = {};
+        walk_func<double>(expr.head->next, [](const std::shared_ptr<Node<double>> &) { return true; }, [&](const std::shared_ptr<Node<double>> &current, bool) {
+            visit_node(current.get(), node_handlers{
+                [&](const Operation<double> &) { counts[0]++; },
+                [&](const Function<double> &) { counts[1]++; },
+                [&](const Variable<double> &) { counts[2]++; },
+                [&](const Value<double> &) { counts[3]++; },
+                [&](const Head<double> &) { counts[4]++; }
+            });
+        });
+        Function<double> function(FunctionType::sin, std::make_shared<Variable<double>>("x"));
+        Function<double> assigned(FunctionType::exp, std::make_shared<Value<double>>(1.0));
+        assigned = function;
+        std::string result = std::to_string(counts[0]) + " operations, " + std::to_string(counts[1]) + " functions, " +
+            std::to_string(counts[2]) + " variables, " + std::to_string(counts[3]) + " numbers";
+        std::string expect = "3 operations, 2 functions, 2 variables, 2 numbers";
+        std::cout << "Test 27. Node visitor. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && counts[4] == 0 && assigned.kind == NodeKind::func && assigned.type == FunctionType::sin && node_cast<Operation<double>>(expr.head->next)->type == OperationType::add) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Параллельный результат побитово совпадает с однопоточным при любом числе потоков и размере куска.
+        Expression<double> expr = construct_real("sin(x) * exp(y / 10) + ln(x ^ 2 + 1) / (y ^ 2 + 2) - x ^ 3");
+        std::string original = expr.to_string();
+        const std::size_t n = 100003;
+        std::vector<double> xs(n), ys(n), serial(n);
+        for (std::size_t i = 0; i < n; i++) {
+            xs[i] = -3.0 + 6.0 * i / n;
+            ys[i] = std::cos(0.001 * i) * 5;
+        }
+        expr.calculate_batch({"x", "y"}, {xs.data(), ys.data()}, serial.data(), n);
+        bool same = true;
+        for (unsigned threads : {1u, 3u, 8u}) {
+            ThreadPool pool(threads, threads == 3);
+            for (std::size_t chunk : {(std::size_t)1, (std::size_t)Program<double>::block, (std::size_t)5000}) {
+                std::vector<double> parallel(n, -1.0);
+                calculate_batch(expr, {"x", "y"}, {xs.data(), ys.data()}, parallel.data(), n, pool, chunk);
+                same = same && std::memcmp(parallel.data(), serial.data(), n * sizeof(double)) == 0;
+            }
+        }
+        ThreadPool pool(4);
+        std::vector<std::atomic<int>> hits(1000);
+        pool.run(hits.size(), [&](std::size_t task, unsigned worker) { hits[task]++; });
+        bool once = std::all_of(hits.begin(), hits.end(), [](const std::atomic<int> &hit) { return hit == 1; });
+        std::string result = same ? "identical for 1, 3 and 8 threads" : "results differ";
+        std::string expect = "identical for 1, 3 and 8 threads";
+        std::cout << "Test 28. Parallel batch. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && once) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Копии и операции ссылаются на общие ноды, а изменение на месте забирает их себе и не видно другим выражениям.
+        Expression<double> expr = construct_real("sin(x) * 2 + ln(y) ^ 3 + 0 * x");
+        std::string original = expr.to_string();
+        Expression<double> copy = expr;
+        Expression<double> sum = expr + copy;
+        Expression<double> wrapped = sin(expr);
+        bool shared = copy.head->next == expr.head->next && node_cast<Operation<double>>(sum.head->next)->left == expr.head->next &&
+            node_cast<Function<double>>(wrapped.head->next)->arg == expr.head->next;
+        copy.simplify();
+        sum.self_substitute("x", 1.0);
+        bool isolated = expr.to_string() == original && node_cast<Function<double>>(wrapped.head->next)->arg == expr.head->next &&
+            copy.to_string() == "sin(x) * 2 + ln(y) ^ 3" && sum.get_variables().size() == 1 && expr.get_variables().size() == 2;
+        // Сумма из n слагаемых с разными переменными строится за линейное время. Как и в тесте цепочек, малая сумма
+        // строится 10 раз без освобождения, чтобы оба замера шли в одинаково заполненной памяти.
+        std::vector<Expression<double>> kept;
+        auto build = [&kept](unsigned n) {
+            auto start = std::chrono::steady_clock::now();
+            Expression<double> total("x0");
+            for (unsigned k = 1; k < n; k++) total = std::move(total) + Expression<double>("x" + std::to_string(k));
+            Expression<double> twice = total * total;
+            bool ok = twice.count_nodes() == 2 * n && twice.get_variables().size() == n;
+            double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            kept.push_back(std::move(twice));
+            return time * (ok ? 1 : -1);
+        };
+        double small = 0;
+        for (int run = 0; run < 10; run++) small += build(100000) / 10;
+        double large = build(1000000);
+        kept.clear();
+        std::string result = shared && isolated ? "shared until written" : "copied or leaked";
+        std::string expect = "shared until written";
+        std::cout << "Test 29. Structural sharing. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && small > 0 && large > 0 && large / small < 15) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Хранилище со сверткой: константы и тождества сворачиваются при построении, одинаковые листья - одна нода.
+        std::shared_ptr<NodeStore<double>> store = std::make_shared<NodeStore<double>>(true);
+        Expression<double> x("x", store), y("y", store), zero(0.0, store), one(1.0, store), two(2.0, store);
+        Expression<double> expr = (x * one + zero * y) * (two + two) + sin(zero) + (y ^ one) / one - exp(zero) * x;
+        std::string result = expr.to_string();
+        std::string expect = "x * 4 + y - x";
+        Expression<double> plain = construct_real("(x * 1 + 0 * y) * (2 + 2) + sin(0) + (y ^ 1) / 1 - exp(0) * x");
+        bool same = plain.simplify().to_string() == expect;
+        Expression<double> another = Expression<double>("x", store) * Expression<double>(4.0, store);
+        bool hashed = node_cast<Operation<double>>(node_cast<Operation<double>>(expr.head->next)->left)->left == another.head->next;
+        Expression<double> late = Expression<double>("z") + Expression<double>(3.0) * zero;
+        // Константы в хранилище различаются побитово: 0 и -0 - разные ноды, а NaN находит свою же ноду.
+        NodeStore<double> exact;
+        bool constants = exact.value(0.0) != exact.value(-0.0) && exact.value(std::nan("")) == exact.value(std::nan("")) && exact.size() == 3;
+        std::cout << "Test 30. Folding store. Original expression: (x * 1 + 0 * y) * (2 + 2) + sin(0) + (y ^ 1) / 1 - exp(0) * x\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && same && hashed && constants && late.to_string() == "z" && late.store == store) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Потоковое вычисление: записи в обоих форматах через временные файлы и разбор чисел без regex.
+        auto run_stream = [](auto expr, std::string input, StreamFormat format) {
+            FILE* in = tmpfile();
+            FILE* out = tmpfile();
+            std::fwrite(input.data(), 1, input.size(), in);
+            std::rewind(in);
+            stream_evaluate(expr, in, out, format);
+            std::string result(std::ftell(out), '\0');
+            std::rewind(out);
+            std::fread(result.data(), 1, result.size(), out);
+            std::fclose(in);
+            std::fclose(out);
+            return result;
+        };
+        std::string assignments = run_stream(construct_real("x ^ 2 + y"), "x=1 y=2\n\n x = 0.5 , y=-1e-3\r\ny=3 x=+2\n", StreamFormat::assignments);
+        std::string input = "y, x\n";
+        for (unsigned k = 0; k < 1000; k++) input += std::to_string(k) + " 2\n";
+        std::string many = run_stream(construct_real("x * y"), input, StreamFormat::columns);
+        bool counted = std::count(many.begin(), many.end(), '\n') == 1000 && many.substr(many.size() - 5) == "1998\n";
+        std::string complex_result = run_stream(construct_complex("z * z + i"), "z=1+i\nz=-i\nz=2.5e-1-0.5i\n", StreamFormat::assignments);
+        std::complex<double> number;
+        bool parsed = parse_number("1.5e+2-4i", number) && number == std::complex<double>(150, -4) && !parse_number("2x", number) &&
+            parse_number("i", number) && number == std::complex<double>(0, 1);
+        std::string result = assignments;
+        std::string expect = "3\n0.249\n7\n";
+        std::cout << "Test 31. Streaming evaluation. Original expression: x ^ 2 + y\nResult: " << result << "Expected result: " << expect << "Verdict: ";
+        if (result == expect && counted && complex_result == "3i\n(-1 + 1i)\n(-0.1875 + 0.75i)\n" && parsed) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Сервер вычислений: запросы подряд через сокет, ошибки возвращаются клиенту, повторные запросы берутся из memo,
+        // а выражение живет, пока не отпущены все полученные на него handle.
+        std::string path = "/tmp/sga_test_" + std::to_string(getpid()) + ".sock";
+        ExpressionServer server(path);
+        std::thread serving(&ExpressionServer::run, &server);
+        ExpressionClient client(path);
+        uint32_t handle = client.parse("x ^ 2 * y + 1");
+        bool memo = client.parse("x^2*y+1") == handle;
+        std::vector<double> values = client.eval(handle, {2, 3, 1, -1});
+        uint32_t derivative = client.diff(handle, "x");
+        memo = memo && client.diff(handle, "x") == derivative && server.size() == 2;
+        uint32_t reciprocal = client.parse("1 / y");
+        uint32_t negative_base = client.parse("(-2) ^ x");
+        std::string payload;
+        put_u32(payload, derivative);
+        put_u32(payload, 2);
+        put_double(payload, 3);
+        put_double(payload, 0.5);
+        std::vector<uint32_t> ids;
+        for (unsigned i = 0; i < 100; i++) ids.push_back(client.send(Command::eval, payload));
+        std::string bad;
+        put_string(bad, "x + * 2");
+        uint32_t bad_parse = client.send(Command::parse, bad);
+        std::string division;
+        put_u32(division, reciprocal);
+        put_string(division, "y");
+        put_double(division, 0);
+        uint32_t bad_substitute = client.send(Command::substitute, division);
+        std::string logarithm;
+        put_u32(logarithm, negative_base);
+        put_string(logarithm, "x");
+        uint32_t bad_diff = client.send(Command::diff, logarithm);
+        std::string unknown;
+        put_u32(unknown, 1000);
+        uint32_t bad_handle = client.send(Command::text, unknown);
+        bool ordered = true, errors = true;
+        uint32_t id;
+        Status status;
+        std::string result_payload;
+        for (uint32_t expected : ids) {
+            client.receive(id, status, result_payload);
+            double value;
+            std::memcpy(&value, result_payload.data(), 8);
+            ordered = ordered && id == expected && status == Status::ok && value == 3;
+        }
+        std::vector<std::string> messages;
+        for (uint32_t expected : {bad_parse, bad_substitute, bad_diff, bad_handle}) {
+            client.receive(id, status, result_payload);
+            errors = errors && id == expected && status == Status::error;
+            messages.push_back(result_payload);
+        }
+        errors = errors && messages[0] == "Non-algebraic expression! Met wrong symbol:*" && messages[1] == "Division by zero!" &&
+            messages[2] == "Logarithm of a negative value!" && messages[3] == "no such handle: 1000";
+        std::string text = client.text(derivative);
+        client.release(derivative);
+        bool shared = client.text(derivative) == text && server.size() == 4;
+        client.release(derivative);
+        memo = memo && shared && client.slots(handle) == std::vector<std::string>{"x", "y"} && server.size() == 3;
+        // Ответы на пачку запросов не помещаются в max_backlog, а клиент сразу после запросов закрывает свою сторону:
+        // сервер придерживает чтение, пока ответы не уйдут, отвечает на все кадры и только потом закрывает соединение.
+        uint32_t identity = client.parse("x");
+        std::string requests;
+        for (uint32_t k = 0; k < 1200; k++) {
+            std::string batch;
+            put_u32(batch, identity);
+            put_u32(batch, 512);
+            for (uint32_t i = 0; i < 512; i++) put_double(batch, k + i);
+            put_u32(requests, 5 + batch.size());
+            requests.push_back((char)Command::eval);
+            put_u32(requests, k);
+            requests += batch;
+        }
+        int raw = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        bool drained = connect(raw, (sockaddr*)&address, sizeof(address)) == 0;
+        std::thread writer([&]() {
+            for (std::size_t done = 0; done < requests.size();) {
+                ssize_t sent = ::send(raw, requests.data() + done, requests.size() - done, MSG_NOSIGNAL);
+                if (sent <= 0) break;
+                done += sent;
+            }
+            shutdown(raw, SHUT_WR);
+        });
+        std::string responses;
+        char chunk[1 << 16];
+        ssize_t got;
+        while ((got = recv(raw, chunk, sizeof(chunk), 0)) > 0) responses.append(chunk, got);
+        writer.join();
+        close(raw);
+        const std::size_t response_size = 9 + 512 * 8;
+        drained = drained && responses.size() == 1200 * response_size;
+        if (drained) {
+            FrameReader last(std::string_view(responses).substr(responses.size() - response_size));
+            drained = last.u32() == response_size - 4 && last.u8() == (uint8_t)Status::ok && last.u32() == 1199;
+            for (uint32_t i = 0; i < 511; i++) last.f64();
+            drained = drained && last.f64() == 1199 + 511 && last.finished();
+        }
+        server.stop();
+        serving.join();
+        std::string result = two_string(values[0]) + " " + two_string(values[1]) + ", d/dx = " + text;
+        std::string expect = "13 0, d/dx = 2x * y";
+        std::cout << "Test 32. Expression server. Original expression: x ^ 2 * y + 1\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && memo && ordered && errors && drained) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Двоичная запись: сохранение в файл и чтение через mmap для обоих типов, вычисление прямо по отображенной
+        // памяти и отказ на испорченном, обрезанном и чужом файле.
+        std::string original = "sin(x * y) ^ 2 + ln(x + 3) / y - exp(-x)";
+        Expression<double> expr = construct_real(original).differentiate("x");
+        std::string path = "/tmp/sga_test_" + std::to_string(getpid()) + ".sgax";
+        std::string blob = serialize(expr, "tag");
+        bool saved = write_file(path, blob);
+        ExpressionBlob<double> loaded(path);
+        std::vector<std::string> names = loaded.names();
+        std::vector<double> point;
+        for (const std::string &name : names) point.push_back(name == "x" ? 0.7 : 1.3);
+        std::vector<double> scratch(loaded.nodes_count);
+        bool same_value = std::abs(loaded.calculate(point.data(), scratch.data()) - expr.calculate(names, point)) < 1e-12;
+        bool same_flat = serialize(loaded.flat(), "tag") == blob && loaded.tag() == "tag";
+        Expression<std::complex<double>> complex_expr = construct_complex("(2 + 3i) * z ^ 2 - i * w");
+        std::string complex_blob = serialize(complex_expr);
+        ExpressionBlob<std::complex<double>> complex_loaded;
+        std::string error;
+        bool complex_ok = complex_loaded.attach(complex_blob, error) && complex_loaded.expand().to_string() == complex_expr.to_string();
+        ExpressionBlob<double> rejected;
+        std::string corrupted = blob;
+        corrupted[corrupted.size() / 2] ^= 1;
+        bool corrupt_error = !rejected.attach(corrupted, error) && error == "checksum mismatch";
+        std::string truncated = blob.substr(0, blob.size() - 4);
+        bool truncated_error = !rejected.attach(truncated, error) && error == "file size does not match its header";
+        bool type_error = !rejected.attach(complex_blob, error) && error == "file holds a complex expression";
+        bool missing_error = !rejected.open(path + ".missing", error);
+        std::remove(path.c_str());
+        std::string result = loaded.expand().to_string();
+        std::string expect = expr.to_string();
+        std::cout << "Test 33. Binary serialization. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && saved && same_value && same_flat && complex_ok && corrupt_error && truncated_error && type_error && missing_error) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Интервальное вычисление: границы содержат все значения на сетке, экстремумы sin и cos внутри интервала
+        // учитываются, а деление на ноль, логарифм и дробная степень отрицательного числа отмечаются без exit.
+        std::string original = "x ^ 2 * sin(y) + ln(x + 3) / (y ^ 2 + 1) - exp(-x) * cos(3y)";
+        Expression<double> expr = construct_real(original);
+        Interval<double> bounds = expr.calculate_interval({{"x", Interval<double>(-1, 2)}, {"y", Interval<double>(0.5, 4)}});
+        bool inside = bounds.faults == 0;
+        for (unsigned i = 0; i <= 100 && inside; i++) {
+            for (unsigned j = 0; j <= 100; j++) {
+                double x = -1 + 3.0 * i / 100, y = 0.5 + 3.5 * j / 100;
+                inside = inside && bounds.contains(expr.calculate({"x", "y"}, {x, y}));
+            }
+        }
+        auto bound = [](std::string text, std::map<std::string, Interval<double>> box) {
+            return construct_real(text).calculate_interval(box);
+        };
+        Interval<double> sine = bound("sin(x)", {{"x", Interval<double>(0.5, 2)}});
+        Interval<double> cosine = bound("cos(x)", {{"x", Interval<double>(-1, 1)}});
+        Interval<double> wide = bound("sin(x)", {{"x", Interval<double>(100, 107)}});
+        Interval<double> safe = bound("1 / (x ^ 2 + 1)", {{"x", Interval<double>(-5, 5)}});
+        Interval<double> pole = bound("1 / x", {{"x", Interval<double>(-1, 1)}});
+        Interval<double> logarithm = bound("ln(x)", {{"x", Interval<double>(-1, 2)}});
+        Interval<double> root = bound("x ^ 0.5", {{"x", Interval<double>(-1, 4)}});
+        Interval<double> power = bound("x ^ y", {{"x", Interval<double>(1, 4)}, {"y", Interval<double>(0.5, 1.5)}});
+        Interval<double> inverse_square = bound("x ^ (-2)", {{"x", Interval<double>(-1, 1)}});
+        // Дробный показатель через целое: (-3) ^ 2 = 9 и (-3) ^ 3 = -27 лежат в границах.
+        Interval<double> even = bound("x ^ y", {{"x", Interval<double>(-3, 1)}, {"y", Interval<double>(1.5, 2.5)}});
+        Interval<double> odd = bound("x ^ y", {{"x", Interval<double>(-3, 1)}, {"y", Interval<double>(2.5, 3.5)}});
+        bool flagged = safe.faults == 0 && pole.faults == Interval<double>::division && logarithm.faults == Interval<double>::logarithm &&
+            root.faults == Interval<double>::power && power.faults == 0 && inverse_square.faults == Interval<double>::division;
+        bool tight = wide.lower == -1 && wide.upper == 1 && std::abs(safe.lower - 1.0 / 26) < 1e-12 && safe.upper >= 1 && safe.upper < 1 + 1e-12 &&
+            std::abs(logarithm.upper - std::log(2)) < 1e-12 && std::isinf(logarithm.lower) && root.lower == 0 && std::abs(root.upper - 2) < 1e-12 &&
+            std::abs(power.lower - 1) < 1e-12 && std::abs(power.upper - 8) < 1e-12 && even.lower == 0 && even.contains(9) && even.upper < 9 + 1e-12 &&
+            odd.contains(-27) && odd.contains(1) && odd.lower > -27 - 1e-12 && even.faults == Interval<double>::power && odd.faults == Interval<double>::power;
+        std::string result = "sin: [" + two_string(sine.lower) + ", " + two_string(sine.upper) + "], cos: [" + two_string(cosine.lower) + ", " + two_string(cosine.upper) + "]";
+        std::string expect = "sin: [0.479425538604203, 1], cos: [0.54030230586814, 1]";
+        std::cout << "Test 34. Interval evaluation. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && inside && flagged && tight) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Пошаговый пересчет: после каждого изменения одной-двух переменных значение совпадает с полным вычислением,
+        // а пересчитываются только записи, зависящие от измененных переменных.
+        std::string original = "exp(a) * sin(b) + ln(c + 2) * a + cos(d) ^ 2 + b * c + exp(sin(d) * e) / (e ^ 2 + 1)";
+        Expression<double> expr = construct_real(original);
+        std::map<std::string, double> point = {{"a", 0.1}, {"b", 0.2}, {"c", 0.3}, {"d", 0.4}, {"e", 0.5}};
+        IncrementalEvaluator<double> evaluator(expr, point);
+        FlatExpression<double> flat = expr.flatten();
+        bool same = evaluator.value() == flat.calculate({"a", "b", "c", "d", "e"}, {0.1, 0.2, 0.3, 0.4, 0.5});
+        std::vector<std::string> vars = {"a", "b", "c", "d", "e"};
+        std::vector<double> vals = {0.1, 0.2, 0.3, 0.4, 0.5};
+        uint32_t slot_d = evaluator.slot("d");
+        for (unsigned step = 0; step < 500; step++) {
+            unsigned first = step % 5, second = (step * 3 + 1) % 5;
+            vals[first] += 0.01;
+            evaluator.set(vars[first], vals[first]);
+            if (step % 2) {
+                vals[second] -= 0.02;
+                evaluator.set(vars[second], vals[second]);
+            }
+            same = same && std::abs(evaluator.value() - flat.calculate(vars, vals)) < 1e-12;
+        }
+        uint64_t before = evaluator.recomputed;
+        evaluator.set(slot_d, 1.5);
+        vals[3] = 1.5;
+        double result_value = evaluator.value();
+        uint64_t d_path = evaluator.recomputed - before;
+        before = evaluator.recomputed;
+        evaluator.set("a", vals[0]);
+        bool untouched = evaluator.value() == result_value && evaluator.recomputed == before;
+        // 0.0 и -0.0 равны по ==, но 1 / x для них разный - смена знака нуля тоже пересчитывается.
+        IncrementalEvaluator<double> signed_zero(construct_real("1 / x + y"), {{"x", 0.0}, {"y", 1.0}});
+        bool positive = signed_zero.value() == std::numeric_limits<double>::infinity();
+        signed_zero.set("x", -0.0);
+        untouched = untouched && positive && signed_zero.value() == -std::numeric_limits<double>::infinity();
+        std::string result = two_string(result_value);
+        std::string expect = two_string(flat.calculate(vars, vals));
+        std::cout << "Test 35. Incremental evaluation. Original expression: " << original << "\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && same && untouched && d_path > 0 && d_path < flat.nodes.size() / 2) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+    {
+        // Разбор: приоритеты и ассоциативность, унарный минус, неявное умножение и комплексные литералы со скобками.
+        auto real = [](std::string text, std::vector<std::string> vars, std::vector<double> vals) {
+            return construct_real(text).calculate(vars, vals);
+        };
+        bool precedence = real("a - b * c", {"a", "b", "c"}, {10, 2, 3}) == 4 && real("a / b / c", {"a", "b", "c"}, {24, 2, 3}) == 4 &&
+            real("2 ^ 3 ^ 2", {}, {}) == 512 && real("-x ^ 2", {"x"}, {3}) == -9 && real("-2 * x + 1", {"x"}, {3}) == -5 &&
+            real("3x + 2", {"x"}, {4}) == 14 && real("2sin(x) - -1x", {"x"}, {0}) == 0;
+        Expression<double> product = construct_real("y * (ln(x) * sin(x))");
+        const Operation<double>* root = node_cast<Operation<double>>(product.head->next);
+        bool grouped = root->type == OperationType::mult && root->left->kind == NodeKind::var && root->right->kind == NodeKind::op &&
+            node_cast<Operation<double>>(root->right)->left->kind == NodeKind::func;
+        std::complex<double> z(0.5, 0.25);
+        Expression<std::complex<double>> literal = construct_complex("(8 - 6i) * z");
+        Expression<std::complex<double>> functions = construct_complex("cos(z) + exp(z) + ln(z)");
+        bool complex_ok = std::abs(literal.calculate({"z"}, {z}) - std::complex<double>(8, -6) * z) < 1e-12 &&
+            std::abs(functions.calculate({"z"}, {z}) - (std::cos(z) + std::exp(z) + std::log(z))) < 1e-12;
+        std::string result = functions.to_string();
+        std::string expect = "cos(z) + exp(z) + ln(z)";
+        std::cout << "Test 36. Parser precedence and literals. Original expression: cos(z) + exp(z) + ln(z)\nResult: " << result << "\n" << "Expected result: " << expect << "\n" << "Verdict: ";
+        if (result == expect && precedence && grouped && complex_ok) std::cout << "OK\n\n";
+        else std::cout << "FAIL\n\n";
+    }
+
+}